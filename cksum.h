@@ -0,0 +1,250 @@
+/*
+ * cksum.h - The internet checksum (RFC 1071), of data that comes in
+ *           more than one piece
+ *
+ * A packet is usually a header and a payload that live apart, and
+ * copying them together only to add them up costs more than the
+ * adding. cksum_add() adds one piece at a time to a running sum and
+ * cksum_iov() does a whole iovec, so the pieces stay where they are.
+ *
+ * One's complement addition doesn't care in what order or how wide it
+ * is done, or in which byte order, as long as every byte stays on its
+ * own side of its 16-bit word. So the words are added as they are in
+ * memory, 32 bits at a time into 64, and folded to 16 only at the end,
+ * which gives the checksum ready to be put in a header as is. A piece
+ * that starts at an odd offset has all its bytes on the wrong side;
+ * swapping the two bytes of its sum puts them right.
+ *
+ * The adding is done 32 or 16 bytes at a time with AVX2 or SSE2 when
+ * the CPU has it, which is found out the first time, and 8 at a time
+ * in plain C otherwise.
+ *
+ * This code is released into the P U B L I C  D O M A I N!
+ *
+ */
+
+#ifndef CKSUM_H
+#define CKSUM_H
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/uio.h> /* struct iovec */
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+	#define CKSUM_X86 1
+	#include <immintrin.h>
+#endif
+
+/* pieces shorter than this are not worth the vectors */
+#define CKSUM_MIN_VECTOR 128
+
+/* A checksum being added up; len is how much went in so far */
+struct Cksum
+{
+	uint64_t sum;
+	size_t len;
+};
+
+/* Adds the 16-bit words of p to s as they are in memory; good for
+ * 16 GB before s could overflow */
+static inline uint64_t cksum_words(const unsigned char * p, size_t len,
+	uint64_t s)
+{
+	uint64_t w;
+	uint32_t h;
+	uint16_t t;
+
+	while (len >= 8)
+	{
+		memcpy(&w, p, 8);
+		s += (uint32_t)w;
+		s += w >> 32;
+		p += 8;
+		len -= 8;
+	}
+
+	if (len >= 4)
+	{
+		memcpy(&h, p, 4);
+		s += h;
+		p += 4;
+		len -= 4;
+	}
+	if (len >= 2)
+	{
+		memcpy(&t, p, 2);
+		s += t;
+		p += 2;
+		len -= 2;
+	}
+	if (len > 0)
+	{
+		/* the last byte, padded with a zero after it */
+		t = 0;
+		memcpy(&t, p, 1);
+		s += t;
+	}
+
+	return s;
+}
+
+#if CKSUM_X86
+/* Each 32-bit word gets a 64-bit lane of its own, so nothing carries
+ * out of one */
+__attribute__((target("sse2")))
+static uint64_t cksum_sse2(const unsigned char * p, size_t len,
+	uint64_t s)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i a = zero, b = zero, v, u;
+	uint64_t lanes[2];
+
+	while (len >= 32)
+	{
+		v = _mm_loadu_si128((const __m128i *)p);
+		u = _mm_loadu_si128((const __m128i *)(p + 16));
+		a = _mm_add_epi64(a, _mm_unpacklo_epi32(v, zero));
+		b = _mm_add_epi64(b, _mm_unpackhi_epi32(v, zero));
+		a = _mm_add_epi64(a, _mm_unpacklo_epi32(u, zero));
+		b = _mm_add_epi64(b, _mm_unpackhi_epi32(u, zero));
+		p += 32;
+		len -= 32;
+	}
+
+	_mm_storeu_si128((__m128i *)lanes, _mm_add_epi64(a, b));
+	s += lanes[0];
+	s += lanes[1];
+
+	return cksum_words(p, len, s);
+}
+
+__attribute__((target("avx2")))
+static uint64_t cksum_avx2(const unsigned char * p, size_t len,
+	uint64_t s)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i a = zero, b = zero, v, u;
+	uint64_t lanes[4];
+
+	while (len >= 64)
+	{
+		v = _mm256_loadu_si256((const __m256i *)p);
+		u = _mm256_loadu_si256((const __m256i *)(p + 32));
+		a = _mm256_add_epi64(a, _mm256_unpacklo_epi32(v, zero));
+		b = _mm256_add_epi64(b, _mm256_unpackhi_epi32(v, zero));
+		a = _mm256_add_epi64(a, _mm256_unpacklo_epi32(u, zero));
+		b = _mm256_add_epi64(b, _mm256_unpackhi_epi32(u, zero));
+		p += 64;
+		len -= 64;
+	}
+
+	_mm256_storeu_si256((__m256i *)lanes, _mm256_add_epi64(a, b));
+	s += lanes[0];
+	s += lanes[1];
+	s += lanes[2];
+	s += lanes[3];
+
+	return cksum_words(p, len, s);
+}
+#endif
+
+static uint64_t cksum_pick(const unsigned char * p, size_t len,
+	uint64_t s);
+
+/* The kernel for long pieces. Every thread that finds out which one it
+ * is stores the same thing, so they may as well race */
+static uint64_t (*cksum_kernel)(const unsigned char *, size_t, uint64_t) =
+	cksum_pick;
+
+static uint64_t cksum_pick(const unsigned char * p, size_t len,
+	uint64_t s)
+{
+	cksum_kernel = cksum_words;
+
+	#if CKSUM_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+	{
+		cksum_kernel = cksum_avx2;
+	}
+	else if (__builtin_cpu_supports("sse2"))
+	{
+		cksum_kernel = cksum_sse2;
+	}
+	#endif
+
+	return cksum_kernel(p, len, s);
+}
+
+/* Folds a sum down to its 16 bits */
+static inline uint16_t cksum_fold(uint64_t s)
+{
+	s = (s & 0xffffffff) + (s >> 32);
+	s = (s & 0xffffffff) + (s >> 32);
+	s = (s & 0xffff) + (s >> 16);
+	s = (s & 0xffff) + (s >> 16);
+
+	return (uint16_t)s;
+}
+
+static inline void cksum_init(struct Cksum * c)
+{
+	c->sum = 0;
+	c->len = 0;
+}
+
+/* Adds the next len bytes of the data to c */
+static inline void cksum_add(struct Cksum * c, const void * buf,
+	size_t len)
+{
+	uint64_t s;
+
+	if (len < CKSUM_MIN_VECTOR)
+	{
+		s = cksum_words(buf, len, 0);
+	}
+	else
+	{
+		s = cksum_kernel(buf, len, 0);
+	}
+
+	if (c->len & 1)
+	{
+		s = cksum_fold(s);
+		s = (uint16_t)(s << 8 | s >> 8);
+	}
+
+	c->sum += s;
+	c->len += len;
+}
+
+/* The checksum of everything added to c, to be stored as is */
+static inline uint16_t cksum_final(const struct Cksum * c)
+{
+	return (uint16_t)~cksum_fold(c->sum);
+}
+
+static inline uint16_t cksum_iov(const struct iovec * iov, int iovcnt)
+{
+	struct Cksum c;
+
+	cksum_init(&c);
+	for (int i = 0; i < iovcnt; i++)
+	{
+		cksum_add(&c, iov[i].iov_base, iov[i].iov_len);
+	}
+
+	return cksum_final(&c);
+}
+
+static inline uint16_t cksum(const void * buf, size_t len)
+{
+	struct Cksum c;
+
+	cksum_init(&c);
+	cksum_add(&c, buf, len);
+
+	return cksum_final(&c);
+}
+
+#endif
@@ -0,0 +1,266 @@
+/*
+ * cksumbench.c - Checks the checksums of cksum.h, and measures them
+ *                against the one icmpmys used to have
+ *
+ * usage: cksumbench [-m megabytes]
+ *
+ * First every kernel is checked against a byte at a time checksum,
+ * for every length up to a few KB and every alignment, and cksum_iov()
+ * with the data cut into random pieces, odd ones too. Then an echo
+ * request of a few sizes, as a header and a payload apart, is summed
+ * until -m megabytes (256 by default) went through: once the old way,
+ * copying it all into a buffer on the stack and adding 16 bits at a
+ * time, and once with cksum_iov() for each kernel the CPU has.
+ *
+ * compile with: cc -O2 cksumbench.c -o cksumbench
+ *
+ * This code is released into the P U B L I C  D O M A I N!
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <netinet/in.h> /* IP_MAXPACKET */
+#include <netinet/ip_icmp.h> /* struct icmp */
+#include <arpa/inet.h>
+
+#include "cksum.h"
+
+#define CHECK_LEN 4096 /* longest length checked */
+#define CHECK_SPLITS 100000 /* random iovecs checked */
+#define MAX_PIECES 8
+
+typedef uint64_t (*kernel_fn)(const unsigned char *, size_t, uint64_t);
+
+struct Kernel {
+	const char * name;
+	kernel_fn fn;
+	int ok; /* the CPU has it */
+};
+
+struct Kernel kernels[] = {
+	{ "words", cksum_words, 1 },
+#if CKSUM_X86
+	{ "sse2", cksum_sse2, 0 },
+	{ "avx2", cksum_avx2, 0 },
+#endif
+};
+#define NKERNELS (sizeof(kernels) / sizeof(kernels[0]))
+
+/* the payload sizes timed; with the 8 byte header on top */
+size_t sizes[] = { 0, 56, 248, 1472, 8992, 65000 };
+#define NSIZES (sizeof(sizes) / sizeof(sizes[0]))
+
+/* seconds since some point, for timing */
+double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* What icmpmys did before cksum.h, as it was */
+uint16_t old_checksum(uint16_t * b, size_t len)
+{
+	uint32_t sum = 0;
+
+	while (len > 1) {
+		sum += *(b++);
+		len -= 2;
+	}
+
+	if (len > 0)
+		sum += *((uint8_t *)b);
+
+	sum = (sum >> 0x10) + (sum & 0xffff);
+	sum += (sum >> 0x10);
+
+	return (uint16_t)(~sum);
+}
+
+uint16_t old_icmp4_checksum(struct icmp icmphdr, const uint8_t * payload,
+	size_t payloadlen)
+{
+	char buf[IP_MAXPACKET];
+	char * p = buf;
+
+	memcpy(p, &icmphdr.icmp_type, 1); p++;
+	memcpy(p, &icmphdr.icmp_code, 1); p++;
+	*p = 0; p++;
+	*p = 0; p++;
+	memcpy(p, &icmphdr.icmp_id, 2); p += 2;
+	memcpy(p, &icmphdr.icmp_seq, 2); p += 2;
+	memcpy(p, payload, payloadlen);
+	p += payloadlen;
+
+	return old_checksum((uint16_t *)buf, p - buf);
+}
+
+/* RFC 1071 straight from the book, a big endian word at a time */
+uint16_t slow_checksum(const unsigned char * p, size_t len)
+{
+	uint32_t sum = 0;
+
+	for (size_t i = 0; i < len; i += 2)
+		sum += p[i] << 8 | (i + 1 < len ? p[i + 1] : 0);
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+
+	return htons((uint16_t)~sum);
+}
+
+int check(void)
+{
+	unsigned char * data = malloc(CHECK_LEN + 64);
+	struct iovec iov[MAX_PIECES];
+	int failed = 0;
+
+	if (data == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	for (size_t i = 0; i < CHECK_LEN + 64; i++)
+		data[i] = rand();
+	/* a lot of 0xff makes the carries count */
+	memset(data + CHECK_LEN / 2, 0xff, CHECK_LEN / 4);
+
+	for (size_t k = 0; k < NKERNELS; k++) {
+		if (!kernels[k].ok)
+			continue;
+		for (size_t len = 0; len <= CHECK_LEN; len++) {
+			for (size_t off = 0; off < 64; off += len < 256 ? 1 : 31) {
+				uint16_t want = slow_checksum(data + off, len);
+				uint16_t got = ~cksum_fold(
+					kernels[k].fn(data + off, len, 0));
+
+				if (got != want && failed++ < 10)
+					printf("%s: %zu bytes at +%zu: %04x, "
+						"not %04x\n", kernels[k].name, len, off,
+						got, want);
+			}
+		}
+	}
+
+	for (int n = 0; n < CHECK_SPLITS; n++) {
+		size_t len = rand() % CHECK_LEN;
+		size_t off = rand() % 64, at = 0;
+		int pieces = 0;
+		uint16_t want = slow_checksum(data + off, len);
+		uint16_t got;
+
+		while (at < len && pieces < MAX_PIECES - 1) {
+			size_t l = rand() % (len - at + 1);
+
+			/* short and odd pieces are the interesting ones */
+			if (rand() & 1)
+				l %= 8;
+			iov[pieces].iov_base = data + off + at;
+			iov[pieces].iov_len = l;
+			pieces++;
+			at += l;
+		}
+		iov[pieces].iov_base = data + off + at;
+		iov[pieces].iov_len = len - at;
+		pieces++;
+
+		got = cksum_iov(iov, pieces);
+		if (got != want && failed++ < 10)
+			printf("%zu bytes in %d pieces: %04x, not %04x\n", len,
+				pieces, got, want);
+	}
+
+	printf("%s\n", failed ? "FAILED" : "ok");
+	free(data);
+
+	return failed;
+}
+
+int main(int argc, char **argv)
+{
+	size_t megabytes = 256;
+	unsigned char * payload = malloc(IP_MAXPACKET);
+	struct icmp hdr;
+	struct iovec iov[2];
+	volatile uint16_t sink;
+	double t, old;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "m:")) != -1) {
+		switch (opt) {
+			case 'm': megabytes = strtoul(optarg, NULL, 10); break;
+			default:
+				fprintf(stderr, "Usage: %s [-m megabytes]\n", argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+
+	if (payload == NULL || megabytes == 0) {
+		fprintf(stderr, "Usage: %s [-m megabytes]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+#if CKSUM_X86
+	__builtin_cpu_init();
+	kernels[1].ok = __builtin_cpu_supports("sse2");
+	kernels[2].ok = __builtin_cpu_supports("avx2");
+#endif
+
+	if (check())
+		return EXIT_FAILURE;
+
+	for (size_t i = 0; i < IP_MAXPACKET; i++)
+		payload[i] = rand();
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.icmp_type = ICMP_ECHO;
+	hdr.icmp_id = htons(12345);
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = ICMP_MINLEN;
+	iov[1].iov_base = payload;
+
+	printf("bytes\told ns\tMB/s");
+	for (size_t k = 0; k < NKERNELS; k++)
+		if (kernels[k].ok)
+			printf("\t%s ns\tMB/s", kernels[k].name);
+	printf("\n");
+
+	for (size_t s = 0; s < NSIZES; s++) {
+		size_t len = ICMP_MINLEN + sizes[s];
+		uint64_t rounds = (megabytes << 20) / len;
+
+		iov[1].iov_len = sizes[s];
+
+		t = now();
+		for (uint64_t r = 0; r < rounds; r++) {
+			hdr.icmp_seq = r;
+			sink = old_icmp4_checksum(hdr, payload, sizes[s]);
+		}
+		old = (now() - t) * 1e9 / rounds;
+		printf("%zu\t%.1f\t%.0f", len, old, len * 1e3 / old);
+
+		for (size_t k = 0; k < NKERNELS; k++) {
+			if (!kernels[k].ok)
+				continue;
+			cksum_kernel = kernels[k].fn;
+
+			t = now();
+			for (uint64_t r = 0; r < rounds; r++) {
+				hdr.icmp_seq = r;
+				sink = cksum_iov(iov, 2);
+			}
+			t = (now() - t) * 1e9 / rounds;
+			printf("\t%.1f\t%.0f", t, len * 1e3 / t);
+		}
+		printf("\n");
+	}
+	(void)sink;
+
+	free(payload);
+
+	return 0;
+}
@@ -0,0 +1,116 @@
+/*
+ * hist.h - Log-bucketed histograms, for latencies and sizes
+ *
+ * Buckets double in size every HIST_SUB buckets, like HdrHistogram,
+ * so a histogram covers anything that fits 64 bits with about 6%
+ * error in a fixed 8 KB, and adding to it is a few instructions.
+ * tcpproxy keeps its stats in these, and tpreplay and qotdload their
+ * latencies, so their numbers mean the same thing.
+ *
+ * A histogram has one writer. The counts are updated with relaxed
+ * atomic loads and stores, no locked instructions, so anyone else can
+ * read or hist_merge() it while it is being written; a count read a
+ * moment late is all that can go wrong.
+ *
+ * This code is released into the P U B L I C  D O M A I N!
+ *
+ */
+
+#ifndef HIST_H
+#define HIST_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define HIST_SUB 16 /* linear steps per power of 2 */
+#define HIST_LEN (64 * HIST_SUB)
+
+struct Hist
+{
+	uint64_t counts[HIST_LEN];
+	uint64_t n;
+	uint64_t max;
+};
+
+/* the bucket v goes in */
+static inline int hist_index(uint64_t v)
+{
+	int e;
+
+	if (v < HIST_SUB)
+		return v;
+
+	e = 63 - __builtin_clzll(v); /* highest bit, at least 4 */
+
+	return (e - 3) * HIST_SUB + ((v >> (e - 4)) & (HIST_SUB - 1));
+}
+
+/* the lowest value that goes in bucket i */
+static inline uint64_t hist_value(int i)
+{
+	if (i < HIST_SUB)
+		return i;
+
+	return (uint64_t)(HIST_SUB + i % HIST_SUB) << (i / HIST_SUB - 1);
+}
+
+/* one more v in h, negative ones count as 0 */
+static inline void hist_add(struct Hist * h, int64_t v)
+{
+	uint64_t * c;
+
+	if (v < 0)
+		v = 0;
+
+	c = &h->counts[hist_index(v)];
+	__atomic_store_n(c, __atomic_load_n(c, __ATOMIC_RELAXED) + 1,
+		__ATOMIC_RELAXED);
+	__atomic_store_n(&h->n, __atomic_load_n(&h->n, __ATOMIC_RELAXED) + 1,
+		__ATOMIC_RELAXED);
+
+	if ((uint64_t)v > __atomic_load_n(&h->max, __ATOMIC_RELAXED))
+		__atomic_store_n(&h->max, v, __ATOMIC_RELAXED);
+}
+
+/* adds the counts of h to sum, which only we write */
+static inline void hist_merge(struct Hist * sum, const struct Hist * h)
+{
+	uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+
+	for (int i = 0; i < HIST_LEN; i++)
+		sum->counts[i] += __atomic_load_n(&h->counts[i], __ATOMIC_RELAXED);
+
+	sum->n += __atomic_load_n(&h->n, __ATOMIC_RELAXED);
+	if (max > sum->max)
+		sum->max = max;
+}
+
+/* the value below which a fraction q of h lies, never more than the
+ * largest one that went in */
+static inline uint64_t hist_quantile(const struct Hist * h, double q)
+{
+	uint64_t seen = 0, rank = (uint64_t)(q * h->n);
+
+	for (int i = 0; i < HIST_LEN; i++) {
+		seen += h->counts[i];
+
+		if (seen > rank)
+			return hist_value(i) < h->max ? hist_value(i) : h->max;
+	}
+
+	return h->max;
+}
+
+static inline void hist_print(FILE * f, const char * name,
+	const struct Hist * h)
+{
+	fprintf(f, "%-18s n %-10llu p50 %-8llu p90 %-8llu p99 %-8llu p99.9 %-8llu max %llu\n",
+		name, (unsigned long long)h->n,
+		(unsigned long long)hist_quantile(h, 0.5),
+		(unsigned long long)hist_quantile(h, 0.9),
+		(unsigned long long)hist_quantile(h, 0.99),
+		(unsigned long long)hist_quantile(h, 0.999),
+		(unsigned long long)h->max);
+}
+
+#endif
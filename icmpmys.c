@@ -3,6 +3,22 @@
  *             the internet using ICMPv6 over IPv6 or ICMP over IPv4
  * 
  * 
+ * usage: icmpmys [-p] <hostname>
+ * Every line typed is sent to hostname as an echo request, and the
+ * echo reply its kernel answers with says it got there. Up to WINDOW
+ * lines are on their way at once, so piping a file in doesn't wait a
+ * round trip for every line. One that isn't answered within the
+ * retransmit timeout is sent again, up to MAX_TRIES times; the timeout
+ * follows the round trip times measured, as TCP does it (RFC 6298).
+ * Lines that come in more than once, because the reply to them got
+ * lost, are only printed once.
+ * 
+ * The kernel only hands us echo requests and replies, the rest of the
+ * ICMP on the host is dropped before it is copied to us. -p only lets
+ * through what comes from hostname, and of the echo replies only those
+ * to our own requests, so a busy host doesn't wake us for anyone else's
+ * pings either.
+ * 
  * Copyright 2017 job <job@function1.nl>
  * 
  * Permission to use, copy, modify, and/or distribute this software for
@@ -37,6 +53,12 @@
 #include <netinet/in.h> /* IP_MAXPACKET, other IP stuff */
 #include <netdb.h> /* getaddrinfo() */
 #include <arpa/inet.h> /* inet_ntop() */
+#include <errno.h>
+#include <poll.h>
+#include <time.h> /* clock_gettime() */
+#include <linux/filter.h> /* classic BPF */
+
+#include "cksum.h"
 
 #if IPV4
 	#include <netinet/ip_icmp.h> /* struct icmp */
@@ -45,6 +67,52 @@
 #endif
 
 #define MAX_PACKET_LEN 2048
+#define MAX_MSG_LEN 1024 /* longer lines are sent in pieces */
+
+#define WINDOW 64 /* messages on their way at once */
+#define MAX_TRIES 8 /* sends before a message counts as lost */
+#define RTO_INIT 1000.0 /* ms, until a round trip was measured */
+#define RTO_MIN 200.0 /* ms; RFC 6298 says 1 s, a chat can be quicker */
+#define RTO_MAX 60000.0
+
+#define RECV_WINDOW 1024 /* seqs per sender remembered to spot resends */
+#define MAX_SENDERS 16 /* senders remembered */
+
+/* A message sent and not acknowledged yet */
+struct Pending
+{
+	int in_use;
+	uint16_t seq;
+	int tries;
+	double sent; /* ms, the last time it was */
+	double deadline; /* ms, when it is sent again */
+	size_t len;
+	char msg[MAX_MSG_LEN];
+};
+
+/* The messages on their way, seq % WINDOW each, and what the round
+ * trip time is thought to be */
+struct Sender
+{
+	struct Pending pending[WINDOW];
+	uint16_t base; /* oldest seq still on its way */
+	uint16_t next; /* seq of the next new message */
+	double srtt, rttvar; /* ms, srtt is 0 until measured */
+	double rto; /* ms */
+	int backoff; /* times rto doubles, since the last round trip
+	              * that could be measured */
+};
+
+/* The echo requests that came in from one sender, to tell a resent one
+ * apart. Bit seq % RECV_WINDOW is set for the seqs up to top seen */
+struct Seen
+{
+	int in_use;
+	unsigned char addr[16];
+	uint16_t id;
+	uint16_t top;
+	uint64_t bits[RECV_WINDOW / 64];
+};
 
 
 void ferr(const char* msg)
@@ -190,96 +258,433 @@ void * getinaddr(const struct sockaddr *sa)
 	return &(((struct sockaddr_in6*)sa)->sin6_addr); /* IPv6 */
 }
 
-#if IPV4
-/* Computes the standard internet checksum (RFC 1071) */
-/* Using stupid types because I don't know if I can trust the compiler */
-uint16_t checksum(uint16_t * b, size_t len)
+/* Has the kernel drop every packet sock would get that isn't an echo
+ * request or reply, so we are not woken up for it. With only_peer,
+ * also those that don't come from peer, and echo replies that don't
+ * carry id. Whatever came in before that is thrown away too */
+void attach_filter(int sock, const struct sockaddr * peer, uint16_t id,
+	int only_peer)
 {
-	/*register*/ uint32_t sum = 0;
+	struct sock_filter code[16];
+	struct sock_fprog prog;
+	unsigned short len = 0;
+	char packet[MAX_PACKET_LEN];
+	
+	#if IPV4
+	/* a raw IPv4 socket gets the IP header too, X = its length */
+	code[len++] = (struct sock_filter)BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0);
+	code[len++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_B | BPF_IND, 0);
+	
+	if (!only_peer)
+	{
+		/* if (type == echo || type == echo reply) pass; else drop; */
+		code[len++] = (struct sock_filter)BPF_JUMP(
+			BPF_JMP | BPF_JEQ | BPF_K, ICMP_ECHO, 1, 0);
+		code[len++] = (struct sock_filter)BPF_JUMP(
+			BPF_JMP | BPF_JEQ | BPF_K, ICMP_ECHOREPLY, 0, 1);
+	}
+	else
+	{
+		uint32_t addr = ntohl(
+			((const struct sockaddr_in *)peer)->sin_addr.s_addr);
+		
+		/* echo goes straight to the address check, echo reply
+		 * has to have our id first */
+		code[len++] = (struct sock_filter)BPF_JUMP(
+			BPF_JMP | BPF_JEQ | BPF_K, ICMP_ECHO, 3, 0);
+		code[len++] = (struct sock_filter)BPF_JUMP(
+			BPF_JMP | BPF_JEQ | BPF_K, ICMP_ECHOREPLY, 0, 5);
+		code[len++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_H | BPF_IND, 4);
+		code[len++] = (struct sock_filter)BPF_JUMP(
+			BPF_JMP | BPF_JEQ | BPF_K, id, 0, 3);
+		
+		/* the source address */
+		code[len++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 12);
+		code[len++] = (struct sock_filter)BPF_JUMP(
+			BPF_JMP | BPF_JEQ | BPF_K, addr, 0, 1);
+	}
+	#else
+	/* the kernel drops the other types before the filter even runs,
+	 * that's cheaper still */
+	struct icmp6_filter types;
+	
+	ICMP6_FILTER_SETBLOCKALL(&types);
+	ICMP6_FILTER_SETPASS(ICMP6_ECHO_REQUEST, &types);
+	ICMP6_FILTER_SETPASS(ICMP6_ECHO_REPLY, &types);
+	if (setsockopt(sock, IPPROTO_ICMPV6, ICMP6_FILTER, &types,
+		sizeof(types)) < 0)
+	{
+		perror("setsockopt failed while setting ICMP6_FILTER");
+	}
+	
+	/* a raw IPv6 socket gets what comes after the IPv6 header */
+	code[len++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 0);
+	
+	if (!only_peer)
+	{
+		code[len++] = (struct sock_filter)BPF_JUMP(
+			BPF_JMP | BPF_JEQ | BPF_K, ICMP6_ECHO_REQUEST, 1, 0);
+		code[len++] = (struct sock_filter)BPF_JUMP(
+			BPF_JMP | BPF_JEQ | BPF_K, ICMP6_ECHO_REPLY, 0, 1);
+	}
+	else
+	{
+		const uint8_t * a =
+			((const struct sockaddr_in6 *)peer)->sin6_addr.s6_addr;
+		
+		code[len++] = (struct sock_filter)BPF_JUMP(
+			BPF_JMP | BPF_JEQ | BPF_K, ICMP6_ECHO_REQUEST, 3, 0);
+		code[len++] = (struct sock_filter)BPF_JUMP(
+			BPF_JMP | BPF_JEQ | BPF_K, ICMP6_ECHO_REPLY, 0, 11);
+		code[len++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 4);
+		code[len++] = (struct sock_filter)BPF_JUMP(
+			BPF_JMP | BPF_JEQ | BPF_K, id, 0, 9);
+		
+		/* the source address, 4 bytes at a time, out of the IPv6
+		 * header the kernel still has */
+		for (int i = 0; i < 4; i++)
+		{
+			code[len++] = (struct sock_filter)BPF_STMT(
+				BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 8 + 4 * i);
+			code[len++] = (struct sock_filter)BPF_JUMP(
+				BPF_JMP | BPF_JEQ | BPF_K,
+				(uint32_t)a[4 * i] << 24 | a[4 * i + 1] << 16 |
+				a[4 * i + 2] << 8 | a[4 * i + 3], 0, 7 - 2 * i);
+		}
+	}
+	#endif
+	
+	code[len++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0xffffffff);
+	code[len++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0);
 	
-	/* Sum pairs of bytes until none or one byte left */
-	while (len > 1)
+	prog.len = len;
+	prog.filter = code;
+	
+	if (setsockopt(sock, SOL_SOCKET, SO_ATTACH_FILTER, &prog,
+		sizeof(prog)) < 0)
 	{
-		sum += *(b++);
-		len -= 2;
+		/* not the end of the world, we skip them ourselves too */
+		perror("setsockopt failed while setting SO_ATTACH_FILTER");
+		return;
 	}
 	
-	/* Add left-over byte, if any */
-	if (len > 0)
-		sum += *((uint8_t *)b);
+	/* what got in before the filter was there */
+	while (recv(sock, packet, sizeof(packet), MSG_DONTWAIT) >= 0 ||
+		errno == EINTR)
+	{
+	}
+}
 
 
-#if 1 == 1
-	/* Fold the 4 byte sum into 2 bytes
-	   sum = lower 2 bytes + upper 2 bytes */
-	sum = (sum >> 0x10) + (sum & 0xffff);
-	/* Add carry, if any */
-	sum += (sum >> 0x10);
-#else
-	/* Another way of writing this: */
+/* Milliseconds since some point, for timing */
+double now_ms(void)
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
 
-	while (sum >> 0x10) {
-		sum = (sum & 0xffff) + (sum >> 0x10);
+/* Sends m as an echo request, for the first time or again */
+void send_message(int sock, const struct addrinfo * p, uint16_t id,
+	struct Pending * m)
+{
+	#if IPV4
+	struct icmp hdr;
+	#else
+	struct icmp6_hdr hdr;
+	#endif
+	struct iovec iov[2];
+	struct msghdr mh;
+	ssize_t r;
+	
+	memset(&hdr, 0, sizeof(hdr));
+	
+	#if IPV4
+	/* Craft ICMP header */
+	hdr.icmp_type = ICMP_ECHO;
+	hdr.icmp_code = 0;
+	hdr.icmp_cksum = 0; /* Will NOT be computed by the IP stack */
+	hdr.icmp_id = htons(id);
+	hdr.icmp_seq = htons(m->seq);
+	#else
+	/* Craft ICMPv6 header */
+	hdr.icmp6_type = ICMP6_ECHO_REQUEST;
+	hdr.icmp6_code = 0;
+	hdr.icmp6_cksum = 0; /* Will be calculated by the IP stack */
+	hdr.icmp6_id = htons(id);
+	hdr.icmp6_seq = htons(m->seq);
+	#endif
+	
+	/* the header and the message go out from where they are */
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = m->msg;
+	iov[1].iov_len = m->len;
+	
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_name = p->ai_addr;
+	mh.msg_namelen = p->ai_addrlen;
+	mh.msg_iov = iov;
+	mh.msg_iovlen = 2;
+	
+	#if IPV4
+	hdr.icmp_cksum = cksum_iov(iov, 2);
+	#endif
+	
+	if (m->tries == 0)
+	{
+		print_icmphdrinfo(&hdr);
+	}
+	
+	/* I think the max packet length of sendto is around 0xffff */
+	r = sendmsg(sock, &mh, 0);
+	
+	/* a full socket buffer is a lost packet like any other, it is
+	 * sent again when it times out */
+	if (r < 0)
+	{
+		perror("sendmsg");
+	}
+	else if (m->tries == 0)
+	{
+		printf("Sent %zd bytes(msglen: %zu, hdrsize: %zu)\n",
+			r, m->len, sizeof(hdr));
+	}
+	else
+	{
+		printf("Resent message %d (try %d)\n", m->seq, m->tries + 1);
 	}
-#endif
 	
-	/* ~ is bitwise NOT, or the one's complement */
-	return (uint16_t)(~sum);
+	m->tries++;
+	m->sent = now_ms();
 }
 
-/* Computes an IPv4 ICMP checksum 
- * will crash if you feed it REALLY large packets (above 65535 bytes)
- * that shouldn't be allowed */
-uint16_t icmp4_checksum(struct icmp icmphdr, const uint8_t * payload,
-	size_t payloadlen)
+/* Takes in a round trip time measured, in ms (RFC 6298 2.2, 2.3) */
+void rtt_sample(struct Sender * s, double rtt)
 {
-	char buf[IP_MAXPACKET /* 65535 */];
-	char * p;
-	size_t cksumlen = 0;
-	
-	p = &buf[0];
-	
-	/* Copy type to buf (1 byte) */
-	memcpy(p, &icmphdr.icmp_type, sizeof(icmphdr.icmp_type));
-	p += sizeof(icmphdr.icmp_type);
-	cksumlen += sizeof(icmphdr.icmp_type);
-	
-	/* Copy code to buf (1 byte) */
-	memcpy(p, &icmphdr.icmp_code, sizeof(icmphdr.icmp_code));
-	p += sizeof(icmphdr.icmp_code);
-	cksumlen += sizeof(icmphdr.icmp_code);
-	
-	/* Copy checksum to buf (2 bytes), but it's not known, so 0
-	 * according to RFC 792 */
-	*p = 0; p++;
-	*p = 0; p++;
-	cksumlen += 2;
-	
-	/* Copy identifier to buf (2 bytes) */
-	memcpy(p, &icmphdr.icmp_id, sizeof(icmphdr.icmp_id));
-	p += sizeof(icmphdr.icmp_id);
-	cksumlen += sizeof(icmphdr.icmp_id);
-	
-	/* Copy seq to buf (2 bytes) */
-	memcpy(p, &icmphdr.icmp_seq, sizeof(icmphdr.icmp_seq));
-	p += sizeof(icmphdr.icmp_seq);
-	cksumlen += sizeof(icmphdr.icmp_seq);
-	
-	/* Copy payload */
-	memcpy(p, payload, payloadlen);
-	p += payloadlen;
-	cksumlen += payloadlen;
-	
-	return checksum((uint16_t *)buf, cksumlen);
+	double d;
+	
+	if (s->srtt == 0)
+	{
+		s->srtt = rtt;
+		s->rttvar = rtt / 2;
+	}
+	else
+	{
+		d = s->srtt - rtt;
+		if (d < 0)
+		{
+			d = -d;
+		}
+		s->rttvar = 0.75 * s->rttvar + 0.25 * d;
+		s->srtt = 0.875 * s->srtt + 0.125 * rtt;
+	}
+	
+	s->backoff = 0;
+	
+	/* the clock ticks in about a ms */
+	s->rto = s->srtt + (4 * s->rttvar > 1 ? 4 * s->rttvar : 1);
+	if (s->rto < RTO_MIN)
+	{
+		s->rto = RTO_MIN;
+	}
+	if (s->rto > RTO_MAX)
+	{
+		s->rto = RTO_MAX;
+	}
+}
+
+/* How long to wait for m to be answered before sending it again. A
+ * resend waits twice as long as the send before it (RFC 6298 5.5), and
+ * a new message as long as the last one resent, until a round trip
+ * measured says otherwise */
+double wait_for(const struct Sender * s, const struct Pending * m)
+{
+	int doubles = m->tries - 1 > s->backoff ? m->tries - 1 : s->backoff;
+	double w = s->rto;
+	
+	while (doubles-- > 0 && w < RTO_MAX)
+	{
+		w *= 2;
+	}
+	
+	return w < RTO_MAX ? w : RTO_MAX;
+}
+
+/* Moves base past the messages that are done with */
+void slide_window(struct Sender * s)
+{
+	while (s->base != s->next && !s->pending[s->base % WINDOW].in_use)
+	{
+		s->base++;
+	}
+}
+
+/* An echo reply to one of ours came in */
+void acknowledge(struct Sender * s, uint16_t seq)
+{
+	struct Pending * m = &s->pending[seq % WINDOW];
+	double rtt;
+	
+	/* not on its way (any more), a resent one answered twice */
+	if (!m->in_use || m->seq != seq)
+	{
+		return;
+	}
+	
+	rtt = now_ms() - m->sent;
+	
+	/* which of the sends this answers isn't known for one that was
+	 * resent, so only the others say what the round trip is (Karn) */
+	if (m->tries == 1)
+	{
+		rtt_sample(s, rtt);
+	}
+	
+	printf("Message %d acknowledged! (%.1f ms, rto %.0f ms)\n", seq, rtt,
+		s->rto);
+	
+	m->in_use = 0;
+	slide_window(s);
+}
+
+/* Sends again what timed out, or gives up on it. Returns the ms until
+ * the next one does, -1 if nothing is on its way */
+int retransmit(int sock, const struct addrinfo * p, uint16_t id,
+	struct Sender * s)
+{
+	struct Pending * m;
+	double now = now_ms();
+	double next = -1;
+	
+	for (uint16_t seq = s->base; seq != s->next; seq++)
+	{
+		m = &s->pending[seq % WINDOW];
+		if (!m->in_use)
+		{
+			continue;
+		}
+		
+		if (m->deadline <= now)
+		{
+			if (m->tries >= MAX_TRIES)
+			{
+				printf("Message %d lost!\n", seq);
+				m->in_use = 0;
+				continue;
+			}
+			
+			if (s->backoff < m->tries)
+			{
+				s->backoff = m->tries;
+			}
+			
+			send_message(sock, p, id, m);
+			m->deadline = m->sent + wait_for(s, m);
+		}
+		
+		if (next < 0 || m->deadline < next)
+		{
+			next = m->deadline;
+		}
+	}
+	
+	slide_window(s);
+	
+	if (next < 0)
+	{
+		return -1;
+	}
+	
+	return next > now ? (int)(next - now) + 1 : 0;
 }
-#endif
 
+/* Whether an echo request from addr with id and seq came in before;
+ * marks it as come in if it didn't */
+int seen_before(struct Seen * seen, const void * addr, size_t addrlen,
+	uint16_t id, uint16_t seq)
+{
+	static int evict = 0;
+	struct Seen * s = NULL;
+	int16_t d;
+	
+	for (int i = 0; i < MAX_SENDERS; i++)
+	{
+		if (seen[i].in_use && seen[i].id == id &&
+			memcmp(seen[i].addr, addr, addrlen) == 0)
+		{
+			s = &seen[i];
+			break;
+		}
+	}
+	
+	if (s == NULL)
+	{
+		/* someone new, forget whoever we heard from longest ago */
+		s = &seen[evict];
+		evict = (evict + 1) % MAX_SENDERS;
+		
+		memset(s, 0, sizeof(*s));
+		s->in_use = 1;
+		memcpy(s->addr, addr, addrlen);
+		s->id = id;
+		s->top = seq;
+	}
+	
+	d = (int16_t)(seq - s->top);
+	if (d > 0)
+	{
+		/* newer, so the ones that fall out of the window go */
+		if (d >= RECV_WINDOW)
+		{
+			memset(s->bits, 0, sizeof(s->bits));
+		}
+		else
+		{
+			for (uint16_t q = s->top + 1; q != (uint16_t)(seq + 1); q++)
+			{
+				s->bits[q % RECV_WINDOW / 64] &=
+					~((uint64_t)1 << q % 64);
+			}
+		}
+		s->top = seq;
+	}
+	else if (d <= -RECV_WINDOW)
+	{
+		/* that far back, they must have started over */
+		memset(s->bits, 0, sizeof(s->bits));
+		s->top = seq;
+	}
+	else if (s->bits[seq % RECV_WINDOW / 64] & (uint64_t)1 << seq % 64)
+	{
+		return 1;
+	}
+	
+	s->bits[seq % RECV_WINDOW / 64] |= (uint64_t)1 << seq % 64;
+	
+	return 0;
+}
 
 int main(int argc, char **argv)
 {
-	if (argc < 2)
+	int only_peer = 0;
+	int opt;
+	
+	while ((opt = getopt(argc, argv, "p")) != -1)
+	{
+		switch (opt)
+		{
+			case 'p': only_peer = 1; break;
+			default:
+				printf("Usage: %s [-p] <hostname>\n", argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+	
+	if (optind >= argc)
 	{
-		printf("Usage: %s <hostname>\n", argv[0]);
+		printf("Usage: %s [-p] <hostname>\n", argv[0]);
 		return EXIT_FAILURE;
 	}
 	
@@ -309,7 +714,7 @@ int main(int argc, char **argv)
 	hints.ai_socktype = SOCK_RAW;
 	
 	
-	r = getaddrinfo(argv[1], NULL, &hints, &target_info);
+	r = getaddrinfo(argv[optind], NULL, &hints, &target_info);
 	
 	if (r != 0)
 	{
@@ -370,8 +775,11 @@ int main(int argc, char **argv)
 		#endif
 	}
 	
-	/* TODO: Do tha random id stuff..? */
-	short id = 12345;
+	/* Like ping does it; another run gets another id, so what it
+	 * sends isn't taken for what the last one did */
+	uint16_t id = getpid() & 0xffff;
+	
+	attach_filter(sock, p->ai_addr, id, only_peer);
 	
 	#if IPV4
 	struct icmp hdr;
@@ -379,213 +787,208 @@ int main(int argc, char **argv)
 	struct icmp6_hdr hdr;
 	#endif
 	
-	int pid = fork();
-	if (pid < 0)
-	{
-		ferr("fork");
-	}
-	else if (pid == 0)
+	struct Sender sender;
+	struct Seen seen[MAX_SENDERS];
+	struct Pending * m;
+	
+	memset(&sender, 0, sizeof(sender));
+	sender.base = sender.next = 1;
+	sender.rto = RTO_INIT;
+	memset(seen, 0, sizeof(seen));
+	
+	struct sockaddr_storage resp_addr;
+	socklen_t resp_addrlen;
+	
+	char packet[MAX_PACKET_LEN];
+	size_t msg_offset;
+	uint16_t seq;
+	
+	/* what was typed and isn't sent yet */
+	char in[4 * MAX_MSG_LEN];
+	size_t in_len = 0, len;
+	char * nl;
+	int eof = 0;
+	
+	struct pollfd pfd[2];
+	int timeout = -1;
+	
+	/* Until all that was typed got there, or was given up on */
+	while (!eof || in_len > 0 || sender.base != sender.next)
 	{
-		/* child, receiving stuff */
-		struct sockaddr * resp_addr;
-		
-		#if IPV4
-		socklen_t resp_addrlen = sizeof(struct sockaddr_in);
-		#else
-		socklen_t resp_addrlen = sizeof(struct sockaddr_in6);
-		#endif
+		/* new messages, as long as there's room in the window */
+		while (in_len > 0 && (uint16_t)(sender.next - sender.base) < WINDOW)
+		{
+			nl = memchr(in, '\n', in_len);
+			if (nl != NULL)
+			{
+				len = nl - in + 1;
+			}
+			else if (in_len >= MAX_MSG_LEN || eof)
+			{
+				len = in_len;
+			}
+			else
+			{
+				break;
+			}
+			if (len > MAX_MSG_LEN)
+			{
+				len = MAX_MSG_LEN;
+			}
+			
+			m = &sender.pending[sender.next % WINDOW];
+			m->in_use = 1;
+			m->seq = sender.next++;
+			m->tries = 0;
+			m->len = len;
+			memcpy(m->msg, in, len);
+			
+			in_len -= len;
+			memmove(in, in + len, in_len);
+			
+			send_message(sock, p, id, m);
+			m->deadline = m->sent + wait_for(&sender, m);
+			if (timeout < 0 || timeout > (int)(m->deadline - m->sent))
+			{
+				timeout = (int)(m->deadline - m->sent);
+			}
+		}
 		
-		resp_addr = malloc(resp_addrlen);
+		pfd[0].fd = sock;
+		pfd[0].events = POLLIN;
+		/* stdin waits while the window is full */
+		pfd[1].fd = !eof && in_len < MAX_MSG_LEN &&
+			(uint16_t)(sender.next - sender.base) < WINDOW ?
+			STDIN_FILENO : -1;
+		pfd[1].events = POLLIN;
 		
-		char packet[MAX_PACKET_LEN];
-		memset(packet, 0, MAX_PACKET_LEN);
+		fflush(stdout);
+		r = poll(pfd, 2, timeout);
+		if (r < 0 && errno != EINTR)
+		{
+			ferr("poll");
+		}
 		
-		char * buf = NULL;
-		size_t buf_size;
-		#if IPV4
-		size_t ipv4offset;
-		#endif
+		if (r > 0 && (pfd[1].revents & (POLLIN | POLLHUP)))
+		{
+			r = read(STDIN_FILENO, in + in_len, sizeof(in) - in_len);
+			if (r > 0)
+			{
+				in_len += r;
+			}
+			else if (r == 0)
+			{
+				eof = 1;
+			}
+			else if (errno != EINTR)
+			{
+				ferr("read");
+			}
+		}
 		
-		/* TODO: Receiving proper messages */
-		while (1)
+		/* all that came in */
+		while (pfd[0].revents & POLLIN)
 		{
+			resp_addrlen = sizeof(resp_addr);
 			r = recvfrom(
 				sock,
 				packet,
 				MAX_PACKET_LEN,
-				0,
-				resp_addr,
+				MSG_DONTWAIT,
+				(struct sockaddr *)&resp_addr,
 				&resp_addrlen
 			);
 			
 			if (r < 0)
 			{
-				perror("recvfrom");
-				continue;
-			}	
-			
-			inet_ntop(
-				p->ai_family, /* !!! UNSAFE AND RETARDED !!! */
-				getinaddr(resp_addr),
-				ipbuffer,
-				sizeof(ipbuffer)
-			);
-			
+				if (errno != EAGAIN && errno != EWOULDBLOCK &&
+					errno != EINTR)
+				{
+					perror("recvfrom");
+				}
+				break;
+			}
 			
 			#if IPV4
 			/* recvfrom for IPv4 will also include the IPv4 address */
 			/* So, the second nimble(4 bits) of an IPv4 address
 			 * contains the length of the address in terms of 32 bit
 			 * - or 4 byte - words. So this will extract it. */
-			ipv4offset = (*((uint8_t *)packet) & 0x0f) * 4;
-			#define ADDITIONAL_OFFSET ipv4offset
+			msg_offset = (*((uint8_t *)packet) & 0x0f) * 4;
 			#else
 			/* The IPv6 stack will strip the IPv6 header off, leaving
 			 * the data we want */
-			#define ADDITIONAL_OFFSET 0
+			msg_offset = 0;
 			#endif
 			
-			#define MSG_OFFSET (ADDITIONAL_OFFSET + sizeof(hdr))
-			
+			/* too short to be one of ours, ping sends those */
+			if ((size_t)r < msg_offset + sizeof(hdr))
+			{
+				continue;
+			}
 			
-			memcpy(&hdr, packet + ADDITIONAL_OFFSET, sizeof(hdr));
+			memcpy(&hdr, packet + msg_offset, sizeof(hdr));
+			msg_offset += sizeof(hdr);
 			
 			#if IPV4
-			if (hdr.icmp_type == ICMP_ECHO) /* echo request, 8 */
-			{
-				printf("Incoming message!\n");
-			}
-			else if (hdr.icmp_type == ICMP_ECHOREPLY) /* 0 */
+			#define ICMP_TYPE hdr.icmp_type
+			#define ICMP_ID hdr.icmp_id
+			#define ICMP_SEQ hdr.icmp_seq
+			#define ECHO_REQUEST ICMP_ECHO /* 8 */
+			#define ECHO_REPLY ICMP_ECHOREPLY /* 0 */
+			#define ADDR_LEN 4
+			#else
+			#define ICMP_TYPE hdr.icmp6_type
+			#define ICMP_ID hdr.icmp6_id
+			#define ICMP_SEQ hdr.icmp6_seq
+			#define ECHO_REQUEST ICMP6_ECHO_REQUEST /* 128 */
+			#define ECHO_REPLY ICMP6_ECHO_REPLY /* 129 */
+			#define ADDR_LEN 16
+			#endif
+			
+			seq = ntohs(ICMP_SEQ);
+			
+			if (ICMP_TYPE == ECHO_REPLY)
 			{
-				if (ntohs(hdr.icmp_id) == id)
+				/* without -p the filter lets replies from anyone
+				 * through, and only the peer's say it got ours */
+				if (ntohs(ICMP_ID) == id &&
+					memcmp(getinaddr((struct sockaddr *)&resp_addr),
+						getinaddr(p->ai_addr), ADDR_LEN) == 0)
 				{
-					printf("Message acknowledged!\n");
+					acknowledge(&sender, seq);
 				}
+				continue;
 			}
-			else
+			else if (ICMP_TYPE != ECHO_REQUEST)
 			{
-				/* ??? */
+				/* Uninteresting router solicitations */
+				continue;
 			}
-			#else
 			
-			/* Check if error or info */
-			if (hdr.icmp6_type & 0x80 /* info mask */)
+			/* our kernel answered it again, which is all a resent
+			 * one needs */
+			if (seen_before(seen, getinaddr((struct sockaddr *)&resp_addr),
+				ADDR_LEN, ntohs(ICMP_ID), seq))
 			{
-				/* TODO: Check if resp_addr == p->ai_addr */
-				
-				/* info */
-				if (hdr.icmp6_type == ICMP6_ECHO_REQUEST /*128*/)
-				{
-					printf("Incoming message!\n");
-				}
-				else if (hdr.icmp6_type == ICMP6_ECHO_REPLY /*129*/)
-				{
-					if (ntohs(hdr.icmp6_id) == id)
-					{
-						printf("Message acknowledged!\n");	
-					}
-					/*continue;*/
-				}
-				else
-				{
-					/* Uninteresting router solicitations */
-					continue;
-				}
+				continue;
 			}
-			#endif
-			
-			printf("Got packet from %s\n", ipbuffer);
-			print_icmphdrinfo(&hdr);
 			
-			buf_size = r - MSG_OFFSET;
-			
-			buf = realloc(buf, buf_size);
-			
-			memcpy(buf, packet + MSG_OFFSET, buf_size);
-			
-			printf("len: %d, msg: %s\n", r, buf);
-			
-			/* Reset the buffer so the string terminates properly 
-			 * the next time */
-			memset(buf, 0, buf_size);
-		}
-		
-		free(resp_addr);
-		if (buf_size > 0) free(buf);
-		
-		return 0;
-	}
-	else
-	{
-		/* parent, sending stuff */
-		size_t msg_len, msg_alloc_len, packet_len;
-		char * msg = NULL;
-		char * packet = NULL;
-		short seq = 1;
-		
-		while (1)
-		{
-			memset(&hdr, 0, sizeof(hdr));
-			
-			#if IPV4
-			/* Craft ICMP header */
-			hdr.icmp_type = ICMP_ECHO;
-			hdr.icmp_code = 0;
-			hdr.icmp_cksum = 0; /* Will NOT be computed by the IP stack */
-			hdr.icmp_id = htons(id);
-			hdr.icmp_seq = htons(seq);
-			#else
-			/* Craft ICMPv6 header */
-			hdr.icmp6_type = ICMP6_ECHO_REQUEST;
-			hdr.icmp6_code = 0;
-			hdr.icmp6_cksum = 0; /* Will be calculated by the IP stack */
-			hdr.icmp6_id = htons(id);
-			hdr.icmp6_seq = htons(seq);
-			#endif
-			
-			r = getline(&msg, &msg_alloc_len, stdin);
-			
-			if (r < 0)
-				ferr("getline");
-				
-			msg_len = (size_t)r;
-			
-			#if IPV4
-			hdr.icmp_cksum = icmp4_checksum(hdr, (uint8_t *)msg, msg_len);
-			#endif
+			inet_ntop(
+				p->ai_family,
+				getinaddr((struct sockaddr *)&resp_addr),
+				ipbuffer,
+				sizeof(ipbuffer)
+			);
 			
+			printf("Incoming message!\n");
+			printf("Got packet from %s\n", ipbuffer);
 			print_icmphdrinfo(&hdr);
-			
-				
-			/* I think the max packet length of sendto is around 0xffff */
-			packet_len = sizeof(hdr) + msg_len;
-
-			packet = realloc(packet, packet_len);
-
-			memcpy(packet, &hdr, sizeof(hdr));
-			memcpy(packet + sizeof(hdr), msg, msg_len);
-			
-			r = sendto(
-				sock,
-				packet,
-				packet_len,
-				0,
-				p->ai_addr,
-				p->ai_addrlen
-			);
-
-			if (r < 0)
-				perror("sendto");
-				
-			printf("Sent %d bytes(msglen: %zu, hdrsize: %zu)\n",
-				r, msg_len, sizeof(hdr));
-				
-			seq++;
+			printf("len: %d, msg: %.*s\n", r, (int)(r - msg_offset),
+				packet + msg_offset);
 		}
 		
-		free(packet);
-		/* According to man getline it should be freed */
-		/*if (msg_alloc_len > 0)*/ free(msg);
+		timeout = retransmit(sock, p, id, &sender);
 	}
 	
 	freeaddrinfo(target_info);
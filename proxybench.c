@@ -0,0 +1,275 @@
+/*
+ * proxybench.c - Measures how much data tcpproxy can relay on loopback,
+ *                with 1 up to N worker threads
+ *
+ * usage: proxybench [-x path to tcpproxy] [-W max workers] [-c conns]
+ *                   [-s seconds] [-P]
+ *
+ * Runs a sink that throws away whatever it gets, starts tcpproxy in
+ * front of it with -w 1, -w 2 ... -w N, and pushes data through with a
+ * bunch of connections for a few seconds each time. Prints the
+ * aggregate throughput for every worker count. -P is passed on to
+ * tcpproxy to pin its workers.
+ *
+ * The senders and the sink run on the same machine, so they compete
+ * with the proxy for CPUs; give it a box with some cores to spare.
+ *
+ * compile with: cc -pthread proxybench.c -o proxybench
+ *
+ * CC0/Public domain
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define PROXY_PORT 19900
+#define SINK_PORT 19901
+#define CHUNK 65536 /* bytes per send() */
+#define MAX_CONNS 1024
+
+atomic_uint_fast64_t received; /* bytes that made it to the sink */
+atomic_int stop; /* tells the senders to quit */
+
+/* prints msg, with error details, and exits */
+void ferr(const char * msg)
+{
+	perror(msg);
+	exit(EXIT_FAILURE);
+}
+
+/* eats everything a single connection has to say */
+void * sink_conn(void * arg)
+{
+	int fd = (int)(intptr_t)arg;
+	char * buf = malloc(CHUNK);
+	ssize_t n;
+
+	while ((n = recv(fd, buf, CHUNK, 0)) > 0)
+		atomic_fetch_add(&received, (uint64_t)n);
+
+	close(fd);
+	free(buf);
+
+	return NULL;
+}
+
+/* accepts connections to the sink, each gets its own thread */
+void * sink(void * arg)
+{
+	int lsock = (int)(intptr_t)arg;
+	int fd;
+	pthread_t tid;
+
+	while (1) {
+		fd = accept(lsock, NULL, NULL);
+		if (fd == -1) {
+			perror("accept");
+			continue;
+		}
+
+		if (pthread_create(&tid, NULL, sink_conn, (void *)(intptr_t)fd) != 0) {
+			close(fd);
+			continue;
+		}
+		pthread_detach(tid);
+	}
+
+	return NULL;
+}
+
+/* pushes data into the proxy until told to stop */
+void * sender(void * arg)
+{
+	int fd = (int)(intptr_t)arg;
+	char * buf = malloc(CHUNK);
+
+	memset(buf, 'x', CHUNK);
+
+	while (!atomic_load(&stop)) {
+		if (send(fd, buf, CHUNK, MSG_NOSIGNAL) < 0)
+			break;
+	}
+
+	free(buf);
+
+	return NULL;
+}
+
+int listen_on(int port)
+{
+	struct sockaddr_in a;
+	const int yes = 1;
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+	if (fd == -1)
+		ferr("socket");
+
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+	memset(&a, 0, sizeof(a));
+	a.sin_family = AF_INET;
+	a.sin_port = htons(port);
+	a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if (bind(fd, (struct sockaddr *)&a, sizeof(a)) == -1)
+		ferr("bind");
+	if (listen(fd, MAX_CONNS) == -1)
+		ferr("listen");
+
+	return fd;
+}
+
+/* connects to the proxy, retrying for a bit while it starts up */
+int connect_proxy(void)
+{
+	struct sockaddr_in a;
+	int fd;
+
+	memset(&a, 0, sizeof(a));
+	a.sin_family = AF_INET;
+	a.sin_port = htons(PROXY_PORT);
+	a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	for (int tries = 0; tries < 100; tries++) {
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (fd == -1)
+			ferr("socket");
+
+		if (connect(fd, (struct sockaddr *)&a, sizeof(a)) == 0)
+			return fd;
+
+		close(fd);
+		usleep(20000);
+	}
+
+	ferr("connect to proxy");
+	return -1;
+}
+
+/* runs tcpproxy with the given number of workers */
+pid_t start_proxy(const char * path, int workers, int pin)
+{
+	char w[16], lport[16], tport[16];
+	pid_t pid;
+
+	snprintf(w, sizeof(w), "%d", workers);
+	snprintf(lport, sizeof(lport), "%d", PROXY_PORT);
+	snprintf(tport, sizeof(tport), "%d", SINK_PORT);
+
+	/* or the child prints our buffered output too */
+	fflush(stdout);
+
+	pid = fork();
+	if (pid < 0)
+		ferr("fork");
+
+	if (pid == 0) {
+		/* the proxy has nothing interesting to say */
+		freopen("/dev/null", "w", stdout);
+
+		if (pin)
+			execl(path, path, "-q", "-P", "-w", w, lport, "127.0.0.1",
+				tport, "4", (char *)NULL);
+		else
+			execl(path, path, "-q", "-w", w, lport, "127.0.0.1",
+				tport, "4", (char *)NULL);
+
+		ferr("exec tcpproxy");
+	}
+
+	return pid;
+}
+
+int main(int argc, char **argv)
+{
+	const char * path = "./tcpproxy";
+	int max_workers = 4;
+	int nconns = 16;
+	int seconds = 5;
+	int pin = 0;
+	int opt, lsock;
+	int fds[MAX_CONNS];
+	pthread_t tids[MAX_CONNS], tid;
+	uint64_t before, after;
+	double mbps, base = 0;
+	pid_t pid;
+
+	while ((opt = getopt(argc, argv, "x:W:c:s:P")) != -1) {
+		switch (opt) {
+			case 'x': path = optarg; break;
+			case 'W': max_workers = atoi(optarg); break;
+			case 'c': nconns = atoi(optarg); break;
+			case 's': seconds = atoi(optarg); break;
+			case 'P': pin = 1; break;
+			default:
+				fprintf(stderr, "Usage: %s [-x path to tcpproxy] [-W max workers] [-c conns] [-s seconds] [-P]\n", argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+
+	if (nconns < 1 || nconns > MAX_CONNS) {
+		fprintf(stderr, "Can do 1 to %d connections\n", MAX_CONNS);
+		return EXIT_FAILURE;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	lsock = listen_on(SINK_PORT);
+	if (pthread_create(&tid, NULL, sink, (void *)(intptr_t)lsock) != 0)
+		ferr("pthread_create");
+
+	printf("workers\tMB/s\tspeedup\n");
+
+	for (int w = 1; w <= max_workers; w++) {
+		pid = start_proxy(path, w, pin);
+
+		atomic_store(&stop, 0);
+
+		for (int i = 0; i < nconns; i++) {
+			fds[i] = connect_proxy();
+
+			if (pthread_create(&tids[i], NULL, sender,
+					(void *)(intptr_t)fds[i]) != 0)
+				ferr("pthread_create");
+		}
+
+		/* give slow start a moment, then measure */
+		usleep(500000);
+		before = atomic_load(&received);
+		sleep(seconds);
+		after = atomic_load(&received);
+
+		atomic_store(&stop, 1);
+		for (int i = 0; i < nconns; i++) {
+			shutdown(fds[i], SHUT_RDWR);
+			pthread_join(tids[i], NULL);
+			close(fds[i]);
+		}
+
+		kill(pid, SIGTERM);
+		waitpid(pid, NULL, 0);
+
+		mbps = (double)(after - before) / seconds / 1e6;
+		if (w == 1)
+			base = mbps;
+
+		printf("%d\t%.1f\t%.2fx\n", w, mbps, base > 0 ? mbps / base : 0);
+		fflush(stdout);
+	}
+
+	close(lsock);
+
+	return 0;
+}
@@ -1,8 +1,44 @@
 /*
  * qotd.c - IPv6 UPD QOTD server conforming to RFC865
  * 
- * usage: qotd [filename]
+ * usage: qotd [-q] [-t [-O]] [-p port] [-b batch] [-w workers] [-P] [-S]
+ *             [-r rate[,burst]] [-m v4 bits,v6 bits] [-A ratio] [filename]
  * if filename is not given, quotes.txt will be tried
+ * filename can also be a database compiled by qotdc, which is mapped
+ * and served from as is, so startup takes no time at all. Quotes
+ * can be made more or less likely to come up, see quotes.h
+ * A UDP request that says a category gets a quote from that, and one
+ * that says #id the quote with that id, see quotes.h too. Anything
+ * else, like an empty request, gets any quote
+ * -q stops printing every request, -p listens on another port than
+ * 17 and -b sets how many requests are taken in and answered with a
+ * single recvmmsg/sendmmsg, 64 by default
+ * -t serves QOTD over TCP on the same port too. A client gets its
+ * quote with a single send, straight from the quote list, and once
+ * it has acked all of it the connection is reset, so it doesn't sit
+ * in TIME_WAIT here. The client reads its quote and then sees a reset
+ * rather than a close; one that hangs up first gets a close, and the
+ * TIME_WAIT is its own. -O closes with a FIN after the quote instead,
+ * as RFC 865 has it, for clients that don't take a reset well, and
+ * the TIME_WAIT stays here. A client that can't be given all of its
+ * quote is reset either way, rather than get part of it. -b also says
+ * how many connections are accepted in one go
+ * -w runs that many worker threads, each on its own SO_REUSEPORT
+ * socket, all serving the same quote list. -P pins worker i to the
+ * i-th CPU and tells the kernel with SO_INCOMING_CPU, which it uses
+ * to pick a socket since linux 6.1. -S steers with a classic BPF
+ * program instead, handing every request to the worker on the CPU
+ * that received it; it implies -P
+ * -r answers every source network at most rate requests a second
+ * (bursts of 2 * rate by default), all workers together, as the
+ * kernel spreads one network's requests over them. Networks are /24 for
+ * IPv4 and /64 for IPv6 unless -m says otherwise. -A only sends a
+ * quote if the reply is at most ratio times the size of the request,
+ * IP and UDP headers included, so qotd can't be used to flood a
+ * spoofed address with more than it got. Both drop requests before
+ * any work is done on them
+ *
+ * compile with: cc -pthread qotd.c -o qotd
  * 
  * Copyright 2016-2018 job <job@function1.nl>
  * 
@@ -13,7 +49,6 @@
 
 /* IDEAS:
 	* comments
-	* improve random distribution
  */
 
 /* Set to 1 if you want to watch the quote file for changes, so
@@ -26,6 +61,8 @@
 #define COMPILE_AUTOUPDATE 0
 #endif
 
+#define _GNU_SOURCE /* recvmmsg, sendmmsg */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -35,21 +72,109 @@
 #include <arpa/inet.h>
 #include <string.h>
 #include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h> /* cpu_set_t */
+#include <stdatomic.h>
+#include <linux/filter.h> /* classic BPF */
+#include <sys/random.h> /* getrandom */
+#include <sys/ioctl.h>
+#include <linux/sockios.h> /* SIOCOUTQ */
+#include <poll.h>
 
 #if COMPILE_AUTOUPDATE
 	#include <sys/inotify.h>
-	#include <poll.h>
-	#include <errno.h>
+	#include <libgen.h>
 #endif
 
+#include "quotes.h"
+
 #define BUF_SIZE 512
+#define BATCH_LEN 64 /* default requests per recvmmsg */
+#define MAX_BATCH 1024
+#define MAX_WORKERS 256
+#define LIMIT_ROWS 4 /* buckets a source network counts against */
+#define LIMIT_COLS 16384 /* buckets per row */
+#define RATIO_TRIES 8 /* quotes to try for one that is short enough */
+#define MAX_PENDING 1024 /* TCP clients per worker still getting quotes */
+#define PENDING_MS 5000 /* give up on a client that won't take its quote */
+#define PENDING_POLL_MS 10 /* how often to look if quotes got acked */
 
-struct Quote
+/* Everything one round of recvmmsg and sendmmsg needs. Set up once,
+ * replies point straight into the quote list */
+struct Batch
 {
-	char * msg;
-	unsigned short len;
+	unsigned int len;
+	struct mmsghdr * in;
+	struct mmsghdr * out;
+	struct iovec * in_iov;
+	struct iovec * out_iov;
+	struct sockaddr_storage * addr;
+	char * buf; /* len requests of BUF_SIZE each */
 };
 
+/* A token bucket of requests */
+struct Bucket
+{
+	float tokens;
+	uint32_t last; /* ms, when tokens was last topped up */
+};
+
+/* A TCP client that hasn't acked all of its quote yet */
+struct Pending
+{
+	int fd;
+	char * rest; /* what didn't fit in the socket buffer, or NULL */
+	size_t len;
+	uint32_t since; /* ms, when it was accepted */
+	int eof; /* it hung up its side */
+};
+
+/* A thread with its own socket, that the kernel hands some of the
+ * requests to */
+struct Worker
+{
+	int id;
+	int cpu; /* -1 if not pinned */
+	int sock;
+	int lsock; /* TCP listener, -1 without -t */
+	uint64_t rng[4]; /* xoshiro256** state, see quotes.h */
+	struct Batch batch;
+	pthread_t tid;
+	
+	/* A source network hashes to one bucket in every row and gets
+	 * what the fullest of them allows, like a count-min sketch: the
+	 * others were drained by whoever shares them too. Sources
+	 * sharing a bucket in one row rarely share one in the others,
+	 * and no matter how many sources there are it stays this size. The same one for every worker, NULL without -r */
+	_Atomic(struct Bucket) (* limit)[LIMIT_COLS];
+	
+	/* TCP clients, with pollfds for them after the two sockets */
+	struct Pending * pend;
+	int npend;
+	struct pollfd * pfds;
+	
+	/* goes up before a batch picks quotes and again once its replies
+	 * are sent, so it is odd while the worker holds on to a quote
+	 * list and even while it holds none */
+	atomic_ulong passes;
+};
+
+/* The quote list being served. Workers only ever read it, a reload
+ * puts a whole new one in its place and frees the old one once every
+ * worker has been seen without it */
+_Atomic(struct QuoteList *) quotes;
+
+int quiet; /* don't print every request */
+int tcp_fin; /* -O */
+
+/* rate limiting and amplification, see the top */
+float limit_rate; /* requests/s, 0 for no limit */
+float limit_burst;
+int prefix4 = 24, prefix6 = 64; /* bits of a source that make a network */
+float max_ratio; /* 0 for no limit */
+uint64_t limit_key; /* so no one can pick sources that share buckets */
+
 /* Converts a sockaddr to a human readable one */
 char * get_ip_str(const struct sockaddr * sa, char * s, size_t maxlen)
 {
@@ -74,323 +199,994 @@ char * get_ip_str(const struct sockaddr * sa, char * s, size_t maxlen)
 	return s;
 }
 
-/* prints msg, with error details, and exits */
-void ferr(const char * msg)
+/* sets up a batch for len requests */
+void init_batch(struct Batch * b, unsigned int len)
+{
+	b->len = len;
+	b->in = calloc(len, sizeof(struct mmsghdr));
+	b->out = calloc(len, sizeof(struct mmsghdr));
+	b->in_iov = calloc(len, sizeof(struct iovec));
+	b->out_iov = calloc(len, sizeof(struct iovec));
+	b->addr = calloc(len, sizeof(struct sockaddr_storage));
+	b->buf = malloc(len * BUF_SIZE);
+	
+	if (!b->in || !b->out || !b->in_iov || !b->out_iov || !b->addr ||
+		!b->buf)
+	{
+		ferr("malloc");
+	}
+	
+	for (unsigned int i = 0; i < len; i++)
+	{
+		/* -1 for terminating null byte */
+		b->in_iov[i].iov_base = b->buf + i * BUF_SIZE;
+		b->in_iov[i].iov_len = BUF_SIZE - 1;
+		b->in[i].msg_hdr.msg_iov = &b->in_iov[i];
+		b->in[i].msg_hdr.msg_iovlen = 1;
+		b->in[i].msg_hdr.msg_name = &b->addr[i];
+		
+		b->out[i].msg_hdr.msg_iov = &b->out_iov[i];
+		b->out[i].msg_hdr.msg_iovlen = 1;
+	}
+}
+
+/* ms, not since any particular moment */
+uint32_t now_ms(void)
 {
-	perror(msg);
-	exit(EXIT_FAILURE);
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
-/* Parses a quote list from a file. Returns NULL if there are no
- * quotes in file */
-struct Quote * parse_quote_list(const char * filename, size_t * len)
+/* Hashes the network sa is on, FNV-1a keyed with limit_key. IPv4
+ * comes in v4-mapped and goes by prefix4 */
+uint64_t network_hash(const struct sockaddr_storage * sa)
 {
-	FILE * input = fopen(filename, "r");
+	const struct in6_addr * a = &((struct sockaddr_in6 *)sa)->sin6_addr;
+	uint8_t net[16];
+	int bits = IN6_IS_ADDR_V4MAPPED(a) ? 96 + prefix4 : prefix6;
+	uint64_t h = 14695981039346656037ull ^ limit_key;
 	
-	if (input == NULL)
+	memcpy(net, a->s6_addr, sizeof(net));
+	for (int i = 0; i < 16; i++)
 	{
-		/* I know that this should only be fatal for the first time,
-		 * not when the quote file has been updated(fall back to old),
-		 * but that seems to be a rare case and I am a little lazy. */
-		ferr("Couldn't read quote list file");
+		if (bits <= 0)
+			net[i] = 0;
+		else if (bits < 8)
+			net[i] &= 0xff << (8 - bits);
+		bits -= 8;
 	}
 	
-	/* initial list length, will double every time there is too little
-	 * space */
-	size_t list_len = 512;
-	struct Quote * list = malloc(list_len * sizeof(struct Quote));
+	for (int i = 0; i < 16; i++)
+		h = (h ^ net[i]) * 1099511628211ull;
 	
-	struct Quote q; /* current quote */
-	
-	char * p = NULL; /* current quote message */
-	int c; /* current unsigned char, cast to int for EOF */
-	char prevEsc = 0; /* previous char was escape char */
-	size_t i, j;
+	return h;
+}
+
+/* Takes a request's worth of tokens from the buckets of the network sa
+ * is on. Returns 0, and takes nothing, if it has had enough.
+ * Every worker does this on the same buckets, each one a compare and
+ * swap of its own. Two workers can both see tokens the other is just
+ * taking, so a network can get a few requests more than its burst
+ * once in a while, never a worker's worth */
+int limit_take(struct Worker * w, const struct sockaddr_storage * sa,
+	uint32_t now)
+{
+	_Atomic(struct Bucket) * b[LIMIT_ROWS];
+	struct Bucket old, new;
+	uint64_t h = network_hash(sa);
+	uint32_t h1 = h, h2 = (h >> 32) | 1;
+	float most = 0;
 	
-	for (i = 0; ; i++)
+	for (int i = 0; i < LIMIT_ROWS; i++)
 	{
-		p = malloc(BUF_SIZE);
+		b[i] = &w->limit[i][(h1 + i * h2) % LIMIT_COLS];
 		
-		/* -1 for terminating null byte */
-		for (j = 0; j < BUF_SIZE - 1;)
+		old = atomic_load_explicit(b[i], memory_order_relaxed);
+		do
 		{
-			c = fgetc(input);
-			
-			if (c == EOF)
+			new = old;
+			/* another worker's now can be a little later than
+			 * this one's, that is no time going by at all */
+			if (old.last - now >= 1000)
 			{
-				goto endoffile;
-			}
-			if (c == '\\' && !prevEsc)
-			{
-				prevEsc = 1;
-				continue;
+				new.tokens += (now - old.last) * limit_rate / 1000;
+				if (new.tokens > limit_burst)
+					new.tokens = limit_burst;
+				new.last = now;
 			}
-
-			p[j] = (char)c;
-			j++;
-			
-			if (c == '\n' && !prevEsc)
-			{
-				/* if this is hit, high chance msg < BUF_SIZE, so
-				 * resize */
-				p = realloc(p, j);
-				break;
-			}
-			
-			prevEsc = 0;
 		}
+		while (!atomic_compare_exchange_weak_explicit(b[i], &old, new,
+			memory_order_relaxed, memory_order_relaxed));
 		
-		q.msg = p;
-		q.len = j;
-		
-		if (i >= list_len)
-		{
-			list_len *= 2;
-			list = realloc(list, list_len * sizeof(struct Quote));
-		}
-		
-		list[i] = q;
+		if (new.tokens > most)
+			most = new.tokens;
 	}
-
-endoffile:
-	fclose(input);
-
-	free(p);
-
-	if (i == 0)
+	
+	if (most < 1)
+		return 0;
+	
+	/* Only bring every bucket down to what the network has left.
+	 * Taking a token from all of them would also charge whoever
+	 * else drained the emptier ones */
+	for (int i = 0; i < LIMIT_ROWS; i++)
 	{
-		/* No quotes in list */
-		free(list);
-		return NULL;
+		old = atomic_load_explicit(b[i], memory_order_relaxed);
+		while (old.tokens > most - 1)
+		{
+			new = old;
+			new.tokens = most - 1;
+			if (atomic_compare_exchange_weak_explicit(b[i], &old, new,
+				memory_order_relaxed, memory_order_relaxed))
+				break;
+		}
 	}
-
-	/* if last quote has no \n quote won't be added */
-	list = realloc(list, i * sizeof(struct Quote));
-	*len = i;
 	
-	return list;
+	return 1;
 }
 
-#if COMPILE_AUTOUPDATE
-/* frees a quote list */
-/* only used with autoupdate */
-void free_quote_list(struct Quote * l, size_t len)
+/* Picks a quote for a request that said key, len bytes of it, NULL
+ * if it is damaged. See pick_keyed() for what key does */
+const char * pick_quote(struct Worker * w, const struct QuoteList * ql,
+	const char * key, size_t len, uint32_t * qlen)
 {
-	for (size_t i = 0; i < len; i++)
-	{
-		free(l[i].msg);
-	}
-	free(l);
+	size_t ran = pick_keyed(ql, key, len, w->rng);
+	const char * q = get_quote(ql, ran, qlen);
+	
+	if (q == NULL)
+		fprintf(stderr, "Quote %zu is damaged\n", ran);
+	
+	return q;
 }
-#endif
 
-int main(int argc, char **argv)
+/* Takes in whatever requests are waiting, up to a batch of them, and
+ * sends every one of them a quote. With MSG_WAITFORONE in flags, waits
+ * for the first request if there are none */
+void serve_batch(struct Worker * w, int flags)
 {
-	size_t n_quotes, ran;
+	const struct QuoteList * ql;
+	struct Batch * b = &w->batch;
+	int sock = w->sock;
+	char s[INET6_ADDRSTRLEN];
+	unsigned int m = 0; /* replies */
+	uint32_t now = 0;
+	int n, r;
 	
-	const struct in6_addr ia = IN6ADDR_ANY_INIT;
+	for (unsigned int i = 0; i < b->len; i++)
+	{
+		/* the kernel shrinks it to the address it wrote */
+		b->in[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+	}
 	
-	int sock, r;
-	struct sockaddr_in6 serv_addr;
-	struct sockaddr_storage cli_addr;
-	socklen_t cli_len = (socklen_t)sizeof(cli_addr);
-	char buf[BUF_SIZE];
-	char s[INET6_ADDRSTRLEN];
-
-	#if COMPILE_AUTOUPDATE
-	int watchfd; /* inotify watch file descriptor */
-	int wd; /* quotefile watch descriptor */
-	nfds_t fdlen = 2; /* number of poll() file descriptors(fds) */
-	struct pollfd fdlist[2]; /* 2 fds: sock & wd */
-	#endif
-
-	char * quotepath = argc > 1 ? argv[1] : "quotes.txt";
-
-	struct Quote * quotes = parse_quote_list(
-		quotepath, &n_quotes
-	);
-	if (quotes == NULL)
+	n = recvmmsg(sock, b->in, b->len, flags, NULL);
+	if (n < 0)
 	{
-		fprintf(stderr, "No quotes in list!\n");
-		exit(EXIT_FAILURE);
+		if (errno != EINTR && errno != EAGAIN)
+			perror("Error on recvmmsg");
+		return;
 	}
 	
-	#if COMPILE_AUTOUPDATE
-	/* create file descriptor for the inotify api,
-	 * which watches the quote file */
-	watchfd = inotify_init1(IN_NONBLOCK);
+	/* not before recvmmsg, which may wait through a reload */
+	atomic_fetch_add(&w->passes, 1);
+	ql = atomic_load(&quotes);
 	
-	if (watchfd < 0)
+	if (w->limit != NULL)
+		now = now_ms();
+	
+	for (int i = 0; i < n; i++)
 	{
-		ferr("inotify_init1");
+		if (w->limit != NULL && !limit_take(w, &b->addr[i], now))
+			continue;
+		
+		if (!quiet)
+		{
+			char * buf = b->in_iov[i].iov_base;
+			buf[b->in[i].msg_len] = '\0';
+			
+			printf("Got message from %s\t%s", get_ip_str(
+				(struct sockaddr *)&b->addr[i], s, sizeof(s)), buf);
+		}
+		
+		/* the request, without the newline a client might add, is
+		 * what category or id it wants */
+		const char * key = b->in_iov[i].iov_base;
+		size_t len = b->in[i].msg_len;
+		
+		while (len > 0 && (key[len - 1] == '\n' ||
+			key[len - 1] == '\r' || key[len - 1] == ' '))
+			len--;
+		
+		uint32_t qlen;
+		const char * q = pick_quote(w, ql, key, len, &qlen);
+		
+		if (q == NULL)
+			continue;
+		
+		if (max_ratio > 0)
+		{
+			/* what goes over the wire, v4-mapped is IPv4 */
+			float hdr = IN6_IS_ADDR_V4MAPPED(
+				&((struct sockaddr_in6 *)&b->addr[i])->sin6_addr) ?
+				20 + 8 : 40 + 8;
+			float most = max_ratio * (b->in[i].msg_len + hdr) - hdr;
+			
+			/* look for a short enough one a few times, then give
+			 * up rather than go through all of them */
+			for (int t = 1; q != NULL && qlen > most; t++)
+			{
+				if (t == RATIO_TRIES)
+				{
+					q = NULL;
+					break;
+				}
+				q = pick_quote(w, ql, key, len, &qlen);
+			}
+			
+			if (q == NULL)
+				continue;
+		}
+		
+		b->out_iov[m].iov_base = (void *)q;
+		b->out_iov[m].iov_len = qlen;
+		b->out[m].msg_hdr.msg_name = &b->addr[i];
+		b->out[m].msg_hdr.msg_namelen = b->in[i].msg_hdr.msg_namelen;
+		m++;
 	}
-
-	/* add watch descriptor for quote file */
-	wd = inotify_add_watch(watchfd, quotepath, IN_CLOSE);
-	if (wd < 0)
+	
+	for (unsigned int sent = 0; sent < m; )
 	{
-		fprintf(stderr, "Cannot watch %s:", quotepath);
-		ferr("inotify_add_watch");
+		r = sendmmsg(sock, b->out + sent, m - sent, 0);
+		if (r < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			
+			/* only the first one failed, forget about it and
+			 * carry on with the rest */
+			perror("Error on sendmmsg");
+			sent++;
+			continue;
+		}
+		sent += r;
 	}
-	#endif
-	
-	srand(time(NULL)); /* seed the RNG with the current time */
 	
-	
-	sock = socket(AF_INET6,	SOCK_DGRAM, 0); /* IPv6 UDP socket */
+	/* done with ql, the replies pointing into it have been copied */
+	atomic_fetch_add(&w->passes, 1);
+}
+
+/* Opens a UDP socket, or a TCP listener, on port, that other workers
+ * can bind too */
+int make_socket(int type, int port, int cpu)
+{
+	const struct in6_addr ia = IN6ADDR_ANY_INIT;
+	struct sockaddr_in6 serv_addr;
+	int sock = socket(AF_INET6, type, 0); /* IPv6 UDP or TCP socket */
 	
 	if (sock < 0)
 		ferr("Error opening socket");
 		
 	const socklen_t yes = 1;
 	
-	/* make the socket reusable */
+	/* make the socket reusable, and shareable between workers */
 	if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR,
+		(void*)&yes, sizeof(yes)) < 0 ||
+		setsockopt(sock, SOL_SOCKET, SO_REUSEPORT,
 		(void*)&yes, sizeof(yes)) < 0)
 		ferr("Error on setsockopt");
+	
+	/* prefer this socket for requests that came in on its CPU */
+	if (cpu != -1 && setsockopt(sock, SOL_SOCKET, SO_INCOMING_CPU,
+		&cpu, sizeof(cpu)) < 0)
+		perror("SO_INCOMING_CPU");
 		
 	memset(&serv_addr, 0, sizeof(serv_addr));
 	serv_addr.sin6_family = AF_INET6; /* IPv6 */
-	serv_addr.sin6_port = htons(17); /* spec specifies port 17*/
+	serv_addr.sin6_port = htons(port);
 	serv_addr.sin6_addr = ia; /* use local ip */
 		
 	if (bind(sock, (struct sockaddr *)&serv_addr,
 		sizeof(serv_addr)) < 0)
 		ferr("Error on binding socket");
 	
-	#if COMPILE_AUTOUPDATE
-	/* socket input */
-	fdlist[0].fd = sock;
-	fdlist[0].events = POLLIN;
+	if (type == SOCK_STREAM && listen(sock, SOMAXCONN) < 0)
+		ferr("Error on listen");
 	
-	/* inotify quotefile */
-	fdlist[1].fd = watchfd;
-	fdlist[1].events = POLLIN;
-	#endif
+	return sock;
+}
+
+/* Makes the kernel hand a request to the worker pinned to the CPU it
+ * came in on, and to cpu % n if there is none. Sockets in a
+ * SO_REUSEPORT group are numbered in the order they were bound, which
+ * is the order of the workers */
+void steer_workers(struct Worker * workers, int n, int tcp)
+{
+	struct sock_filter code[2 * MAX_WORKERS + 3];
+	struct sock_fprog prog;
+	unsigned short len = 0;
 	
-	while (1)
+	code[len++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+		SKF_AD_OFF + SKF_AD_CPU);
+	
+	for (int i = 0; i < n; i++)
 	{
-		#if COMPILE_AUTOUPDATE
-		r = poll(fdlist, fdlen, -1);
-		if (r < 0)
+		/* if (cpu == workers[i].cpu) return i; */
+		code[len++] = (struct sock_filter)BPF_JUMP(
+			BPF_JMP | BPF_JEQ | BPF_K, workers[i].cpu, 0, 1);
+		code[len++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, i);
+	}
+	
+	code[len++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_MOD | BPF_K,
+		n);
+	code[len++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_A, 0);
+	
+	prog.len = len;
+	prog.filter = code;
+	
+	/* one socket is enough, it goes for the whole group */
+	if (setsockopt(tcp ? workers[0].lsock : workers[0].sock, SOL_SOCKET,
+		SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0)
+		ferr("SO_ATTACH_REUSEPORT_CBPF");
+}
+
+/* Closes a connection with a RST, so it doesn't sit in TIME_WAIT
+ * here for a minute. Whatever the client didn't ack yet is thrown
+ * away, so this is for once it has, or to turn a client away */
+void rst_close(int fd)
+{
+	struct linger l = { .l_onoff = 1, .l_linger = 0 };
+	
+	setsockopt(fd, SOL_SOCKET, SO_LINGER, &l, sizeof(l));
+	close(fd);
+}
+
+/* whether everything sent on fd has been acked */
+int acked(int fd)
+{
+	int outq;
+	
+	return ioctl(fd, SIOCOUTQ, &outq) == 0 && outq == 0;
+}
+
+/* Closes a connection with all of its quote in the socket buffer, to
+ * go out with a FIN after it. Anything the client said that we didn't
+ * read would make that a RST, so it is read first */
+void orderly_close(int fd)
+{
+	char buf[BUF_SIZE];
+	
+	while (recv(fd, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+		;
+	close(fd);
+}
+
+/* Sends a TCP client its quote, and resets the connection once the
+ * client acked everything. With -O the FIN goes after the quote once
+ * it is all in the socket buffer, and the client waits in pend until
+ * it hangs up too. Until then it waits in pend, with a copy of what
+ * didn't fit */
+void tcp_quote(struct Worker * w, int fd, const char * q, uint32_t qlen,
+	uint32_t now)
+{
+	struct Pending * p;
+	ssize_t r = send(fd, q, qlen, MSG_DONTWAIT | MSG_NOSIGNAL);
+	
+	if (r < 0)
+	{
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
 		{
-			/* EINTR is when there was an intteruption and the syscall
-			 * fails. So do not fatal error, but try again! */
-			if (errno == EINTR)
-			{
+			close(fd);
+			return;
+		}
+		r = 0;
+	}
+	
+	if ((size_t)r == qlen)
+	{
+		if (!tcp_fin && acked(fd))
+		{
+			rst_close(fd);
+			return;
+		}
+		if (tcp_fin)
+			shutdown(fd, SHUT_WR);
+	}
+	
+	if (w->npend == MAX_PENDING)
+	{
+		/* Too many slow ones. If all of the quote is in the socket
+		 * buffer, the kernel can see this one out, TIME_WAIT and
+		 * all; if not, it is turned away rather than get part of a
+		 * quote that looks like all of it */
+		if ((size_t)r == qlen)
+			orderly_close(fd);
+		else
+			rst_close(fd);
+		return;
+	}
+	
+	p = &w->pend[w->npend];
+	p->fd = fd;
+	p->rest = NULL;
+	p->len = qlen - r;
+	p->since = now;
+	p->eof = 0;
+	
+	if (p->len > 0)
+	{
+		p->rest = malloc(p->len);
+		if (p->rest == NULL)
+		{
+			rst_close(fd);
+			return;
+		}
+		memcpy(p->rest, q + r, p->len);
+	}
+	
+	w->npend++;
+}
+
+/* Accepts waiting TCP clients, up to a batch of them, and sends every
+ * one of them a quote */
+void serve_accepts(struct Worker * w)
+{
+	const struct QuoteList * ql;
+	struct sockaddr_storage sa;
+	socklen_t salen;
+	char s[INET6_ADDRSTRLEN];
+	uint32_t now = now_ms();
+	int fd;
+	
+	atomic_fetch_add(&w->passes, 1);
+	ql = atomic_load(&quotes);
+	
+	for (unsigned int i = 0; i < w->batch.len; i++)
+	{
+		salen = sizeof(sa);
+		fd = accept4(w->lsock, (struct sockaddr *)&sa, &salen,
+			SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0)
+		{
+			if (errno == ECONNABORTED || errno == EINTR)
 				continue;
-			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				perror("Error on accept");
+			break;
+		}
+		
+		if (w->limit != NULL && !limit_take(w, &sa, now))
+		{
+			rst_close(fd);
+			continue;
+		}
+		
+		if (!quiet)
+		{
+			printf("Got connection from %s\n", get_ip_str(
+				(struct sockaddr *)&sa, s, sizeof(s)));
+		}
+		
+		/* the quote goes out before the client says anything */
+		uint32_t qlen;
+		const char * q = pick_quote(w, ql, NULL, 0, &qlen);
+		
+		if (q == NULL)
+		{
+			rst_close(fd);
+			continue;
+		}
+		
+		tcp_quote(w, fd, q, qlen, now);
+	}
+	
+	/* whatever is pending has its own copy */
+	atomic_fetch_add(&w->passes, 1);
+}
 
-			ferr("poll");
+/* Sees the TCP clients in pend along, with what poll said about them
+ * in pfds, and lets go of the ones that are done */
+void serve_pending(struct Worker * w, const struct pollfd * pfds)
+{
+	uint32_t now = now_ms();
+	char buf[BUF_SIZE];
+	ssize_t r;
+	
+	/* backwards, as the last one fills the hole a finished one
+	 * leaves */
+	for (int i = w->npend - 1; i >= 0; i--)
+	{
+		struct Pending * p = &w->pend[i];
+		short ev = pfds[i].revents;
+		int done = 0;
+		
+		if (ev & (POLLERR | POLLHUP))
+		{
+			close(p->fd);
+			done = 1;
+		}
+		else if (ev & POLLIN)
+		{
+			/* anything it says is ignored. If it hung up its side,
+			 * it still gets the rest of its quote */
+			r = recv(p->fd, buf, sizeof(buf), MSG_DONTWAIT);
+			if (r == 0)
+			{
+				p->eof = 1;
+			}
+			else if (r < 0 && errno != EAGAIN)
+			{
+				close(p->fd);
+				done = 1;
+			}
+		}
+		
+		if (!done && p->rest != NULL && (ev & POLLOUT))
+		{
+			r = send(p->fd, p->rest, p->len,
+				MSG_DONTWAIT | MSG_NOSIGNAL);
+			if (r > 0)
+			{
+				p->len -= r;
+				memmove(p->rest, p->rest + r, p->len);
+				if (p->len == 0)
+				{
+					free(p->rest);
+					p->rest = NULL;
+					if (tcp_fin)
+						shutdown(p->fd, SHUT_WR);
+				}
+			}
+			else if (r < 0 && errno != EAGAIN)
+			{
+				close(p->fd);
+				done = 1;
+			}
 		}
 		
-		if (r == 0) continue;
-		/* r > 0 from here */
+		if (!done && p->rest == NULL)
+		{
+			if (p->eof)
+			{
+				/* Without -O it hung up first, and our FIN only
+				 * answers its own, so the TIME_WAIT is on its
+				 * side. With -O ours went first and it is here */
+				close(p->fd);
+				done = 1;
+			}
+			else if (!tcp_fin && acked(p->fd))
+			{
+				rst_close(p->fd);
+				done = 1;
+			}
+		}
 		
-		if (fdlist[0].revents & POLLIN)
+		if (!done && now - p->since > PENDING_MS)
 		{
-			/* socket data available */
-		#endif
-			memset(buf, 0, BUF_SIZE);
+			/* one that didn't get all of its quote is told so */
+			if (p->rest != NULL)
+				rst_close(p->fd);
+			else
+				orderly_close(p->fd);
+			done = 1;
+		}
 		
-			r = recvfrom(sock, buf, BUF_SIZE - 1, 0, 
-				(struct sockaddr *)&cli_addr, &cli_len);
-			
-			printf("Got message from %s\t%s", get_ip_str(
-				(struct sockaddr *)&cli_addr, s, sizeof(s)), buf);
-			
-			ran = rand() % n_quotes; /* modulo bias XD */
+		if (done)
+		{
+			free(p->rest);
+			*p = w->pend[--w->npend];
+		}
+	}
+}
+
+/* serves requests on the worker's socket, forever */
+void * worker_run(void * arg)
+{
+	struct Worker * w = arg;
+	cpu_set_t set;
+	int r;
+	
+	if (w->cpu != -1)
+	{
+		CPU_ZERO(&set);
+		CPU_SET(w->cpu, &set);
+		
+		r = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		if (r != 0)
+			fprintf(stderr, "worker %d: can't pin to cpu %d: %s\n",
+				w->id, w->cpu, strerror(r));
+	}
+	
+	if (w->lsock == -1)
+	{
+		/* UDP only, recvmmsg can do the waiting */
+		while (1)
+		{
+			serve_batch(w, MSG_WAITFORONE);
+		}
+	}
+	
+	while (1)
+	{
+		uint32_t now = now_ms();
+		int timeout = -1, left;
+		
+		w->pfds[0].fd = w->sock;
+		w->pfds[0].events = POLLIN;
+		w->pfds[1].fd = w->lsock;
+		w->pfds[1].events = POLLIN;
+		
+		for (int i = 0; i < w->npend; i++)
+		{
+			struct Pending * p = &w->pend[i];
 			
-			r = sendto(sock, quotes[ran].msg, quotes[ran].len, 0,
-				(struct sockaddr *)&cli_addr, cli_len);
+			/* once it hung up, it would be readable forever */
+			w->pfds[2 + i].fd = p->fd;
+			w->pfds[2 + i].events = (p->eof ? 0 : POLLIN) |
+				(p->rest != NULL ? POLLOUT : 0);
 			
-			if (r < 0)
-				perror("Error on sendto");
+			/* nothing tells us when a quote is acked, so we
+			 * look now and then; with -O the rest only has to
+			 * be given up on in time */
+			if (!tcp_fin && p->rest == NULL && !p->eof)
+				left = PENDING_POLL_MS;
+			else
+				left = p->since + PENDING_MS - now + 1;
+			if (left < 0)
+				left = 0;
+			if (timeout == -1 || left < timeout)
+				timeout = left;
+		}
+		
+		r = poll(w->pfds, 2 + w->npend, timeout);
+		if (r < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			ferr("poll");
+		}
+		
+		/* before accepting more, their pollfds come after these */
+		if (w->npend > 0)
+			serve_pending(w, w->pfds + 2);
+		
+		if (w->pfds[0].revents & POLLIN)
+			serve_batch(w, MSG_DONTWAIT);
+		
+		if (w->pfds[1].revents & POLLIN)
+			serve_accepts(w);
+	}
+	
+	return NULL;
+}
 
-		#if COMPILE_AUTOUPDATE
+#if COMPILE_AUTOUPDATE
+/* Waits until no worker can still be using a quote list that was
+ * replaced before we were called. A worker holding none when we look
+ * picks up the new one next, one halfway through a batch is done
+ * with the old one once its count moves */
+void wait_for_workers(struct Worker * workers, int n)
+{
+	for (int i = 0; i < n; i++)
+	{
+		unsigned long seen = atomic_load(&workers[i].passes);
+		
+		if (seen % 2 == 0)
 			continue;
+		
+		while (atomic_load(&workers[i].passes) == seen)
+			usleep(1000);
+	}
+}
+
+/* Waits for the quote file to change and installs the new list, for
+ * ever. Parsing happens here, so workers keep serving the old list
+ * meanwhile, and keep doing so if the new one is no good */
+void watch_quotes(const char * quotepath, struct Worker * workers,
+	int nworkers)
+{
+	int watchfd; /* inotify watch file descriptor */
+	int wd; /* quotefile directory watch descriptor */
+	char * quotename; /* name of the quotefile in that directory */
+	
+	/* create file descriptor for the inotify api,
+	 * which watches the quote file */
+	watchfd = inotify_init1(0);
+	
+	if (watchfd < 0)
+	{
+		ferr("inotify_init1");
+	}
+
+	/* add watch descriptor for the directory of the quote file.
+	 * qotdc renames a new database into place, which a watch on
+	 * the file itself would never see */
+	char * quotedir = dirname(strdup(quotepath));
+	quotename = basename(strdup(quotepath));
+	
+	wd = inotify_add_watch(watchfd, quotedir,
+		IN_CLOSE_WRITE | IN_MOVED_TO);
+	if (wd < 0)
+	{
+		fprintf(stderr, "Cannot watch %s:", quotedir);
+		ferr("inotify_add_watch");
+	}
+	
+	/* Some systems cannot read integer variables if they 
+	 * are not properly aligned. On other systems, incorrect
+	 * alignment may decrease performance. Hence, the buffer
+	 * used for reading from the inotify file descriptor
+	 * should have the same alignment as
+	 * struct inotify_event. (Taken from man inotify) */
+	char ibuf[1024]
+		__attribute__ ((aligned(
+		__alignof__(struct inotify_event))));
+
+	ssize_t ilen;
+	struct inotify_event * ievent;
+	char * p;
+	
+	/* browse through events */
+	while (1)
+	{
+		ilen = read(watchfd, ibuf, sizeof(ibuf));
+		
+		if (ilen < 0)
+		{
+			/* EINTR is when there was an intteruption and the
+			 * syscall fails. So do not fatal error, but try
+			 * again! */
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			ferr("read");
 		}
 		
-		if (fdlist[1].revents & POLLIN)
+		for (p = ibuf; p < ibuf + ilen;
+			p += sizeof(struct inotify_event))
 		{
-			/* inotify event: quote list might be changed */
-			
-			/* Some systems cannot read integer variables if they 
-			 * are not properly aligned. On other systems, incorrect
-			 * alignment may decrease performance. Hence, the buffer
-			 * used for reading from the inotify file descriptor
-			 * should have the same alignment as
-			 * struct inotify_event. (Taken from man inotify) */
-			char ibuf[1024]
-				__attribute__ ((aligned(
-				__alignof__(struct inotify_event))));
-
-			ssize_t ilen;
-			struct inotify_event * ievent;
-			char * p;
+			ievent = (struct inotify_event *)p;
 			
-			/* browse through events */
-			while (1)
+			if (ievent->len &&
+				strcmp(ievent->name, quotename) == 0)
 			{
-				ilen = read(watchfd, ibuf, sizeof(ibuf));
+				/* might be changed! reparse quote list */
+				printf("Quote list has been changed, installing new one...\n");
 				
-				if (ilen < 0 &&
-					!(errno == EAGAIN || errno == EWOULDBLOCK))
+				struct QuoteList * nq = malloc(sizeof(*nq));
+				struct QuoteList * old = atomic_load(&quotes);
+				int appended;
+				
+				if (nq == NULL)
 				{
-					/* EAGAIN/EWOULDBLOCK is when read() would
-					 * block in order to read data(See `man read`)*/
-					ferr("read");
+					perror("malloc");
+					break;
 				}
 				
-				if (ilen <= 0)
+				/* only parse what was added, if that is all that
+				 * happened */
+				appended = append_quote_list(quotepath, old, nq);
+				if (appended && nq->len == old->len)
 				{
+					printf("No new quotes.\n");
+					free(nq);
 					break;
 				}
-				
-				for (p = ibuf; p < ibuf + ilen;
-					p += sizeof(struct inotify_event))
+				if (appended)
 				{
-					ievent = (struct inotify_event *)p;
-					
-					if (ievent->mask & IN_CLOSE_WRITE)
-					{
-						/* might be changed! reparse quote list */
-						printf("Quote list has been changed, installing new one...\n");
-						
-						size_t nq_len;
-						struct Quote * nq = parse_quote_list(
-							quotepath, &nq_len);
-						if (nq == NULL)
-						{
-							printf("New quote list has no quotes! Abort.\n");
-							break;
-						}
-						
-						/* all good, update! */
-						free_quote_list(quotes, n_quotes);
-						quotes = nq;
-						n_quotes = nq_len;
-						
-						/* break..? */
-						break;
-					}
-					
-					if (ievent->len)
-					{
-						/*printf("%s\n", ievent->name);*/
-						p += ievent->len;
-					}
+					printf("%zu quotes added.\n", nq->len - old->len);
 				}
+				else if (!load_quote_list(quotepath, nq))
+				{
+					printf("New quote list has no quotes! Keeping the old one.\n");
+					free(nq);
+					break;
+				}
+				
+				/* all good, update! An appended list still uses
+				 * the arena, index and weights of the old one */
+				old = atomic_exchange(&quotes, nq);
+				wait_for_workers(workers, nworkers);
+				if (!appended)
+					free_quote_list(old);
+				else
+					free_appended_quote_list(old, nq);
+				free(old);
+				
+				/* break..? */
+				break;
+			}
+			
+			if (ievent->len)
+			{
+				/*printf("%s\n", ievent->name);*/
+				p += ievent->len;
 			}
-			continue;
 		}
-		#endif
 	}
 	
-	close(sock);
-	#if COMPILE_AUTOUPDATE
 	close(watchfd);
-	#endif
+}
+#endif
+
+int main(int argc, char **argv)
+{
+	int opt, r, i;
+	int port = 17; /* spec specifies port 17 */
+	int batch_len = BATCH_LEN;
+	int nworkers = 1;
+	int pin = 0;
+	int steer = 0;
+	int tcp = 0;
+	cpu_set_t cpus;
+	struct Worker * workers;
+
+	while ((opt = getopt(argc, argv, "qtOp:b:w:PSr:m:A:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'q': quiet = 1; break;
+			case 't': tcp = 1; break;
+			case 'O': tcp_fin = 1; break;
+			case 'p': port = atoi(optarg); break;
+			case 'b': batch_len = atoi(optarg); break;
+			case 'w': nworkers = atoi(optarg); break;
+			case 'P': pin = 1; break;
+			case 'S': pin = steer = 1; break;
+			case 'r':
+				limit_burst = 0;
+				if (sscanf(optarg, "%f,%f", &limit_rate,
+					&limit_burst) < 1)
+					limit_rate = -1;
+				break;
+			case 'm':
+				if (sscanf(optarg, "%d,%d", &prefix4, &prefix6) != 2)
+					prefix4 = -1;
+				break;
+			case 'A': max_ratio = atof(optarg); break;
+			default:
+				fprintf(stderr, "Usage: %s [-q] [-t [-O]] [-p port] [-b batch] [-w workers] [-P] [-S] [-r rate[,burst]] [-m v4 bits,v6 bits] [-A ratio] [filename]\n", argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+	
+	if (batch_len < 1 || batch_len > MAX_BATCH)
+	{
+		fprintf(stderr, "Batch can be 1 to %d requests\n", MAX_BATCH);
+		return EXIT_FAILURE;
+	}
+	
+	if (nworkers < 1 || nworkers > MAX_WORKERS)
+	{
+		fprintf(stderr, "Can have 1 to %d workers\n", MAX_WORKERS);
+		return EXIT_FAILURE;
+	}
+	
+	if (limit_rate < 0 || limit_burst < 0)
+	{
+		fprintf(stderr, "-r wants a rate, and maybe a burst, like 10,20\n");
+		return EXIT_FAILURE;
+	}
+	if (limit_rate > 0 && limit_burst == 0)
+		limit_burst = 2 * limit_rate;
+	if (limit_rate > 0 && limit_burst < 1)
+		limit_burst = 1; /* or nothing would ever get through */
+	
+	if (prefix4 < 0 || prefix4 > 32 || prefix6 < 0 || prefix6 > 128)
+	{
+		fprintf(stderr, "-m wants prefix lengths, like 24,64\n");
+		return EXIT_FAILURE;
+	}
+	
+	if (max_ratio < 0)
+	{
+		fprintf(stderr, "-A wants a ratio, like 2\n");
+		return EXIT_FAILURE;
+	}
+	
+	if (limit_rate > 0 &&
+		getrandom(&limit_key, sizeof(limit_key), 0) != sizeof(limit_key))
+		limit_key = time(NULL) ^ ((uint64_t)getpid() << 32);
+	
+	char * quotepath = optind < argc ? argv[optind] : "quotes.txt";
+
+	struct QuoteList * ql = malloc(sizeof(*ql));
+	
+	if (ql == NULL || !load_quote_list(quotepath, ql))
+	{
+		fprintf(stderr, "No quotes in list!\n");
+		exit(EXIT_FAILURE);
+	}
+	atomic_store(&quotes, ql);
+	
+	if (pin && sched_getaffinity(0, sizeof(cpus), &cpus) == -1)
+	{
+		perror("sched_getaffinity");
+		pin = steer = 0;
+	}
+	
+	workers = calloc(nworkers, sizeof(struct Worker));
+	if (workers == NULL)
+		ferr("malloc");
+	
+	for (i = 0; i < nworkers; i++)
+	{
+		struct Worker * w = &workers[i];
+		
+		w->id = i;
+		w->cpu = -1;
+		
+		if (pin)
+		{
+			/* the i-th CPU we are allowed on, wrapping around */
+			int n = i % CPU_COUNT(&cpus);
+			
+			for (w->cpu = 0; ; w->cpu++)
+			{
+				if (CPU_ISSET(w->cpu, &cpus) && n-- == 0)
+					break;
+			}
+		}
+		
+		rng_seed(w->rng);
+		w->sock = make_socket(SOCK_DGRAM, port, w->cpu);
+		w->lsock = -1;
+		init_batch(&w->batch, batch_len);
 		
+		if (tcp)
+		{
+			w->lsock = make_socket(SOCK_STREAM, port, w->cpu);
+			fcntl(w->lsock, F_SETFL, O_NONBLOCK);
+			
+			w->pend = calloc(MAX_PENDING, sizeof(struct Pending));
+			w->pfds = calloc(2 + MAX_PENDING, sizeof(struct pollfd));
+			if (w->pend == NULL || w->pfds == NULL)
+				ferr("malloc");
+		}
+		
+		if (limit_rate > 0 && i == 0)
+		{
+			struct Bucket full = { limit_burst, now_ms() };
+			
+			w->limit = calloc(LIMIT_ROWS, sizeof(*w->limit));
+			if (w->limit == NULL)
+				ferr("malloc");
+			
+			/* everyone starts out with a full bucket */
+			for (int j = 0; j < LIMIT_ROWS; j++)
+				for (int k = 0; k < LIMIT_COLS; k++)
+					atomic_init(&w->limit[j][k], full);
+		}
+		else if (limit_rate > 0)
+		{
+			w->limit = workers[0].limit;
+		}
+	}
+	
+	if (steer)
+	{
+		steer_workers(workers, nworkers, 0);
+		if (tcp)
+			steer_workers(workers, nworkers, 1);
+	}
+	
+	for (i = 0; i < nworkers; i++)
+	{
+		r = pthread_create(&workers[i].tid, NULL, worker_run,
+			&workers[i]);
+		if (r != 0)
+		{
+			fprintf(stderr, "pthread_create: %s\n", strerror(r));
+			exit(EXIT_FAILURE);
+		}
+	}
+	
+	#if COMPILE_AUTOUPDATE
+	watch_quotes(quotepath, workers, nworkers);
+	#endif
+	
+	/* workers never stop */
+	pthread_join(workers[0].tid, NULL);
+	
 	return 0;
 }
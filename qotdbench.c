@@ -0,0 +1,492 @@
+/*
+ * qotdbench.c - Measures how many requests per second qotd answers,
+ *               one request per syscall versus batches of them,
+ *               and one worker versus more
+ *
+ * usage: qotdbench [-x path to qotd] [-f quote file] [-B max batch]
+ *                  [-W max workers] [-P] [-T] [-c clients] [-s seconds]
+ *        qotdbench -d draws [-f quote file]
+ *
+ * Starts qotd on loopback with -b 1, then -b 4, 16 ... up to -B (64
+ * by default), and has a few clients fire requests at it for a few
+ * seconds each time. -b 1 is the old one recvfrom/sendto per request
+ * loop. Prints the replies per second and the CPU time qotd spent per
+ * reply for every batch size.
+ *
+ * With -W it runs qotd with -w 1, -w 2 ... -W instead, all at the
+ * largest batch size, to see how it scales. -P is passed on to qotd
+ * as -S, to pin and steer its workers.
+ *
+ * -T does it all over TCP (qotd -t): every client connects, reads its
+ * quote until qotd hangs up, and connects again, so what comes out is
+ * connections per second.
+ *
+ * Each client keeps up to WINDOW requests in flight, and gives up on
+ * the ones that are missing when nothing came back for a while, so a
+ * full socket buffer dropping some does not stall it.
+ *
+ * The clients run on the same machine, so they compete with qotd for
+ * CPUs; the CPU time per reply is the number to look at on a small
+ * box. This finds out how fast qotd can go; qotdload sees how it does
+ * at a set rate, and what the response times are.
+ *
+ * -d runs no qotd at all, but picks quotes from the quote file the way
+ * it does, that many times. It checks that every quote came up about
+ * as often as its weight says with a chi-square test, and times a
+ * pick against the rand_r() % count qotd used to do.
+ *
+ * compile with: cc -pthread qotdbench.c -o qotdbench -lm
+ *
+ * This code is released into the P U B L I C  D O M A I N!
+ *
+ */
+
+#define _GNU_SOURCE /* recvmmsg, sendmmsg, mremap in quotes.h */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h> /* PRIu64 */
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/resource.h> /* wait4 */
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "quotes.h" /* for -d */
+
+#define QOTD_PORT 19917
+#define BURST 32 /* requests per sendmmsg */
+#define WINDOW 256 /* requests in flight per client */
+#define LOST_MS 20 /* nothing back for this long, the rest is lost */
+#define MAX_CLIENTS 64
+#define REPLY_LEN 2048 /* longer quotes get cut off, which is fine */
+
+atomic_uint_fast64_t replies; /* answers that came back */
+atomic_int stop; /* tells the clients to quit */
+int tcp; /* -T */
+
+/* fires requests at qotd and counts the replies until told to stop */
+void * client(void * arg)
+{
+	int fd = (int)(intptr_t)arg;
+	struct mmsghdr out[BURST], in[BURST];
+	struct iovec out_iov, in_iov[BURST];
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	char * buf = malloc(BURST * REPLY_LEN);
+	char req[] = "gimme\n";
+	int inflight = 0;
+	int n;
+
+	out_iov.iov_base = req;
+	out_iov.iov_len = sizeof(req) - 1;
+
+	memset(out, 0, sizeof(out));
+	memset(in, 0, sizeof(in));
+	for (int i = 0; i < BURST; i++) {
+		/* the socket is connected, so no addresses */
+		out[i].msg_hdr.msg_iov = &out_iov;
+		out[i].msg_hdr.msg_iovlen = 1;
+
+		in_iov[i].iov_base = buf + i * REPLY_LEN;
+		in_iov[i].iov_len = REPLY_LEN;
+		in[i].msg_hdr.msg_iov = &in_iov[i];
+		in[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	while (!atomic_load(&stop)) {
+		if (inflight + BURST <= WINDOW) {
+			n = sendmmsg(fd, out, BURST, 0);
+			if (n > 0)
+				inflight += n;
+			/* no room in the socket buffer is fine, read first */
+			else if (errno != EAGAIN && errno != ENOBUFS)
+				ferr("sendmmsg");
+		}
+
+		n = recvmmsg(fd, in, BURST, MSG_DONTWAIT, NULL);
+		if (n > 0) {
+			atomic_fetch_add(&replies, (uint64_t)n);
+			inflight -= n;
+			if (inflight < 0)
+				inflight = 0;
+			continue;
+		}
+
+		if (inflight + BURST > WINDOW &&
+				poll(&pfd, 1, LOST_MS) == 0)
+			inflight = 0;
+	}
+
+	free(buf);
+
+	return NULL;
+}
+
+/* connects a UDP socket, or with -T a TCP one, to qotd */
+int connect_qotd(void)
+{
+	struct sockaddr_in6 a;
+	int fd = socket(AF_INET6, tcp ? SOCK_STREAM : SOCK_DGRAM, 0);
+
+	if (fd == -1)
+		ferr("socket");
+
+	memset(&a, 0, sizeof(a));
+	a.sin6_family = AF_INET6;
+	a.sin6_port = htons(QOTD_PORT);
+	a.sin6_addr = in6addr_loopback;
+
+	for (int tries = 0; connect(fd, (struct sockaddr *)&a, sizeof(a)) == -1;
+			tries++) {
+		/* qotd may still be starting up */
+		if (!tcp || tries == 100)
+			ferr("connect");
+
+		close(fd);
+		usleep(20000);
+		fd = socket(AF_INET6, SOCK_STREAM, 0);
+		if (fd == -1)
+			ferr("socket");
+	}
+
+	return fd;
+}
+
+/* fetches quotes over TCP, one connection each, until told to stop */
+void * tcp_client(void * arg)
+{
+	char * buf = malloc(REPLY_LEN);
+	ssize_t n;
+	int fd;
+
+	(void)arg;
+
+	while (!atomic_load(&stop)) {
+		fd = connect_qotd();
+
+		/* qotd resets the connection once we have it all */
+		while ((n = recv(fd, buf, REPLY_LEN, 0)) > 0)
+			;
+		if (n == 0 || errno == ECONNRESET)
+			atomic_fetch_add(&replies, 1);
+
+		close(fd);
+	}
+
+	free(buf);
+
+	return NULL;
+}
+
+/* waits for qotd to answer, so we do not measure it starting up */
+void wait_qotd(int fd)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	char buf[REPLY_LEN];
+
+	for (int tries = 0; tries < 100; tries++) {
+		send(fd, "hi\n", 3, 0);
+		if (poll(&pfd, 1, 50) == 1 && recv(fd, buf, sizeof(buf), 0) > 0)
+			return;
+
+		/* not listening yet makes the recv fail right away */
+		usleep(20000);
+	}
+
+	fprintf(stderr, "qotd does not answer\n");
+	exit(EXIT_FAILURE);
+}
+
+/* seconds since some point, for timing */
+double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* The chance the alias table gives quote i: drawn and kept, plus
+ * drawn as another quote whose alias it is. A database has no
+ * weights, so this checks the table was built and stored right */
+double * alias_chances(const struct QuoteList * l)
+{
+	double * p = calloc(l->len, sizeof(*p));
+
+	if (p == NULL)
+		ferr("calloc");
+
+	for (size_t i = 0; i < l->len; i++) {
+		double keep = l->alias[i].prob / 4294967296.0;
+
+		p[i] += keep / l->len;
+		if (l->alias[i].alias < l->len)
+			p[l->alias[i].alias] += (1 - keep) / l->len;
+	}
+
+	return p;
+}
+
+/* picks draws quotes the way qotd does, see -d up top */
+int check_draws(const char * quotes, uint64_t draws)
+{
+	struct QuoteList l;
+	uint64_t s[4];
+	uint64_t * seen;
+	double * chance = NULL;
+	double total = 0, chi2 = 0, expect, min_expect = INFINITY, z, t;
+	size_t df = 0, never = 0;
+	unsigned int seed;
+	volatile size_t sink;
+
+	if (!load_quote_list(quotes, &l)) {
+		fprintf(stderr, "No quotes in list!\n");
+		return EXIT_FAILURE;
+	}
+
+	seen = calloc(l.len, sizeof(*seen));
+	if (seen == NULL)
+		ferr("calloc");
+
+	if (l.weight != NULL) {
+		for (size_t i = 0; i < l.len; i++)
+			total += l.weight[i];
+	} else if (l.alias != NULL) {
+		chance = alias_chances(&l);
+	}
+
+	rng_seed(s);
+	for (uint64_t d = 0; d < draws; d++) {
+		size_t i = sample_quote(&l, s);
+
+		if (i >= l.len) {
+			fprintf(stderr, "Drew quote %zu of %zu\n", i, l.len);
+			return EXIT_FAILURE;
+		}
+		seen[i]++;
+	}
+
+	for (size_t i = 0; i < l.len; i++) {
+		if (l.weight != NULL)
+			expect = draws * (l.weight[i] / total);
+		else if (chance != NULL)
+			expect = draws * chance[i];
+		else
+			expect = (double)draws / l.len;
+
+		if (expect == 0) {
+			/* must never come up, so no part of the test */
+			never += seen[i];
+			continue;
+		}
+
+		chi2 += (seen[i] - expect) * (seen[i] - expect) / expect;
+		if (expect < min_expect)
+			min_expect = expect;
+		df++;
+	}
+	df = df > 1 ? df - 1 : 1;
+
+	/* chi-square with df degrees of freedom is about normal with
+	 * mean df and variance 2 df, for the df a quote file has */
+	z = (chi2 - df) / sqrt(2.0 * df);
+
+	printf("%zu quotes, %" PRIu64 " draws, %s\n", l.len, draws,
+		l.alias != NULL ? "weighted" : "uniform");
+	printf("chi-square %.1f, %zu degrees of freedom, z %.2f\n", chi2, df, z);
+	if (min_expect < 5)
+		printf("fewer than 5 draws expected for some quotes, "
+			"use more draws to trust this\n");
+	if (never > 0)
+		printf("quotes that must never come up did %zu times\n", never);
+	printf("%s\n", never == 0 && fabs(z) < 4 ? "ok" : "FAILED");
+
+	/* and how long a pick takes, against the old way */
+	t = now();
+	for (uint64_t d = 0; d < draws; d++)
+		sink = sample_quote(&l, s);
+	printf("sample_quote\t%.2f ns/pick\n", (now() - t) * 1e9 / draws);
+
+	seed = time(NULL);
+	t = now();
+	for (uint64_t d = 0; d < draws; d++)
+		sink = rand_r(&seed) % l.len;
+	printf("rand_r %% count\t%.2f ns/pick\n", (now() - t) * 1e9 / draws);
+	(void)sink;
+
+	free(seen);
+	free(chance);
+	free_quote_list(&l);
+
+	return never == 0 && fabs(z) < 4 ? 0 : EXIT_FAILURE;
+}
+
+/* runs qotd answering batch requests at a time */
+pid_t start_qotd(const char * path, const char * quotes, int batch,
+	int workers, int pin)
+{
+	char b[16], w[16], port[16];
+	const char * args[16];
+	int n = 0;
+	pid_t pid;
+
+	snprintf(b, sizeof(b), "%d", batch);
+	snprintf(w, sizeof(w), "%d", workers);
+	snprintf(port, sizeof(port), "%d", QOTD_PORT);
+
+	/* or the child prints our buffered output too */
+	fflush(stdout);
+
+	pid = fork();
+	if (pid < 0)
+		ferr("fork");
+
+	if (pid == 0) {
+		args[n++] = path;
+		args[n++] = "-q";
+		if (pin)
+			args[n++] = "-S";
+		if (tcp)
+			args[n++] = "-t";
+		args[n++] = "-p";
+		args[n++] = port;
+		args[n++] = "-b";
+		args[n++] = b;
+		args[n++] = "-w";
+		args[n++] = w;
+		args[n++] = quotes;
+		args[n] = NULL;
+
+		execv(path, (char **)args);
+		ferr("exec qotd");
+	}
+
+	return pid;
+}
+
+int main(int argc, char **argv)
+{
+	const char * path = "./qotd";
+	const char * quotes = "quotes.txt";
+	int max_batch = 64;
+	int max_workers = 0; /* 0: compare batch sizes instead */
+	int pin = 0;
+	int batch, workers;
+	int nclients = 4;
+	int seconds = 5;
+	uint64_t draws = 0;
+	int opt;
+	int fds[MAX_CLIENTS];
+	pthread_t tids[MAX_CLIENTS];
+	uint64_t before, after;
+	double pps, base = 0, cpu;
+	struct rusage ru;
+	pid_t pid;
+
+	while ((opt = getopt(argc, argv, "x:f:B:W:PTc:s:d:")) != -1) {
+		switch (opt) {
+			case 'x': path = optarg; break;
+			case 'f': quotes = optarg; break;
+			case 'B': max_batch = atoi(optarg); break;
+			case 'W': max_workers = atoi(optarg); break;
+			case 'P': pin = 1; break;
+			case 'T': tcp = 1; break;
+			case 'c': nclients = atoi(optarg); break;
+			case 's': seconds = atoi(optarg); break;
+			case 'd': draws = strtoull(optarg, NULL, 10); break;
+			default:
+				fprintf(stderr, "Usage: %s [-x path to qotd] [-f quote file] [-B max batch] [-W max workers] [-P] [-T] [-c clients] [-s seconds]\n"
+					"       %s -d draws [-f quote file]\n", argv[0], argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+
+	if (draws > 0)
+		return check_draws(quotes, draws);
+
+	if (nclients < 1 || nclients > MAX_CLIENTS) {
+		fprintf(stderr, "Can do 1 to %d clients\n", MAX_CLIENTS);
+		return EXIT_FAILURE;
+	}
+
+	if (max_batch < 1) {
+		fprintf(stderr, "Need a batch of at least 1\n");
+		return EXIT_FAILURE;
+	}
+
+	printf("batch\tworkers\t%s\tus CPU/req\tspeedup\n",
+		tcp ? "conn/s" : "req/s");
+
+	batch = max_workers > 0 ? max_batch : 1;
+	workers = 1;
+
+	for (int run = 0; ; run++) {
+		pid = start_qotd(path, quotes, batch, workers, pin);
+
+		/* TCP clients connect for every quote */
+		for (int i = 0; i < nclients; i++)
+			fds[i] = tcp ? -1 : connect_qotd();
+		if (!tcp)
+			wait_qotd(fds[0]);
+
+		atomic_store(&stop, 0);
+		for (int i = 0; i < nclients; i++) {
+			if (pthread_create(&tids[i], NULL, tcp ? tcp_client : client,
+					(void *)(intptr_t)fds[i]) != 0)
+				ferr("pthread_create");
+		}
+
+		/* give it a moment to fill up, then measure */
+		usleep(500000);
+		before = atomic_load(&replies);
+		sleep(seconds);
+		after = atomic_load(&replies);
+
+		atomic_store(&stop, 1);
+		for (int i = 0; i < nclients; i++) {
+			pthread_join(tids[i], NULL);
+			if (fds[i] != -1)
+				close(fds[i]);
+		}
+
+		/* the CPU time covers the warmup and the stragglers too,
+		 * so count those replies as well */
+		kill(pid, SIGTERM);
+		wait4(pid, NULL, 0, &ru);
+		cpu = ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+			(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+
+		pps = (double)(after - before) / seconds;
+		if (run == 0)
+			base = pps;
+
+		printf("%d\t%d\t%.0f\t%.2f\t\t%.2fx\n", batch, workers, pps,
+			cpu * 1e6 / atomic_load(&replies), base > 0 ? pps / base : 0);
+		fflush(stdout);
+
+		atomic_store(&replies, 0);
+
+		if (max_workers > 0) {
+			if (++workers > max_workers)
+				break;
+		} else {
+			/* 1, 4, 16 ... and max_batch last */
+			if (batch == max_batch)
+				break;
+			batch = batch * 4 < max_batch ? batch * 4 : max_batch;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,156 @@
+/*
+ * qotdc.c - Compiles a quote list into a database qotd can map and
+ *           serve from without parsing anything
+ *
+ * usage: qotdc [-o database] [filename]
+ * if filename is not given, quotes.txt will be tried, and if no
+ * database is given, it is written to quotes.db
+ *
+ * The database is written next to where it goes and then renamed over
+ * it, so a qotd that has the old one mapped keeps serving that until
+ * it notices the new one, and never sees half of it.
+ *
+ * The layout is described in quotes.h.
+ *
+ * This code is released into the P U B L I C  D O M A I N!
+ *
+ */
+
+#define _GNU_SOURCE /* mremap, in quotes.h */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "quotes.h"
+
+/* writes all of buf to fd, or dies trying */
+void write_all(int fd, const void * buf, size_t len)
+{
+	const char * p = buf;
+	ssize_t r;
+
+	while (len > 0)
+	{
+		r = write(fd, p, len);
+		if (r < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			ferr("Couldn't write database");
+		}
+		p += r;
+		len -= r;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	const char * dbpath = "quotes.db";
+	const char * quotepath = "quotes.txt";
+	struct QuoteList quotes;
+	struct QuoteDbHeader h;
+	char * tmppath;
+	size_t keys_len = 0;
+	int opt, fd;
+
+	while ((opt = getopt(argc, argv, "o:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'o': dbpath = optarg; break;
+			default:
+				fprintf(stderr, "Usage: %s [-o database] [filename]\n",
+					argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+
+	if (optind < argc)
+	{
+		quotepath = argv[optind];
+	}
+
+	/* a database goes in as well, which is handy for upgrading one
+	 * to a newer version once we have those */
+	if (!load_quote_list(quotepath, &quotes))
+	{
+		fprintf(stderr, "No quotes in list!\n");
+		return EXIT_FAILURE;
+	}
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, QUOTEDB_MAGIC, sizeof(h.magic));
+	h.version = QUOTEDB_VERSION;
+	h.byte_order = QUOTEDB_BYTE_ORDER;
+	h.count = quotes.len;
+	h.index_off = sizeof(h);
+	h.blob_off = h.index_off + (quotes.len + 1) * sizeof(uint32_t);
+	h.blob_len = quotes.arena_len;
+	if (quotes.alias != NULL)
+	{
+		/* so qotd doesn't have to build it */
+		h.alias_off = h.blob_off;
+		h.blob_off += quotes.len * sizeof(struct QuoteAlias);
+	}
+	if (quotes.slots != NULL)
+	{
+		/* one block, slots first, in a database as well */
+		keys_len = keys_size(quotes.nslots, quotes.ncat, quotes.nmembers,
+			quotes.alias != NULL, quotes.keys_len);
+		h.keys_off = h.blob_off;
+		h.nslots = quotes.nslots;
+		h.ncat = quotes.ncat;
+		h.nmembers = quotes.nmembers;
+		h.keys_len = quotes.keys_len;
+		h.blob_off += keys_len;
+	}
+
+	tmppath = malloc(strlen(dbpath) + sizeof(".XXXXXX"));
+	if (tmppath == NULL)
+	{
+		ferr("malloc");
+	}
+	sprintf(tmppath, "%s.XXXXXX", dbpath);
+
+	fd = mkstemp(tmppath);
+	if (fd < 0)
+	{
+		ferr("Couldn't create database");
+	}
+	/* mkstemp makes it 0600, a server running as someone else
+	 * should still be able to read it */
+	fchmod(fd, 0644);
+
+	write_all(fd, &h, sizeof(h));
+	write_all(fd, quotes.index, (quotes.len + 1) * sizeof(uint32_t));
+	if (quotes.alias != NULL)
+		write_all(fd, quotes.alias, quotes.len * sizeof(struct QuoteAlias));
+	if (quotes.slots != NULL)
+		write_all(fd, quotes.slots, keys_len);
+	write_all(fd, quotes.arena, quotes.arena_len);
+
+	if (fsync(fd) < 0 || close(fd) < 0)
+	{
+		unlink(tmppath);
+		ferr("Couldn't write database");
+	}
+
+	if (rename(tmppath, dbpath) < 0)
+	{
+		unlink(tmppath);
+		ferr("Couldn't put database in place");
+	}
+
+	printf("%zu quotes, %zu bytes of quotes, %zu categories written to "
+		"%s\n", quotes.len, quotes.arena_len, quotes.ncat, dbpath);
+
+	free_quote_list(&quotes);
+	free(tmppath);
+
+	return 0;
+}
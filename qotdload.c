@@ -0,0 +1,729 @@
+/*
+ * qotdload.c - Fires UDP requests at qotd at a set rate, from many
+ *              source ports, and measures what comes back
+ *
+ * usage: qotdload [-x path to qotd | -a address] [-p port]
+ *                 [-f quote file] [-w qotd workers] [-e qotd options]
+ *                 [-t threads] [-S scenario file] [-o results file]
+ *                 [-l label] [scenario ...]
+ *
+ * Runs every scenario in turn, against a qotd it starts on loopback
+ * for each of them, or against whatever is at -a. -e passes more
+ * options to that qotd, -e "-r 1000" to see the rate limit at work,
+ * say. Without scenarios it runs the three in DEFAULT_SCENARIOS. A
+ * scenario is a line like
+ *
+ *   bursty rate=50000 seconds=5 sockets=64 sources=1 burst=20/80
+ *
+ * which sends 50000 requests a second on average, from 64 sockets
+ * (source ports), for 5 seconds, all of them in the first 20 of every
+ * 100 ms. sources spreads the sockets over that many addresses,
+ * 127.0.0.1, 127.0.1.1 and up, so each is on a /24 of its own; rate=0
+ * sends as fast as it can. -S reads scenarios from a file, one per
+ * line, # starts a comment, and scenarios on the command line come
+ * after those.
+ *
+ * Requests go out with sendmmsg, a burst to one socket at a time, paced
+ * to the rate. Replies come in with recvmmsg on the sockets epoll says
+ * have any. What is asked for and not answered by the end, after
+ * DRAIN_MS more to come in, is lost. A request the kernel wouldn't
+ * take from us doesn't count as sent.
+ *
+ * A QOTD reply doesn't say which request it answers, so response times
+ * come from a probe: one more socket that sends a request every
+ * PROBE_US and waits for the reply, while the load is going on.
+ *
+ * For every scenario it prints a line, and with -o appends a JSON
+ * object on a line of its own to the results file, labelled with -l
+ * (say, the commit), so runs of different builds can be compared.
+ * The CPU time qotd took per reply is there too, if we started it.
+ *
+ * Everything runs on the same machine, so the load and qotd compete
+ * for CPUs; on a small box, a rate qotd can't keep up with may be one
+ * we can't either, which shows as a lower rate sent than asked for.
+ *
+ * compile with: cc -pthread qotdload.c -o qotdload
+ *
+ * This code is released into the P U B L I C  D O M A I N!
+ *
+ */
+
+#define _GNU_SOURCE /* recvmmsg, sendmmsg */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/resource.h> /* wait4 */
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "hist.h"
+
+#define QOTD_PORT 19917
+#define BURST 32 /* requests per sendmmsg, replies per recvmmsg */
+#define REPLY_LEN 2048 /* longer quotes get cut off, which is fine */
+#define MAX_THREADS 64
+#define MAX_SOCKETS 65536
+#define MAX_SCENARIOS 64
+#define MAX_ARGS 32 /* options for qotd, with -e */
+#define DRAIN_MS 200 /* replies that take longer than this are lost */
+#define PROBE_US 1000 /* time between probes */
+#define SLEEP_US 1000 /* longest nap when there is nothing to do */
+
+#define DEFAULT_SCENARIOS \
+	"uniform rate=20000 seconds=5 sockets=64\n" \
+	"bursty rate=20000 seconds=5 sockets=64 burst=20/80\n" \
+	"many-sources rate=20000 seconds=5 sockets=1024 sources=1024\n"
+
+struct Scenario
+{
+	char name[32];
+	double rate; /* requests a second, on average; 0 is flat out */
+	int seconds;
+	int sockets;
+	int sources;
+	int on_ms, off_ms; /* off_ms 0 is a steady rate */
+};
+
+/* one thread's share of the load */
+struct Loader
+{
+	pthread_t tid;
+	int * fds;
+	int nfds;
+	double rate; /* its share */
+	uint64_t sent;
+	uint64_t unsent; /* the kernel wouldn't take them */
+	uint64_t replies;
+};
+
+const struct Scenario * cur; /* the scenario running */
+struct sockaddr_storage target;
+socklen_t target_len;
+int64_t start_ns; /* when the load started */
+atomic_int stop; /* stop sending */
+atomic_int done; /* stop reading replies too */
+struct Hist probe_hist; /* ns */
+uint64_t probes, probes_lost;
+pid_t qotd_pid = -1; /* the qotd we started, while it runs */
+
+/* stops the qotd we started, if it runs. Returns the CPU time it took,
+ * in seconds, -1 if there was none */
+double stop_qotd(void)
+{
+	struct rusage ru;
+
+	if (qotd_pid == -1)
+		return -1;
+
+	kill(qotd_pid, SIGTERM);
+	while (wait4(qotd_pid, NULL, 0, &ru) == -1 && errno == EINTR)
+		;
+	qotd_pid = -1;
+
+	return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+		(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+/* prints msg, with error details, and exits; not leaving a qotd
+ * behind on the port */
+void ferr(const char * msg)
+{
+	perror(msg);
+	stop_qotd();
+	exit(EXIT_FAILURE);
+}
+
+int64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* writes s to f as a JSON string */
+void json_string(FILE * f, const char * s)
+{
+	putc('"', f);
+	for (; *s != '\0'; s++) {
+		if (*s == '"' || *s == '\\')
+			fprintf(f, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			fprintf(f, "\\u%04x", *s);
+		else
+			putc(*s, f);
+	}
+	putc('"', f);
+}
+
+/* Reads a scenario from line into s. Returns 0 if it isn't one */
+int parse_scenario(const char * line, struct Scenario * s)
+{
+	char word[64];
+	int n;
+
+	memset(s, 0, sizeof(*s));
+	s->rate = 10000;
+	s->seconds = 5;
+	s->sockets = 64;
+	s->sources = 1;
+
+	if (sscanf(line, "%31s%n", s->name, &n) != 1)
+		return 0;
+	line += n;
+
+	while (sscanf(line, "%63s%n", word, &n) == 1) {
+		line += n;
+
+		if (sscanf(word, "rate=%lf", &s->rate) == 1 ||
+				sscanf(word, "seconds=%d", &s->seconds) == 1 ||
+				sscanf(word, "sockets=%d", &s->sockets) == 1 ||
+				sscanf(word, "sources=%d", &s->sources) == 1 ||
+				sscanf(word, "burst=%d/%d", &s->on_ms, &s->off_ms) == 2)
+			continue;
+
+		fprintf(stderr, "%s: don't know %s\n", s->name, word);
+		return 0;
+	}
+
+	if (s->rate < 0 || s->seconds < 1 || s->sockets < 1 ||
+			s->sockets > MAX_SOCKETS || s->sources < 1 ||
+			s->sources > s->sockets || s->sources > 65536 ||
+			(s->off_ms > 0 && s->on_ms < 1) || s->off_ms < 0) {
+		fprintf(stderr, "%s: out of range\n", s->name);
+		return 0;
+	}
+
+	return 1;
+}
+
+/* Adds the scenarios in text, a line each, to list. Returns how many
+ * there are now, or -1 if one isn't right */
+int add_scenarios(char * text, struct Scenario * list, int n)
+{
+	for (char * line = strtok(text, "\n"); line != NULL;
+			line = strtok(NULL, "\n")) {
+		char * hash = strchr(line, '#');
+		char word[2];
+
+		if (hash != NULL)
+			*hash = '\0';
+		if (sscanf(line, "%1s", word) != 1)
+			continue;
+
+		if (n == MAX_SCENARIOS) {
+			fprintf(stderr, "Can do %d scenarios\n", MAX_SCENARIOS);
+			return -1;
+		}
+		if (!parse_scenario(line, &list[n++]))
+			return -1;
+	}
+
+	return n;
+}
+
+/* how many requests should have gone out t ns into the scenario */
+double due(const struct Scenario * s, int64_t t)
+{
+	double on_ns, period_ns;
+	int64_t periods, rest;
+
+	if (s->off_ms == 0)
+		return s->rate * t / 1e9;
+
+	/* all of a period's requests go out in its on part */
+	on_ns = s->on_ms * 1e6;
+	period_ns = (s->on_ms + s->off_ms) * 1e6;
+	periods = t / (int64_t)period_ns;
+	rest = t - periods * (int64_t)period_ns;
+
+	return s->rate * (periods * period_ns +
+		(rest < on_ns ? rest : on_ns) * period_ns / on_ns) / 1e9;
+}
+
+/* A UDP socket connected to the target, from source address number
+ * src on loopback. Non-blocking, with room for a lot of replies */
+int connect_socket(int src)
+{
+	int fd = socket(target.ss_family, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+	int rcvbuf = 1 << 20;
+
+	if (fd == -1)
+		ferr("socket");
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+	if (src > 0) {
+		/* 127.0.0.1 is 0, the rest are a /24 further each */
+		struct sockaddr_in a;
+
+		memset(&a, 0, sizeof(a));
+		a.sin_family = AF_INET;
+		a.sin_addr.s_addr = htonl(0x7f000001 + (src << 8));
+		if (bind(fd, (struct sockaddr *)&a, sizeof(a)) == -1)
+			ferr("bind source");
+	}
+
+	if (connect(fd, (struct sockaddr *)&target, target_len) == -1)
+		ferr("connect");
+
+	return fd;
+}
+
+/* sends its share of the scenario, and counts the replies */
+void * loader(void * arg)
+{
+	struct Loader * l = arg;
+	struct mmsghdr out[BURST], in[BURST];
+	struct iovec out_iov, in_iov[BURST];
+	struct epoll_event ev[BURST];
+	char * buf = malloc(BURST * REPLY_LEN);
+	char req[] = "gimme\n";
+	int next = 0; /* socket for the next burst */
+	int ep = epoll_create1(0);
+	int n, busy;
+
+	if (buf == NULL || ep == -1)
+		ferr("loader");
+
+	out_iov.iov_base = req;
+	out_iov.iov_len = sizeof(req) - 1;
+
+	memset(out, 0, sizeof(out));
+	memset(in, 0, sizeof(in));
+	for (int i = 0; i < BURST; i++) {
+		/* the sockets are connected, so no addresses */
+		out[i].msg_hdr.msg_iov = &out_iov;
+		out[i].msg_hdr.msg_iovlen = 1;
+
+		in_iov[i].iov_base = buf + i * REPLY_LEN;
+		in_iov[i].iov_len = REPLY_LEN;
+		in[i].msg_hdr.msg_iov = &in_iov[i];
+		in[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	for (int i = 0; i < l->nfds; i++) {
+		struct epoll_event e = { .events = EPOLLIN, .data.fd = l->fds[i] };
+
+		if (epoll_ctl(ep, EPOLL_CTL_ADD, l->fds[i], &e) == -1)
+			ferr("epoll_ctl");
+	}
+
+	while (!atomic_load(&done)) {
+		busy = 0;
+
+		if (!atomic_load(&stop)) {
+			/* catch up a burst at a time, so replies get read
+			 * in between */
+			double owed = cur->rate > 0 ?
+				due(cur, now_ns() - start_ns) * l->rate / cur->rate -
+				(l->sent + l->unsent) : BURST;
+
+			if (owed >= 1) {
+				int k = owed < BURST ? (int)owed : BURST;
+
+				n = sendmmsg(l->fds[next], out, k, 0);
+				if (n < 0) {
+					if (errno != EAGAIN && errno != ENOBUFS &&
+							errno != ECONNREFUSED)
+						ferr("sendmmsg");
+					n = 0;
+				}
+				l->sent += n;
+				l->unsent += k - n;
+				next = (next + 1) % l->nfds;
+				busy = 1;
+			}
+		}
+
+		n = epoll_wait(ep, ev, BURST, 0);
+		for (int i = 0; i < n; i++) {
+			int r = recvmmsg(ev[i].data.fd, in, BURST, MSG_DONTWAIT,
+				NULL);
+
+			if (r > 0) {
+				l->replies += r;
+				busy = 1;
+			}
+		}
+
+		if (!busy) {
+			/* nothing due yet, and nothing came in; don't take
+			 * the CPU from qotd */
+			struct timespec ts = { 0, 20000 };
+
+			if (atomic_load(&stop)) {
+				epoll_wait(ep, ev, 1, SLEEP_US / 1000);
+				continue;
+			}
+			nanosleep(&ts, NULL);
+		}
+	}
+
+	close(ep);
+	free(buf);
+
+	return NULL;
+}
+
+/* asks for a quote every PROBE_US and times the answer */
+void * prober(void * arg)
+{
+	struct pollfd pfd = { .fd = connect_socket(0), .events = POLLIN };
+	char buf[REPLY_LEN];
+	int64_t t;
+
+	(void)arg;
+
+	while (!atomic_load(&stop)) {
+		t = now_ns();
+		send(pfd.fd, "probe\n", 6, 0);
+		probes++;
+
+		if (poll(&pfd, 1, DRAIN_MS) == 1 &&
+				recv(pfd.fd, buf, sizeof(buf), 0) > 0)
+			hist_add(&probe_hist, now_ns() - t);
+		else
+			probes_lost++;
+
+		t = PROBE_US * 1000 - (now_ns() - t);
+		if (t > 0) {
+			struct timespec ts = { 0, t };
+
+			nanosleep(&ts, NULL);
+		}
+	}
+
+	close(pfd.fd);
+
+	return NULL;
+}
+
+/* waits for the target to answer, so we do not measure it starting
+ * up */
+void wait_qotd(void)
+{
+	struct pollfd pfd = { .fd = connect_socket(0), .events = POLLIN };
+	char buf[REPLY_LEN];
+
+	for (int tries = 0; tries < 100; tries++) {
+		send(pfd.fd, "hi\n", 3, 0);
+		if (poll(&pfd, 1, 50) == 1 && recv(pfd.fd, buf, sizeof(buf), 0) > 0) {
+			close(pfd.fd);
+			return;
+		}
+
+		/* not listening yet makes the recv fail right away */
+		usleep(20000);
+	}
+
+	fprintf(stderr, "qotd does not answer\n");
+	stop_qotd();
+	exit(EXIT_FAILURE);
+}
+
+/* runs qotd on port, with the options in extra split at spaces */
+void start_qotd(const char * path, const char * quotes, int port,
+	int workers, const char * extra)
+{
+	char w[16], p[16];
+	char * more = strdup(extra);
+	const char * args[MAX_ARGS + 8];
+	int n = 0;
+	pid_t pid;
+
+	snprintf(w, sizeof(w), "%d", workers);
+	snprintf(p, sizeof(p), "%d", port);
+
+	args[n++] = path;
+	args[n++] = "-q";
+	args[n++] = "-p";
+	args[n++] = p;
+	args[n++] = "-w";
+	args[n++] = w;
+	for (char * a = strtok(more, " "); a != NULL && n < MAX_ARGS + 6;
+			a = strtok(NULL, " "))
+		args[n++] = a;
+	args[n++] = quotes;
+	args[n] = NULL;
+
+	/* or the child prints our buffered output too */
+	fflush(stdout);
+
+	pid = fork();
+	if (pid < 0)
+		ferr("fork");
+
+	if (pid == 0) {
+		execv(path, (char **)args);
+		perror("exec qotd");
+		_exit(EXIT_FAILURE);
+	}
+
+	qotd_pid = pid;
+	free(more);
+}
+
+int main(int argc, char **argv)
+{
+	const char * path = "./qotd";
+	const char * quotes = "quotes.txt";
+	const char * address = NULL;
+	const char * results = NULL;
+	const char * label = "";
+	const char * file = NULL;
+	const char * extra = "";
+	int port = QOTD_PORT;
+	int workers = 1;
+	int nthreads = 1;
+	int opt, n = 0;
+	struct Scenario * list = calloc(MAX_SCENARIOS, sizeof(*list));
+	struct Loader loaders[MAX_THREADS];
+	FILE * out = NULL;
+	struct rlimit files;
+	char * text;
+
+	while ((opt = getopt(argc, argv, "x:a:p:f:w:e:t:S:o:l:")) != -1) {
+		switch (opt) {
+			case 'x': path = optarg; break;
+			case 'a': address = optarg; break;
+			case 'p': port = atoi(optarg); break;
+			case 'f': quotes = optarg; break;
+			case 'w': workers = atoi(optarg); break;
+			case 'e': extra = optarg; break;
+			case 't': nthreads = atoi(optarg); break;
+			case 'S': file = optarg; break;
+			case 'o': results = optarg; break;
+			case 'l': label = optarg; break;
+			default:
+				fprintf(stderr, "Usage: %s [-x path to qotd | -a address] [-p port] [-f quote file] [-w qotd workers] [-e qotd options] [-t threads] [-S scenario file] [-o results file] [-l label] [scenario ...]\n", argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+
+	if (nthreads < 1 || nthreads > MAX_THREADS) {
+		fprintf(stderr, "Can do 1 to %d threads\n", MAX_THREADS);
+		return EXIT_FAILURE;
+	}
+
+	if (file != NULL) {
+		FILE * f = fopen(file, "r");
+		long len;
+
+		if (f == NULL || fseek(f, 0, SEEK_END) == -1 ||
+				(len = ftell(f)) < 0)
+			ferr("Couldn't read scenario file");
+		rewind(f);
+		text = calloc(1, len + 1);
+		if (text == NULL || fread(text, 1, len, f) != (size_t)len)
+			ferr("Couldn't read scenario file");
+		fclose(f);
+
+		if ((n = add_scenarios(text, list, n)) < 0)
+			return EXIT_FAILURE;
+		free(text);
+	}
+	for (int i = optind; i < argc; i++) {
+		if ((n = add_scenarios(argv[i], list, n)) < 0)
+			return EXIT_FAILURE;
+	}
+	if (n == 0) {
+		text = strdup(DEFAULT_SCENARIOS);
+		n = add_scenarios(text, list, n);
+		free(text);
+	}
+
+	/* where the load goes */
+	memset(&target, 0, sizeof(target));
+	if (address == NULL || strchr(address, ':') == NULL) {
+		struct sockaddr_in * a = (struct sockaddr_in *)&target;
+
+		a->sin_family = AF_INET;
+		a->sin_port = htons(port);
+		target_len = sizeof(*a);
+		if (inet_pton(AF_INET, address ? address : "127.0.0.1",
+				&a->sin_addr) != 1) {
+			fprintf(stderr, "%s is not an address\n", address);
+			return EXIT_FAILURE;
+		}
+	} else {
+		struct sockaddr_in6 * a = (struct sockaddr_in6 *)&target;
+
+		a->sin6_family = AF_INET6;
+		a->sin6_port = htons(port);
+		target_len = sizeof(*a);
+		if (inet_pton(AF_INET6, address, &a->sin6_addr) != 1) {
+			fprintf(stderr, "%s is not an address\n", address);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (results != NULL && (out = fopen(results, "a")) == NULL)
+		ferr("Couldn't open results file");
+
+	/* every socket is a file, and 1024 of them is a common limit;
+	 * go as high as we are allowed to */
+	if (getrlimit(RLIMIT_NOFILE, &files) == -1)
+		ferr("getrlimit");
+	if (files.rlim_cur < files.rlim_max) {
+		files.rlim_cur = files.rlim_max;
+		if (setrlimit(RLIMIT_NOFILE, &files) == -1)
+			getrlimit(RLIMIT_NOFILE, &files);
+	}
+
+	printf("scenario\trate\tsent/s\treplies/s\tloss\tp50 us\tp99 us\tp99.9 us\tmax us\tus CPU/reply\n");
+
+	for (int s = 0; s < n; s++) {
+		const struct Scenario * sc = &list[s];
+		pthread_t probe;
+		uint64_t sent = 0, unsent = 0, replies = 0;
+		double cpu, loss;
+		int per;
+
+		if (sc->sources > 1 && target.ss_family != AF_INET) {
+			fprintf(stderr, "%s: more sources only work over IPv4\n",
+				sc->name);
+			return EXIT_FAILURE;
+		}
+
+		/* a socket each, the probe's, epoll's, stdio and a few
+		 * more */
+		if ((rlim_t)sc->sockets + 16 > files.rlim_cur) {
+			fprintf(stderr, "%s: %d sockets are more than the %llu "
+				"files we may have open (ulimit -n)\n", sc->name,
+				sc->sockets, (unsigned long long)files.rlim_cur);
+			return EXIT_FAILURE;
+		}
+
+		if (address == NULL)
+			start_qotd(path, quotes, port, workers, extra);
+		wait_qotd();
+
+		cur = sc;
+		memset(&probe_hist, 0, sizeof(probe_hist));
+		probes = probes_lost = 0;
+		atomic_store(&stop, 0);
+		atomic_store(&done, 0);
+
+		/* sockets go round the threads, and round the sources */
+		per = (sc->sockets + nthreads - 1) / nthreads;
+		for (int t = 0; t < nthreads; t++) {
+			struct Loader * l = &loaders[t];
+
+			memset(l, 0, sizeof(*l));
+			l->fds = malloc(per * sizeof(int));
+			if (l->fds == NULL)
+				ferr("malloc");
+		}
+		for (int i = 0; i < sc->sockets; i++) {
+			struct Loader * l = &loaders[i % nthreads];
+
+			l->fds[l->nfds++] = connect_socket(i % sc->sources);
+		}
+
+		start_ns = now_ns();
+		for (int t = 0; t < nthreads; t++) {
+			struct Loader * l = &loaders[t];
+
+			l->rate = sc->rate * l->nfds / sc->sockets;
+			if (l->nfds > 0 &&
+					pthread_create(&l->tid, NULL, loader, l) != 0)
+				ferr("pthread_create");
+		}
+		if (pthread_create(&probe, NULL, prober, NULL) != 0)
+			ferr("pthread_create");
+
+		sleep(sc->seconds);
+		atomic_store(&stop, 1);
+		pthread_join(probe, NULL);
+
+		/* what is still on its way gets a moment */
+		usleep(DRAIN_MS * 1000);
+		atomic_store(&done, 1);
+
+		for (int t = 0; t < nthreads; t++) {
+			struct Loader * l = &loaders[t];
+
+			if (l->nfds > 0)
+				pthread_join(l->tid, NULL);
+			for (int i = 0; i < l->nfds; i++)
+				close(l->fds[i]);
+			free(l->fds);
+
+			sent += l->sent;
+			unsent += l->unsent;
+			replies += l->replies;
+		}
+
+		cpu = stop_qotd();
+
+		loss = sent > 0 ? 1 - (double)replies / sent : 0;
+		if (loss < 0)
+			loss = 0;
+
+		printf("%s\t%.0f\t%.0f\t%.0f\t%.4f\t%.1f\t%.1f\t%.1f\t%.1f\t%.2f\n",
+			sc->name, sc->rate, (double)sent / sc->seconds,
+			(double)replies / sc->seconds, loss,
+			hist_quantile(&probe_hist, 0.5) / 1e3,
+			hist_quantile(&probe_hist, 0.99) / 1e3,
+			hist_quantile(&probe_hist, 0.999) / 1e3,
+			probe_hist.max / 1e3,
+			cpu >= 0 && replies > 0 ? cpu * 1e6 / replies : 0);
+		fflush(stdout);
+
+		if (out != NULL) {
+			fprintf(out, "{\"label\":");
+			json_string(out, label);
+			fprintf(out, ",\"scenario\":");
+			json_string(out, sc->name);
+			fprintf(out, ",\"qotd_options\":");
+			json_string(out, address == NULL ? extra : "");
+			fprintf(out, ",\"time\":%lld,\"rate\":%.0f,\"seconds\":%d,"
+				"\"sockets\":%d,\"sources\":%d,\"burst_on_ms\":%d,"
+				"\"burst_off_ms\":%d,\"threads\":%d,\"qotd_workers\":%d,"
+				"\"sent\":%llu,\"unsent\":%llu,\"replies\":%llu,"
+				"\"loss\":%.6f,\"replies_per_s\":%.1f,"
+				"\"probes\":%llu,\"probes_lost\":%llu,"
+				"\"p50_us\":%.1f,\"p90_us\":%.1f,\"p99_us\":%.1f,"
+				"\"p999_us\":%.1f,\"max_us\":%.1f,",
+				(long long)time(NULL), sc->rate,
+				sc->seconds, sc->sockets, sc->sources, sc->on_ms,
+				sc->off_ms, nthreads, address == NULL ? workers : 0,
+				(unsigned long long)sent, (unsigned long long)unsent,
+				(unsigned long long)replies, loss,
+				(double)replies / sc->seconds,
+				(unsigned long long)probes,
+				(unsigned long long)probes_lost,
+				hist_quantile(&probe_hist, 0.5) / 1e3,
+				hist_quantile(&probe_hist, 0.9) / 1e3,
+				hist_quantile(&probe_hist, 0.99) / 1e3,
+				hist_quantile(&probe_hist, 0.999) / 1e3,
+				probe_hist.max / 1e3);
+			if (cpu >= 0 && replies > 0)
+				fprintf(out, "\"cpu_us_per_reply\":%.3f}\n",
+					cpu * 1e6 / replies);
+			else
+				fprintf(out, "\"cpu_us_per_reply\":null}\n");
+			fflush(out);
+		}
+	}
+
+	if (out != NULL)
+		fclose(out);
+	free(list);
+
+	return 0;
+}
@@ -0,0 +1,1369 @@
+/*
+ * quotes.h - The quote list, as read from a text file or served
+ *            straight from a database compiled by qotdc
+ *
+ * A text quote list has one quote per line. A backslash takes the
+ * next char literally, so \ followed by a newline continues the quote
+ * on the next line and \\ is a backslash.
+ *
+ * A quote may start with metadata: a %, key=value pairs split by
+ * commas, and a space, which are not part of the quote. w is how
+ * likely the quote is to be picked, 1 if not given, so
+ *
+ *   %w=3 The early bird gets the worm.
+ *
+ * comes up three times as often as a quote without metadata, and w=0
+ * retires a quote without taking it out. c puts the quote in a
+ * category, and can be given more than once; id names the quote, so
+ * it can be asked for whatever else changes in the file:
+ *
+ *   %c=birds,c=mornings,id=worm The early bird gets the worm.
+ *
+ * Values are up to QUOTES_MAX_KEY - 1 bytes, and a category doesn't
+ * start with #, which is how ids are told apart when looked up. Keys
+ * we don't know are skipped. Anything that isn't quite like that is
+ * just a quote that happens to start with %, and \% is one for sure.
+ *
+ * A database is the same quote list laid out so that it can be mapped
+ * and used as is, without parsing anything:
+ *
+ *   struct QuoteDbHeader
+ *   uint32_t offsets[count + 1]  (at index_off, relative to blob_off)
+ *   struct QuoteAlias[count]     (at alias_off, if any quote has a w)
+ *   keys                         (at keys_off, if any quote has a c or
+ *                                 id, laid out as place_keys() says)
+ *   quote bytes                  (at blob_off, blob_len of them)
+ *
+ * Numbers are in host byte order; byte_order tells whether the file
+ * was written on a machine that agrees with us.
+ *
+ * A text file that only grows is reloaded by parsing just what was
+ * added, into room kept free at the end of the arena and index. Needs
+ * _GNU_SOURCE, for mremap. A text file is read, never mapped: one that
+ * is cut short while being parsed would kill the process with SIGBUS,
+ * where read() only comes back short.
+ *
+ * Picking a quote takes the same time however they are weighted,
+ * with Vose's alias method: draw a quote uniformly, then flip a coin
+ * that keeps it or takes its alias instead. The table is built when a
+ * text file is loaded, and stored in a database. Random numbers come
+ * from xoshiro256**, one state per thread.
+ *
+ * Categories and ids go in one open addressing hash table, built when
+ * a text file is loaded and stored in a database like the alias
+ * table, so looking a quote up costs about what picking one does. A
+ * category has its members back to back, with an alias table of its
+ * own if quotes are weighted.
+ *
+ * This code is released into the P U B L I C  D O M A I N!
+ *
+ */
+
+#ifndef QUOTES_H
+#define QUOTES_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h> /* offsetof */
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <time.h>
+
+#define QUOTEDB_MAGIC "QOTDB\r\n\032" /* 8 bytes, mangled by text tools */
+#define QUOTEDB_VERSION 3 /* 1 had no alias_off, 2 no keys; both are
+                            * read still */
+#define QUOTEDB_BYTE_ORDER 0x01020304
+
+#define QUOTES_MIN_RESERVE (1 << 20) /* arena bytes kept for appends */
+#define QUOTES_CHECK 4096 /* bytes before the end of the last quote that
+                           * have to be unchanged for an append */
+#define QUOTES_MAX_TAGS 16 /* categories and id of one quote */
+#define QUOTES_MAX_KEY 256 /* longest category or id, with its #, + 1 */
+
+struct QuoteDbHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint64_t count; /* number of quotes */
+	uint64_t index_off;
+	uint64_t blob_off;
+	uint64_t blob_len;
+	uint64_t alias_off; /* 0 if all quotes are as likely */
+	uint64_t keys_off; /* 0 if no quote has a category or id */
+	uint32_t nslots;
+	uint32_t ncat;
+	uint64_t nmembers;
+	uint64_t keys_len;
+};
+
+/* how much of the header a database of each version has */
+#define QUOTEDB_HEADER_V1 offsetof(struct QuoteDbHeader, alias_off)
+#define QUOTEDB_HEADER_V2 offsetof(struct QuoteDbHeader, keys_off)
+
+/* Quote i is kept if the coin, 32 random bits, is below prob, else
+ * alias is picked */
+struct QuoteAlias
+{
+	uint32_t prob;
+	uint32_t alias;
+};
+
+/* A category or id in the hash table; len is 0 if the slot is free.
+ * The value of an id, which starts with #, is its quote, that of a
+ * category its number */
+struct QuoteSlot
+{
+	uint32_t hash;
+	uint32_t key; /* offset in keys */
+	uint32_t len;
+	uint32_t value;
+};
+
+/* What the metadata of a quote says */
+struct QuoteMeta
+{
+	float weight;
+	int ntags;
+	const char * tag[QUOTES_MAX_TAGS]; /* in the file */
+	uint8_t tag_len[QUOTES_MAX_TAGS];
+	uint8_t is_id[QUOTES_MAX_TAGS]; /* gets a # in front */
+};
+
+/* All quotes live back to back in one arena. Quote i is
+ * arena[index[i]] up to arena[index[i + 1]], so the index has one
+ * more entry than there are quotes and lengths come for free.
+ * For a database, arena and index point into the mapping. For a text
+ * file they are mappings of their own, larger than needed so appended
+ * quotes fit without moving anything. */
+struct QuoteList
+{
+	char * arena;
+	uint32_t * index;
+	size_t len; /* number of quotes */
+	size_t arena_len;
+
+	/* NULL if all quotes are as likely. Points into a database, or
+	 * is allocated for every text list, appended or not */
+	struct QuoteAlias * alias;
+
+	/* Categories and ids, slots NULL if there are none. Point into
+	 * a database, or are one allocation, starting at slots, for
+	 * every text list */
+	struct QuoteSlot * slots;
+	uint32_t nslots; /* a power of 2 */
+	uint32_t * cat_off; /* ncat + 1 of them, into members */
+	size_t ncat;
+	uint32_t * members; /* quotes of category 0, 1 ... */
+	size_t nmembers;
+	struct QuoteAlias * cat_alias; /* per member, if alias is there */
+	const char * keys;
+	size_t keys_len;
+
+	void * map; /* database mapping, NULL for a parsed text file */
+	size_t map_len;
+
+	/* text file only */
+	size_t reserved; /* arena bytes mapped */
+	size_t index_cap; /* index entries mapped */
+	float * weight; /* index_cap of them, NULL until a quote has a w */
+	char * tags; /* tags_reserved bytes mapped, NULL until a quote has
+	              * a c or id; see add_tag() */
+	size_t tags_len;
+	size_t tags_reserved;
+	size_t ntags;
+	dev_t dev; /* the file we parsed */
+	ino_t ino;
+	size_t parsed; /* file bytes up to the end of the last quote */
+	uint32_t check; /* sum of the QUOTES_CHECK bytes before that */
+};
+
+/* prints msg, with error details, and exits */
+static void ferr(const char * msg)
+{
+	perror(msg);
+	exit(EXIT_FAILURE);
+}
+
+/* How many bytes the keys of a list take, laid out as place_keys()
+ * does. Callers keep every count below the size of something that
+ * fits in memory, so this doesn't overflow */
+static uint64_t keys_size(uint64_t nslots, uint64_t ncat, uint64_t nmembers,
+	int weighted, uint64_t keys_len)
+{
+	return nslots * sizeof(struct QuoteSlot) +
+		(ncat + 1) * sizeof(uint32_t) +
+		nmembers * sizeof(uint32_t) +
+		(weighted ? nmembers * sizeof(struct QuoteAlias) : 0) +
+		keys_len;
+}
+
+/* Points the keys of list into mem: slots, cat_off, members,
+ * cat_alias if weighted, and the keys themselves */
+static void place_keys(struct QuoteList * list, char * mem, uint32_t nslots,
+	size_t ncat, size_t nmembers, int weighted, size_t keys_len)
+{
+	list->slots = (struct QuoteSlot *)mem;
+	list->nslots = nslots;
+	mem += nslots * sizeof(struct QuoteSlot);
+
+	list->cat_off = (uint32_t *)mem;
+	list->ncat = ncat;
+	mem += (ncat + 1) * sizeof(uint32_t);
+
+	list->members = (uint32_t *)mem;
+	list->nmembers = nmembers;
+	mem += nmembers * sizeof(uint32_t);
+
+	list->cat_alias = NULL;
+	if (weighted)
+	{
+		list->cat_alias = (struct QuoteAlias *)mem;
+		mem += nmembers * sizeof(struct QuoteAlias);
+	}
+
+	list->keys = mem;
+	list->keys_len = keys_len;
+}
+
+/* Checks a mapped database and points list into it. Only the header
+ * is looked at, so this takes the same time for any number of
+ * quotes; get_quote() checks the offsets it uses. Returns 0 if the
+ * database is damaged or has no quotes */
+static int open_quote_db(const char * filename, void * map, size_t size,
+	struct QuoteList * list)
+{
+	const struct QuoteDbHeader * h = map;
+
+	if (size < QUOTEDB_HEADER_V1 ||
+		size < (h->version == 1 ? QUOTEDB_HEADER_V1 :
+		h->version == 2 ? QUOTEDB_HEADER_V2 : sizeof(*h)))
+	{
+		fprintf(stderr, "%s: truncated quote database\n", filename);
+		return 0;
+	}
+	if (h->version < 1 || h->version > QUOTEDB_VERSION ||
+		h->byte_order != QUOTEDB_BYTE_ORDER)
+	{
+		fprintf(stderr, "%s: quote database version %u, byte order "
+			"%08x is not ours, recompile it with qotdc\n", filename,
+			h->version, h->byte_order);
+		return 0;
+	}
+
+	if (h->count == 0 || h->count >= size / sizeof(uint32_t) ||
+		h->index_off % sizeof(uint32_t) != 0 ||
+		h->index_off > size ||
+		(h->count + 1) * sizeof(uint32_t) > size - h->index_off ||
+		h->blob_off > size || h->blob_len > size - h->blob_off ||
+		h->blob_len > UINT32_MAX)
+	{
+		fprintf(stderr, "%s: damaged quote database\n", filename);
+		return 0;
+	}
+
+	/* version 1 ends before alias_off, 2 before keys_off */
+	uint64_t alias_off = h->version >= 2 ? h->alias_off : 0;
+	uint64_t keys_off = h->version >= 3 ? h->keys_off : 0;
+
+	if (alias_off != 0 &&
+		(alias_off % sizeof(uint32_t) != 0 || alias_off > size ||
+		h->count > (size - alias_off) / sizeof(struct QuoteAlias)))
+	{
+		fprintf(stderr, "%s: damaged quote database\n", filename);
+		return 0;
+	}
+
+	/* the offsets and quote numbers in there are checked when they
+	 * are used */
+	if (keys_off != 0 &&
+		(keys_off % sizeof(uint32_t) != 0 || keys_off > size ||
+		h->nslots == 0 || (h->nslots & (h->nslots - 1)) != 0 ||
+		h->nslots > size / sizeof(struct QuoteSlot) ||
+		h->ncat >= size / sizeof(uint32_t) ||
+		h->nmembers > size / sizeof(uint32_t) ||
+		h->keys_len > size ||
+		keys_size(h->nslots, h->ncat, h->nmembers, alias_off != 0,
+			h->keys_len) > size - keys_off))
+	{
+		fprintf(stderr, "%s: damaged quote database\n", filename);
+		return 0;
+	}
+
+	memset(list, 0, sizeof(*list));
+	list->arena = (char *)map + h->blob_off;
+	list->index = (uint32_t *)((char *)map + h->index_off);
+	list->len = h->count;
+	list->arena_len = h->blob_len;
+	list->alias = alias_off != 0 ?
+		(struct QuoteAlias *)((char *)map + alias_off) : NULL;
+	if (keys_off != 0)
+	{
+		place_keys(list, (char *)map + keys_off, h->nslots, h->ncat,
+			h->nmembers, alias_off != 0, h->keys_len);
+	}
+	list->map = map;
+	list->map_len = size;
+
+	/* quotes get picked at random, reading ahead is wasted */
+	madvise(map, size, MADV_RANDOM);
+
+	return 1;
+}
+
+/* Maps len bytes of address space to grow into, which only take
+ * memory once they are written to. NULL if there is no room */
+static void * reserve(size_t len)
+{
+	void * p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+	return p == MAP_FAILED ? NULL : p;
+}
+
+/* FNV-1a of len bytes at p */
+static uint32_t quote_sum(const char * p, size_t len)
+{
+	uint32_t h = 2166136261u;
+
+	while (len--)
+	{
+		h = (h ^ (unsigned char)*p++) * 16777619u;
+	}
+
+	return h;
+}
+
+/* Makes room for cap entries in the index and weights of a list no
+ * one else uses, which may move them. Returns 0 if that can't be done */
+static int grow_index(struct QuoteList * list, size_t cap)
+{
+	void * p = mremap(list->index, list->index_cap * sizeof(uint32_t),
+		cap * sizeof(uint32_t), MREMAP_MAYMOVE);
+
+	if (p == MAP_FAILED)
+	{
+		return 0;
+	}
+	list->index = p;
+
+	if (list->weight != NULL)
+	{
+		p = mremap(list->weight, list->index_cap * sizeof(float),
+			cap * sizeof(float), MREMAP_MAYMOVE);
+		if (p == MAP_FAILED)
+		{
+			/* shrinking in place always works */
+			mremap(list->index, cap * sizeof(uint32_t),
+				list->index_cap * sizeof(uint32_t), 0);
+			return 0;
+		}
+		list->weight = p;
+	}
+
+	list->index_cap = cap;
+	return 1;
+}
+
+/* Reads a weight, digits with maybe a fraction, from p up to end.
+ * Returns 0 if it is something else, a lone . too */
+static int parse_weight(const char * p, const char * end, float * weight)
+{
+	double w = 0, scale = 1;
+	int dot = 0, digits = 0;
+
+	for (; p < end; p++)
+	{
+		if (*p == '.' && !dot)
+		{
+			dot = 1;
+		}
+		else if (*p >= '0' && *p <= '9')
+		{
+			digits++;
+			if (dot)
+				w += (*p - '0') * (scale /= 10);
+			else
+				w = w * 10 + (*p - '0');
+		}
+		else
+		{
+			return 0;
+		}
+	}
+
+	/* so that summing millions of them stays exact enough */
+	if (digits == 0 || w > 1e9)
+	{
+		return 0;
+	}
+
+	*weight = w;
+	return 1;
+}
+
+/* Reads the metadata p may start with into m, see the top of this
+ * file. Returns where the quote itself starts, which is p if there is
+ * no metadata */
+static const char * parse_meta(const char * p, const char * end,
+	struct QuoteMeta * m)
+{
+	const char * q = p + 1;
+	const char * key;
+	const char * val;
+	float w = 1;
+	int id = 0;
+
+	m->weight = 1;
+	m->ntags = 0;
+
+	if (p == end || *p != '%')
+	{
+		return p;
+	}
+
+	for (;;)
+	{
+		key = q;
+		while (q < end && *q >= 'a' && *q <= 'z')
+			q++;
+		if (q == key || q == end || *q != '=')
+			goto reject;
+
+		val = ++q;
+		while (q < end && *q != ',' && *q != ' ' && *q != '\n' &&
+			*q != '\\')
+			q++;
+		if (q == val || q == end || *q == '\n' || *q == '\\')
+			goto reject;
+
+		if (val - key == 2 && *key == 'w' && !parse_weight(val, q, &w))
+			goto reject;
+
+		if ((val - key == 2 && *key == 'c' && *val != '#') ||
+			(val - key == 3 && memcmp(key, "id", 2) == 0 && !id++))
+		{
+			if (m->ntags == QUOTES_MAX_TAGS ||
+				q - val > QUOTES_MAX_KEY - 2)
+			{
+				goto reject;
+			}
+			m->tag[m->ntags] = val;
+			m->tag_len[m->ntags] = q - val;
+			m->is_id[m->ntags++] = *key == 'i';
+		}
+		else if ((val - key == 2 && *key == 'c') ||
+			(val - key == 3 && memcmp(key, "id", 2) == 0))
+		{
+			/* a category starting with #, or a second id */
+			goto reject;
+		}
+
+		if (*q++ == ' ')
+			break;
+	}
+
+	m->weight = w;
+	return q;
+
+reject:
+	/* not metadata after all, so none of it counts */
+	m->ntags = 0;
+	return p;
+}
+
+/* Gives list weights, 1 for the quotes it has so far. The weights of
+ * a list others are reading are not shared with them yet, so this is
+ * fine any time. Returns 0 if there is no room */
+static int add_weights(struct QuoteList * list)
+{
+	list->weight = reserve(list->index_cap * sizeof(float));
+	if (list->weight == NULL)
+	{
+		return 0;
+	}
+
+	for (size_t i = 0; i < list->len; i++)
+	{
+		list->weight[i] = 1;
+	}
+
+	return 1;
+}
+
+/* Records that quote i has the tags in m, each as the quote number,
+ * the length, and the key, ids with their # in front. The records of
+ * a list others are reading are not shared with them yet, but they
+ * mustn't move: there is room for twice as many bytes of them as the
+ * arena can take, and there are fewer than that in the file they come
+ * from. Returns 0 if there is no room */
+static int add_tags(struct QuoteList * list, size_t i,
+	const struct QuoteMeta * m)
+{
+	uint32_t quote = i;
+
+	if (list->tags == NULL)
+	{
+		list->tags_reserved = 2 * list->reserved;
+		list->tags = reserve(list->tags_reserved);
+		if (list->tags == NULL)
+			return 0;
+	}
+
+	for (int t = 0; t < m->ntags; t++)
+	{
+		char * r = list->tags + list->tags_len;
+		uint8_t len = m->tag_len[t] + m->is_id[t];
+
+		if (list->tags_reserved - list->tags_len < sizeof(quote) + 1 + len)
+			return 0;
+
+		memcpy(r, &quote, sizeof(quote));
+		r[sizeof(quote)] = len;
+		r += sizeof(quote) + 1;
+		if (m->is_id[t])
+			*r++ = '#';
+		memcpy(r, m->tag[t], m->tag_len[t]);
+
+		list->tags_len += sizeof(quote) + 1 + len;
+		list->ntags++;
+	}
+
+	return 1;
+}
+
+/* Parses the quotes from p up to end onto the end of list, copying
+ * them into the arena with escapes taken out; an unescaped newline
+ * ends a quote. Escapes only ever make things shorter, so end - p
+ * bytes of room in the arena are always enough. Returns where the
+ * last complete quote ended, or NULL if the index is full and grow is
+ * not set, or there is no room for weights or tags. Only a list no one
+ * else uses yet may grow */
+static const char * parse_quotes(struct QuoteList * list, const char * p,
+	const char * end, int grow)
+{
+	char * out = list->arena + list->arena_len;
+	const char * done = p;
+	size_t i = list->len;
+	struct QuoteMeta m;
+
+	/* p is always where a quote starts */
+	p = parse_meta(p, end, &m);
+
+	/* the next newline and backslash at or after p, or end. NULL
+	 * until we have looked */
+	const char * nl = NULL;
+	const char * bs = NULL;
+	const char * stop;
+
+	while (p < end)
+	{
+		if ((nl == NULL || nl < p) && (nl = memchr(p, '\n', end - p)) == NULL)
+		{
+			nl = end;
+		}
+		if ((bs == NULL || bs < p) && (bs = memchr(p, '\\', end - p)) == NULL)
+		{
+			bs = end;
+		}
+
+		/* plain bytes up to whichever comes first go in as is */
+		stop = nl < bs ? nl : bs;
+		memcpy(out, p, stop - p);
+		out += stop - p;
+		p = stop;
+
+		if (p == end)
+		{
+			break;
+		}
+
+		if (p == bs)
+		{
+			/* take the next char literally, whatever it is. A
+			 * backslash at the very end escapes nothing */
+			if (++p == end)
+			{
+				break;
+			}
+			*out++ = *p++;
+			continue;
+		}
+
+		/* an unescaped newline ends the quote */
+		*out++ = *p++;
+
+		if (i + 1 >= list->index_cap &&
+			!(grow && grow_index(list, list->index_cap * 2)))
+		{
+			return NULL;
+		}
+		if (list->weight == NULL && m.weight != 1)
+		{
+			list->len = i;
+			if (!add_weights(list))
+				return NULL;
+		}
+		if (list->weight != NULL)
+		{
+			list->weight[i] = m.weight;
+		}
+		if (m.ntags > 0 && !add_tags(list, i, &m))
+		{
+			return NULL;
+		}
+		list->index[++i] = out - list->arena;
+		done = p;
+
+		p = parse_meta(p, end, &m);
+	}
+
+	/* if last quote has no \n quote won't be added; its bytes are
+	 * past arena_len and get written over by the next append */
+	list->len = i;
+	list->arena_len = list->index[i];
+
+	return done;
+}
+
+/* bytes of scratch vose() needs for n weights */
+#define VOSE_SCRATCH(n) ((n) * (2 * sizeof(uint32_t) + sizeof(double)))
+
+/* Fills a, the alias table of n things weighing w, total together,
+ * with Vose's method: things less likely than average are topped up
+ * by one more likely, until every one of them is exactly average.
+ * Takes time in proportion to n */
+static void vose(struct QuoteAlias * a, const float * w, size_t n,
+	double total, void * scratch)
+{
+	double * p = scratch;
+	uint32_t * small = (uint32_t *)(p + n);
+	uint32_t * large = small + n;
+	size_t nsmall = 0, nlarge = 0;
+	uint32_t g = 0;
+
+	/* scaled so that the average is 1 */
+	for (size_t i = 0; i < n; i++)
+	{
+		p[i] = w[i] * n / total;
+		if (p[i] < 1)
+			small[nsmall++] = i;
+		else
+			large[nlarge++] = i;
+	}
+
+	while (nsmall > 0 && nlarge > 0)
+	{
+		uint32_t s = small[--nsmall];
+
+		g = large[--nlarge];
+		a[s].prob = p[s] * 4294967296.0;
+		a[s].alias = g;
+
+		p[g] -= 1 - p[s];
+		if (p[g] < 1)
+			small[nsmall++] = g;
+		else
+			large[nlarge++] = g;
+	}
+
+	/* what is left is average, give or take rounding. Things that
+	 * must never come up still go to one that may */
+	while (nlarge > 0)
+	{
+		g = large[--nlarge];
+		a[g].prob = UINT32_MAX;
+		a[g].alias = g;
+	}
+	while (nsmall > 0)
+	{
+		uint32_t s = small[--nsmall];
+
+		a[s].prob = w[s] > 0 ? UINT32_MAX : 0;
+		a[s].alias = w[s] > 0 ? s : g;
+	}
+}
+
+/* Builds the alias table of a text list from its weights. Returns 0
+ * if no quote can be picked, or there is no memory */
+static int build_alias(struct QuoteList * list)
+{
+	size_t n = list->len;
+	double total = 0;
+	void * scratch;
+
+	list->alias = NULL;
+	if (list->weight == NULL)
+	{
+		/* uniform, nothing to build */
+		return 1;
+	}
+
+	for (size_t i = 0; i < n; i++)
+	{
+		total += list->weight[i];
+	}
+	if (total <= 0)
+	{
+		return 0;
+	}
+
+	list->alias = malloc(n * sizeof(*list->alias));
+	scratch = malloc(VOSE_SCRATCH(n));
+	if (list->alias == NULL || scratch == NULL)
+	{
+		perror("Couldn't build alias table");
+		free(list->alias);
+		list->alias = NULL;
+		free(scratch);
+		return 0;
+	}
+
+	vose(list->alias, list->weight, n, total, scratch);
+	free(scratch);
+
+	return 1;
+}
+
+/* Looks up the slot for key, len bytes of it, or the free slot it
+ * would go in. NULL if there is neither, which only a damaged
+ * database can do */
+static inline const struct QuoteSlot * find_slot(const struct QuoteList * l,
+	const char * key, size_t len, const char * keys, size_t keys_len)
+{
+	uint32_t h = quote_sum(key, len);
+	uint32_t mask = l->nslots - 1;
+
+	for (uint32_t i = h & mask, n = 0; n < l->nslots; i = (i + 1) & mask, n++)
+	{
+		const struct QuoteSlot * s = &l->slots[i];
+
+		if (s->len == 0 ||
+			(s->hash == h && s->len == len && s->key <= keys_len &&
+			len <= keys_len - s->key &&
+			memcmp(keys + s->key, key, len) == 0))
+		{
+			return s;
+		}
+	}
+
+	return NULL;
+}
+
+/* Builds the hash table of categories and ids of a text list, and the
+ * members of every category, from its tags. Quotes with w=0 are in no
+ * category, so a category might be empty. An id given twice stays with
+ * the first quote. Returns 0 if there is no memory */
+static int build_keys(struct QuoteList * list)
+{
+	size_t ncat = 0, nmembers = 0, nkeys = 0, keys_len = 0;
+	uint32_t nslots = 16;
+	uint32_t * count = NULL;
+	float * w = NULL;
+	void * scratch = NULL;
+	char * mem;
+	const char * r;
+	const char * end = list->tags + list->tags_len;
+
+	list->slots = NULL;
+	if (list->tags == NULL)
+	{
+		return 1;
+	}
+
+	/* never more keys than tags */
+	while (nslots / 4 * 3 < list->ntags)
+		nslots *= 2;
+
+	/* first in a table of their own, pointing at the tags, to find
+	 * out how many of everything there are */
+	list->slots = calloc(nslots, sizeof(*list->slots));
+	list->nslots = nslots;
+	count = calloc(list->ntags, sizeof(*count));
+	if (list->slots == NULL || count == NULL)
+	{
+		goto fail;
+	}
+
+	for (r = list->tags; r < end; r += sizeof(uint32_t) + 1 + (uint8_t)r[4])
+	{
+		uint32_t quote;
+		uint8_t len = r[4];
+		const char * key = r + sizeof(quote) + 1;
+		struct QuoteSlot * s = (struct QuoteSlot *)find_slot(list, key, len,
+			list->tags, list->tags_len);
+
+		memcpy(&quote, r, sizeof(quote));
+
+		if (s->len == 0)
+		{
+			s->hash = quote_sum(key, len);
+			s->key = key - list->tags;
+			s->len = len;
+			s->value = key[0] == '#' ? quote : ncat++;
+			keys_len += len;
+			nkeys++;
+		}
+		else if (key[0] == '#')
+		{
+			fprintf(stderr, "Quote %u has id %.*s, which quote %u has "
+				"already\n", quote, len - 1, key + 1, s->value);
+		}
+
+		if (key[0] != '#' && (list->weight == NULL || list->weight[quote] > 0))
+		{
+			count[s->value]++;
+			nmembers++;
+		}
+	}
+
+	/* then the real thing, at most three quarters full so a lookup
+	 * only probes a few slots, with the keys copied next to it */
+	struct QuoteSlot * slots = list->slots;
+	uint32_t nfirst = nslots;
+	char * keys;
+
+	for (nslots = 16; nslots / 4 * 3 < nkeys; nslots *= 2)
+		;
+
+	mem = malloc(keys_size(nslots, ncat, nmembers, list->weight != NULL,
+		keys_len));
+	if (mem == NULL)
+	{
+		goto fail;
+	}
+	memset(mem, 0, nslots * sizeof(struct QuoteSlot));
+
+	place_keys(list, mem, nslots, ncat, nmembers, list->weight != NULL,
+		keys_len);
+	keys = (char *)list->keys;
+	keys_len = 0;
+	for (uint32_t i = 0; i < nfirst; i++)
+	{
+		if (slots[i].len != 0)
+		{
+			const char * key = list->tags + slots[i].key;
+			struct QuoteSlot * s = (struct QuoteSlot *)find_slot(list, key,
+				slots[i].len, keys, keys_len);
+
+			*s = slots[i];
+			s->key = keys_len;
+			memcpy(keys + keys_len, key, s->len);
+			keys_len += s->len;
+		}
+	}
+	free(slots);
+
+	/* members of a category follow those of the one before */
+	list->cat_off[0] = 0;
+	for (size_t c = 0; c < ncat; c++)
+	{
+		list->cat_off[c + 1] = list->cat_off[c] + count[c];
+		count[c] = list->cat_off[c];
+	}
+
+	for (r = list->tags; r < end; r += sizeof(uint32_t) + 1 + (uint8_t)r[4])
+	{
+		uint32_t quote;
+		uint8_t len = r[4];
+		const char * key = r + sizeof(quote) + 1;
+
+		memcpy(&quote, r, sizeof(quote));
+		if (key[0] != '#' && (list->weight == NULL || list->weight[quote] > 0))
+		{
+			const struct QuoteSlot * s = find_slot(list, key, len,
+				list->keys, list->keys_len);
+
+			list->members[count[s->value]++] = quote;
+		}
+	}
+
+	if (list->weight != NULL && nmembers > 0)
+	{
+		/* an alias table for every category, over its members */
+		w = malloc(nmembers * sizeof(*w));
+		scratch = malloc(VOSE_SCRATCH(nmembers));
+		if (w == NULL || scratch == NULL)
+		{
+			free(mem);
+			list->slots = NULL;
+			goto fail;
+		}
+
+		for (size_t m = 0; m < nmembers; m++)
+			w[m] = list->weight[list->members[m]];
+
+		for (size_t c = 0; c < ncat; c++)
+		{
+			uint32_t off = list->cat_off[c];
+			uint32_t n = list->cat_off[c + 1] - off;
+			double total = 0;
+
+			for (uint32_t m = 0; m < n; m++)
+				total += w[off + m];
+			if (n > 0)
+				vose(list->cat_alias + off, w + off, n, total, scratch);
+		}
+	}
+
+	free(w);
+	free(scratch);
+	free(count);
+
+	return 1;
+
+fail:
+	perror("Couldn't build category index");
+	free(list->slots);
+	list->slots = NULL;
+	free(w);
+	free(scratch);
+	free(count);
+	return 0;
+}
+
+/* frees a quote list */
+static inline void free_quote_list(struct QuoteList * l)
+{
+	if (l->map != NULL)
+	{
+		munmap(l->map, l->map_len);
+		return;
+	}
+
+	free(l->alias);
+	free(l->slots);
+	munmap(l->arena, l->reserved);
+	munmap(l->index, l->index_cap * sizeof(uint32_t));
+	if (l->weight != NULL)
+		munmap(l->weight, l->index_cap * sizeof(float));
+	if (l->tags != NULL)
+		munmap(l->tags, l->tags_reserved);
+}
+
+/* Reads len bytes of fd from off into a buffer of their own, or as
+ * many as there are if the file got shorter meanwhile; *got says how
+ * many. NULL if it can't be read */
+static char * read_quote_file(int fd, size_t off, size_t len, size_t * got)
+{
+	char * buf = malloc(len > 0 ? len : 1);
+	size_t n = 0;
+	ssize_t r;
+
+	if (buf == NULL)
+	{
+		perror("Couldn't read quote list file");
+		return NULL;
+	}
+
+	while (n < len)
+	{
+		r = pread(fd, buf + n, len - n, off + n);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0)
+		{
+			perror("Couldn't read quote list file");
+			free(buf);
+			return NULL;
+		}
+		if (r == 0)
+			break;
+		n += r;
+	}
+
+	*got = n;
+	return buf;
+}
+
+/* Loads a quote list from a file, either a database compiled by qotdc
+ * or a text file. Returns 0 if there are no quotes in file, or it
+ * can't be read; a reload keeps the quotes it has then.
+ * A text file is read and parsed in one go, into an arena twice its
+ * size so it can grow. */
+static int load_quote_list(const char * filename, struct QuoteList * list)
+{
+	int fd = open(filename, O_RDONLY);
+	char magic[sizeof(QUOTEDB_MAGIC) - 1];
+	struct stat st;
+	size_t size;
+
+	if (fd < 0 || fstat(fd, &st) < 0)
+	{
+		/* it might just be in the middle of being replaced */
+		perror("Couldn't read quote list file");
+		if (fd >= 0)
+			close(fd);
+		return 0;
+	}
+
+	if (st.st_size == 0)
+	{
+		/* nothing to read, and certainly no quotes */
+		close(fd);
+		return 0;
+	}
+
+	if (pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+		memcmp(magic, QUOTEDB_MAGIC, sizeof(magic)) == 0)
+	{
+		/* a database is never copied, so it is shared with every
+		 * other process serving it through the page cache */
+		void * map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED,
+			fd, 0);
+
+		close(fd);
+		if (map == MAP_FAILED)
+		{
+			perror("Couldn't map quote list file");
+			return 0;
+		}
+		if (open_quote_db(filename, map, st.st_size, list))
+		{
+			return 1;
+		}
+		munmap(map, st.st_size);
+		return 0;
+	}
+
+	if ((uint64_t)st.st_size > UINT32_MAX)
+	{
+		fprintf(stderr, "Quote list file is larger than 4GB\n");
+		close(fd);
+		return 0;
+	}
+
+	char * in = read_quote_file(fd, 0, st.st_size, &size);
+	close(fd);
+	if (in == NULL)
+	{
+		return 0;
+	}
+
+	memset(list, 0, sizeof(*list));
+
+	list->reserved = 2 * size;
+	if (list->reserved < QUOTES_MIN_RESERVE)
+		list->reserved = QUOTES_MIN_RESERVE;
+	if (list->reserved > UINT32_MAX)
+		list->reserved = UINT32_MAX;
+
+	/* a guess, grown while parsing if need be */
+	list->index_cap = size / 32 + 1024;
+
+	list->arena = reserve(list->reserved);
+	list->index = reserve(list->index_cap * sizeof(uint32_t));
+
+	if (list->arena == NULL || list->index == NULL)
+	{
+		perror("Couldn't make room for quotes");
+		if (list->arena != NULL)
+			munmap(list->arena, list->reserved);
+		if (list->index != NULL)
+			munmap(list->index, list->index_cap * sizeof(uint32_t));
+		free(in);
+		return 0;
+	}
+
+	list->index[0] = 0;
+
+	const char * done = parse_quotes(list, in, in + size, 1);
+
+	if (done == NULL || list->len == 0 || !build_alias(list) ||
+		!build_keys(list))
+	{
+		/* No quotes in list, too many to index, all have w=0, or
+		 * no memory */
+		free(in);
+		free_quote_list(list);
+		return 0;
+	}
+
+	/* room for as many quotes again; no matter if there is none,
+	 * an append that doesn't fit loads the file all over */
+	if (list->index_cap < 2 * (list->len + 1))
+		grow_index(list, 2 * (list->len + 1));
+
+	list->dev = st.st_dev;
+	list->ino = st.st_ino;
+	list->parsed = done - in;
+	list->check = list->parsed > QUOTES_CHECK ?
+		quote_sum(done - QUOTES_CHECK, QUOTES_CHECK) :
+		quote_sum(in, list->parsed);
+
+	free(in);
+
+	return 1;
+}
+
+/* Brings list up to date with its text file, if that has only been
+ * appended to since, parsing nothing but what is new. The new quotes
+ * go into the room left in the arena and index of list, which others
+ * may be reading meanwhile: that is fine, they stop at their own len.
+ * next shares arena, index, weights and tags with list, so only one of
+ * them gets freed with free_quote_list(); the other only frees its
+ * alias table and category index, with free_appended_quote_list().
+ * Those are built all over when quotes are added, if there are any,
+ * which takes time in proportion to all quotes.
+ * Returns 1 if next is up to date, even if no quote was added, 0 if
+ * the file has to be loaded all over: it is another file, it shrank,
+ * the bytes before where we got to last time changed, or there is no
+ * room left */
+static inline int append_quote_list(const char * filename,
+	const struct QuoteList * list, struct QuoteList * next)
+{
+	size_t check_from, off, size;
+	char * in;
+	const char * done;
+	struct stat st;
+	int fd;
+
+	if (list->map != NULL)
+	{
+		/* a database never grows, qotdc writes a new one */
+		return 0;
+	}
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0)
+	{
+		if (fd >= 0)
+			close(fd);
+		return 0;
+	}
+
+	size = st.st_size;
+	if (st.st_dev != list->dev || st.st_ino != list->ino ||
+		size < list->parsed ||
+		list->arena_len + (size - list->parsed) > list->reserved)
+	{
+		close(fd);
+		return 0;
+	}
+
+	/* read from the bytes we compare on */
+	check_from = list->parsed > QUOTES_CHECK ?
+		list->parsed - QUOTES_CHECK : 0;
+	off = check_from;
+
+	in = read_quote_file(fd, off, size - off, &size);
+	close(fd);
+	if (in == NULL)
+	{
+		return 0;
+	}
+	size += off;
+	if (size < list->parsed)
+	{
+		/* cut short since the fstat */
+		free(in);
+		return 0;
+	}
+
+	/* in is at file offset off from here on */
+	if (quote_sum(in + (check_from - off), list->parsed - check_from) !=
+		list->check)
+	{
+		/* written over, not just appended to */
+		free(in);
+		return 0;
+	}
+
+	*next = *list;
+	done = parse_quotes(next, in + (list->parsed - off), in + (size - off),
+		0);
+	if (done == NULL || (next->len != list->len &&
+		(!build_alias(next) || !build_keys(next))))
+	{
+		/* whatever list doesn't have is next's own */
+		if (next->alias != list->alias)
+			free(next->alias);
+		if (next->weight != list->weight)
+			munmap(next->weight, next->index_cap * sizeof(float));
+		if (next->tags != list->tags)
+			munmap(next->tags, next->tags_reserved);
+		free(in);
+		return 0;
+	}
+
+	next->parsed = off + (done - in);
+	check_from = next->parsed > QUOTES_CHECK ?
+		next->parsed - QUOTES_CHECK : 0;
+	next->check = quote_sum(in + (check_from - off),
+		next->parsed - check_from);
+
+	free(in);
+
+	return 1;
+}
+
+/* frees the alias table and category index of a list next was
+ * appended from, which is all it doesn't share with next */
+static inline void free_appended_quote_list(struct QuoteList * l,
+	const struct QuoteList * next)
+{
+	if (l->alias != next->alias)
+		free(l->alias);
+	if (l->slots != next->slots)
+		free(l->slots);
+}
+
+/* Returns quote i and its length, or NULL if i or its offsets are
+ * off, which only a damaged database can do */
+static inline const char * get_quote(const struct QuoteList * l,
+	size_t i, uint32_t * len)
+{
+	if (i >= l->len)
+	{
+		return NULL;
+	}
+
+	uint32_t a = l->index[i];
+	uint32_t b = l->index[i + 1];
+
+	if (a > b || b > l->arena_len)
+	{
+		return NULL;
+	}
+
+	*len = b - a;
+	return l->arena + a;
+}
+
+static inline uint64_t rotl(uint64_t x, int k)
+{
+	return (x << k) | (x >> (64 - k));
+}
+
+/* the next number from xoshiro256** state s */
+static inline uint64_t rng_next(uint64_t s[4])
+{
+	uint64_t r = rotl(s[1] * 5, 7) * 9;
+	uint64_t t = s[1] << 17;
+
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = rotl(s[3], 45);
+
+	return r;
+}
+
+/* Seeds s from the kernel. If it can't say, which only happens
+ * without getrandom(), from the time and where s is, which differs
+ * for every thread */
+static inline void rng_seed(uint64_t s[4])
+{
+	if (getrandom(s, 4 * sizeof(uint64_t), 0) == 4 * sizeof(uint64_t) &&
+		(s[0] | s[1] | s[2] | s[3]) != 0)
+	{
+		return;
+	}
+
+	/* splitmix64 spreads what little we have over all of s */
+	uint64_t x = (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32) ^
+		(uintptr_t)s;
+
+	for (int i = 0; i < 4; i++)
+	{
+		uint64_t z = (x += 0x9e3779b97f4a7c15);
+
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+		s[i] = z ^ (z >> 31);
+	}
+}
+
+/* Picks one of n things with rng state s, as likely as alias table a
+ * says, or all as likely if a is NULL. A number below n comes from
+ * multiplying 32 random bits by it, redrawing the few that would make
+ * some numbers more likely than others (Lemire's method, no division
+ * most of the time); the other 32 bits are the coin. A damaged
+ * database can make this n or more */
+static inline uint32_t sample_alias(const struct QuoteAlias * a, uint32_t n,
+	uint64_t s[4])
+{
+	uint64_t r = rng_next(s);
+	uint64_t m = (r & 0xffffffff) * n;
+
+	if ((uint32_t)m < n)
+	{
+		uint32_t t = -n % n;
+
+		while ((uint32_t)m < t)
+			m = (rng_next(s) & 0xffffffff) * n;
+	}
+
+	uint32_t i = m >> 32;
+
+	if (a != NULL)
+	{
+		/* a coin flip is as unpredictable as it gets, so no branch
+		 * on it: keep is all ones or all zeroes */
+		struct QuoteAlias e = a[i];
+		uint32_t keep = -(uint32_t)((uint32_t)(r >> 32) < e.prob);
+
+		i = (i & keep) | (e.alias & ~keep);
+	}
+
+	return i;
+}
+
+/* Picks a quote number with rng state s, as likely as its weight
+ * says. get_quote() refuses what a damaged database makes of it */
+static inline size_t sample_quote(const struct QuoteList * l,
+	uint64_t s[4])
+{
+	return sample_alias(l->alias, l->len, s);
+}
+
+/* Picks a quote number for key, len bytes of it: the quote with that
+ * id if it starts with #, one of that category as likely as its
+ * weight says, or any quote if there is no such thing */
+static inline size_t pick_keyed(const struct QuoteList * l,
+	const char * key, size_t len, uint64_t s[4])
+{
+	const struct QuoteSlot * k;
+	uint32_t off, n, i;
+
+	if (l->slots == NULL || len == 0 || len >= QUOTES_MAX_KEY ||
+		(k = find_slot(l, key, len, l->keys, l->keys_len)) == NULL ||
+		k->len == 0)
+	{
+		return sample_quote(l, s);
+	}
+
+	if (key[0] == '#')
+	{
+		return k->value;
+	}
+
+	if (k->value >= l->ncat || l->cat_off[k->value] >
+		l->cat_off[k->value + 1] || l->cat_off[k->value + 1] > l->nmembers)
+	{
+		/* damaged */
+		return l->len;
+	}
+
+	off = l->cat_off[k->value];
+	n = l->cat_off[k->value + 1] - off;
+	if (n == 0)
+	{
+		/* all retired */
+		return sample_quote(l, s);
+	}
+
+	i = sample_alias(l->cat_alias != NULL ? l->cat_alias + off : NULL, n, s);
+
+	return i < n ? l->members[off + i] : l->len;
+}
+
+#endif
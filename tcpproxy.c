@@ -5,88 +5,3730 @@
  * 
  * CC0/Public domain
  * 
+ * Every accepted client gets its own connection to the target. The
+ * target connection is set up with happy eyeballs (RFC 8305): all
+ * resolved addresses are raced with nonblocking connect()s, started
+ * a little after each other, and the first one to get through wins.
+ *
+ * The target name is resolved by a separate thread that keeps a small
+ * cache, so a target that moves to another IP is picked up without a
+ * restart and the event loop never has to wait for DNS. Answers are
+ * kept for as long as their DNS TTL says (names from /etc/hosts have
+ * no TTL, they get the -c one), failures are remembered for -n
+ * seconds, and an entry that is used close to its expiry is refreshed
+ * in the background before it runs out.
+ *
+ * With -w the relaying is done by several worker threads. Each has its
+ * own SO_REUSEPORT listening socket, connections, relay buffers and
+ * spare target connections, so workers only meet at the resolver
+ * cache, and only when connecting. -P pins worker i to the i-th CPU.
+ * See proxybench.c for how well that scales.
+ *
+ * -u relays UDP instead. Every client address gets a session with its
+ * own socket to the target, so replies can find their way back. The
+ * sessions live in a fixed size hash table, of -m per worker or as
+ * many as the open file limit leaves room for, and are expired by a
+ * timer wheel after -i seconds of silence, datagrams are moved in
+ * batches with recvmmsg()/sendmmsg().
+ *
+ * Bandwidth can be capped with token buckets, per connection (-r),
+ * per client IP (-I) and for the whole proxy (-G), each direction on
+ * its own. A side that runs out of tokens isn't read from until the
+ * event loop timer says there are enough again, so the kernel pushes
+ * back on the sender; nothing ever sleeps.
+ *
+ * Every worker keeps counters and log-bucketed histograms of upstream
+ * connect time, time to first byte from the target, chunk sizes and
+ * time spent waiting for a side to take our writes. kill -USR1 prints
+ * them on stderr, and with -S they are served on a unix socket:
+ *     socat - UNIX-CONNECT:/tmp/tcpproxy.stats
+ *
+ * -C writes what goes through the proxy to a pcapng file that
+ * Wireshark can open, with made up TCP/IP headers around every chunk.
+ * Workers only copy chunks into a lock-free ring, a capture thread does
+ * the rest; if it falls behind, records are dropped and counted rather
+ * than slowing down the relaying. When it has nothing to do it sleeps
+ * on an eventfd, and only the first record after that costs a worker a
+ * write to it. Files are rotated at -Z bytes, to
+ * path.1, path.2 and so on.
+ *
+ * -R records a trace through the same rings: when every connection
+ * opened, sent how much in which direction, half closed and closed,
+ * to the microsecond. tpreplay.c plays it back through a tcpproxy to
+ * see how a build holds up. The trace is TRACE_MAGIC and then records
+ * of a byte with the type (CAP_*) | direction << 2, varints for the
+ * microseconds since the previous record and the session number, and
+ * for data a varint length.
+ *
+ * Two tcpproxies can form a tunnel, to keep clients far away from the
+ * target from paying for a long haul handshake (and slow start) every
+ * time. The entry (-T n) keeps n connections per worker, links, to the
+ * exit (-X) and sends every client over one of them as a stream of
+ * frames; the exit makes the target connections. Every stream has a
+ * window of STREAM_WINDOW bytes the receiver hands back as it delivers,
+ * so one slow client can't hog a link, and streams with data take
+ * turns a chunk at a time. On one box:
+ *     tcpproxy -X 9001 localhost 80 & tcpproxy -T 2 9000 localhost 9001
+ *
+ * With -z on both ends the links are deflated. Whatever frames are
+ * queued when a link can take more are sent as one block with a sync
+ * flush, so bulk transfers get big blocks and a keystroke still goes
+ * out right away. Blocks that hardly shrink switch deflate off for the
+ * next ZIP_BYPASS bytes, so compressed data doesn't cost CPU for
+ * nothing.
+ *
+ * TCP Fast Open can save a round trip on both sides: -F n lets clients
+ * put data in their SYN, with a queue of n pending fast opens, and -f
+ * sends the first bytes of a client along in the SYN to the target.
+ * The next address isn't raced against an attempt that did that, it
+ * only gets its turn once that attempt failed. Both need
+ * net.ipv4.tcp_fastopen to allow it (3 does client and server), and a
+ * target that has given us a cookie before.
+ *
+ * compile with: cc -pthread tcpproxy.c -lresolv -lz -o tcpproxy
+ *
  * IDEAS: 
  * 		print addresses and such
- * 		sock_nonblock?
  */
 
+/* for accept4(), SOCK_NONBLOCK, POLLRDHUP and CPU affinity */
+#define _GNU_SOURCE
 
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h> /* atoi */
 #include <string.h> /* memset */
+#include <stddef.h> /* offsetof */
+#include <time.h> /* clock_gettime */
+#include <limits.h> /* INT_MAX */
+#include <pthread.h>
+#include <sched.h> /* cpu_set_t */
 
 /* socket stuff */
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h> /* getaddrinfo */
-#include <unistd.h> /* close */
+#include <unistd.h> /* close, getopt */
 #include <arpa/inet.h> /* htons, inet_ntop */
+#include <resolv.h> /* res_nquery, to find out TTLs */
+#include <arpa/nameser.h>
 
 #include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h> /* waking the capture thread */
 #include <errno.h>
+#include <fcntl.h> /* O_NONBLOCK */
+#include <signal.h>
+#include <sys/resource.h> /* RLIMIT_NOFILE */
+#include <sys/un.h> /* stats socket */
+#include <netinet/tcp.h> /* TCP_NODELAY */
+#include <zlib.h> /* tunnel compression */
 
+#include "hist.h"
+
+
+#define BUF_LEN 16384
+#define BUF_POOL_LEN 256 /* max free relay buffers kept per worker */
+#define BACKLOG 64 /* listen() backlog */
+
+#define MAX_WORKERS 64
+#define MAX_SPARES 16 /* max spare target connections per worker */
+#define SPARE_RETRY 1000 /* ms to wait before retrying a failed spare */
+
+#define UDP_BATCH 32 /* datagrams per recvmmsg()/sendmmsg() */
+#define UDP_BUF_LEN 65536 /* biggest datagram there is, roughly */
+#define UDP_IDLE 60 /* s of silence before a UDP session is dropped */
+#define UDP_MAX_SESSIONS 65536 /* per worker, if there are files for them */
+#define UDP_SPARE_FILES 64 /* kept for listeners, epoll, DNS and such */
+#define WHEEL_LEN 64 /* one second slots in the session timer wheel */
+
+#define SHAPE_BURST_DIV 10 /* default burst: 1/SHAPE_BURST_DIV s of rate */
+#define SHAPE_MIN_READ 1500 /* tokens to wait for before reading again */
+#define IP_TABLE_LEN 4096 /* client IPs tracked for -I */
+#define IP_PROBE 8 /* slots looked at for a client IP */
+
+#define CAP_RING_LEN (4 << 20) /* bytes of capture ring per worker, 2^n */
+#define CAP_ROTATE (64 << 20) /* default capture file size */
+#define CAP_SNAPLEN 65535
+#define CAP_FLOWS 8192 /* connections the capture thread can follow */
+#define TRACE_MAGIC "TPTRACE1" /* first bytes of a -R trace */
+
+
+#define MAX_LINKS 16 /* tunnel connections per worker, entry side */
+#define LINK_TABLE 256 /* stream hash buckets per link */
+#define LINK_IN_LEN (4 * BUF_LEN) /* holds at least one whole frame */
+#define LINK_OUT_LEN (64 << 10) /* initial output buffer, it grows */
+#define LINK_HIGH (64 << 10) /* queued link output before streams wait */
+#define STREAM_WINDOW (256 << 10) /* bytes in flight per stream */
+
+/* with -z the frames go over a link in blocks: 1 byte type, 1 unused
+ * and a 16 bit length, then the frames, deflated or as they are */
+#define BLOCK_HDR 4
+#define BLOCK_RAW 0
+#define BLOCK_DEFLATE 1
+#define BLOCK_LEN (32 << 10) /* max frame bytes per block */
+#define BLOCK_MAX (BLOCK_LEN + BLOCK_LEN / 8) /* after deflate, worst case */
+#define ZIP_BYPASS (1 << 20) /* bytes sent raw after a poor block */
+#define ZIP_SAMPLE 4096 /* smallest block that can start a bypass */
+
+/* tunnel frames: 1 byte type, 1 unused, 16 bit length and 32 bit
+ * stream id, all big endian, then length bytes of payload */
+#define FRAME_HDR 8
+#define FRAME_OPEN 1
+#define FRAME_DATA 2
+#define FRAME_WINDOW 3 /* payload: 32 bit credit increment */
+#define FRAME_FIN 4 /* the sender won't send more data */
+#define FRAME_RST 5 /* the stream is gone */
+
+#define MAX_ADDRS 16 /* max target addresses raced per connection */
+#define ATTEMPT_DELAY 250 /* ms between connection attempts, RFC 8305 */
+#define ATTEMPT_TIMEOUT 5000 /* ms before a single attempt is given up */
+
+#define DNS_CACHE_LEN 16 /* names kept in the resolver cache */
+#define DNS_TTL 30 /* s, for answers without a TTL, like /etc/hosts */
+#define DNS_NEG_TTL 5 /* s, failed lookups are remembered this long */
+#define DNS_REFRESH 10 /* refresh when 1/DNS_REFRESH of the TTL is left */
+
+/* A token bucket, the rate and burst size live in the settings */
+struct Bucket
+{
+	double tokens; /* bytes */
+	int64_t last; /* ms, when tokens was last topped up */
+};
+
+/* what a worker measures. Times are in microseconds */
+struct Stats
+{
+	struct Hist connect; /* accept until the target connection is up */
+	struct Hist ttfb; /* accept until the first byte from the target */
+	struct Hist blocked; /* a side not taking our writes, per episode */
+	struct Hist chunk[2]; /* bytes per recv(), per side read from */
+
+	uint64_t conns; /* accepted */
+	uint64_t closed;
+	uint64_t bytes[2]; /* read from side i */
+	uint64_t chunks[2];
+};
+
+/* connection states */
+#define CONN_RESOLVING 0 /* waiting for the resolver thread */
+#define CONN_CONNECTING 1 /* racing connects to the target */
+#define CONN_RELAY 2 /* shoveling bytes back and forth */
+#define CONN_SPARE 3 /* connected to the target, waiting for a client */
+
+/* A proxied connection. Index 0 is the client side, index 1 is the
+ * target side, so buf[i] holds bytes read from side i that still have
+ * to be sent to side (i + 1) % 2. Spare connections have no client,
+ * fd[0] is -1 for them */
+struct Conn
+{
+	int fd[2];
+	int state;
+
+	/* happy eyeballs: addresses in the order they will be tried, and
+	 * the sockets of the attempts that are in flight */
+	struct sockaddr_storage addrs[MAX_ADDRS];
+	socklen_t addrlens[MAX_ADDRS];
+	int naddrs;
+	int next_addr; /* next address to try */
+	int attempt_fd[MAX_ADDRS];
+	int64_t attempt_deadline[MAX_ADDRS];
+	int64_t next_attempt; /* when the next attempt may be started */
+	int tfo_attempt; /* the attempt with client bytes in its SYN, or -1 */
+	size_t tfo_sent; /* how many it took */
+	size_t skip; /* client bytes the target got that way, still to read */
+
+	uint8_t * buf[2]; /* from the buffer pool, NULL when empty */
+	size_t len[2]; /* bytes in buf */
+	size_t off[2]; /* bytes of buf already sent */
+	char eof[2]; /* side i has sent us a FIN */
+
+	int pfd; /* index of our first entry in the pollfd list */
+
+	/* bandwidth shaping, per direction */
+	struct Bucket bucket[2];
+	struct IpEntry * ip; /* per client IP buckets, if shaping by IP */
+	int64_t resume_at[2]; /* ms, not reading side i until then, or 0 */
+	int64_t paused_at[2]; /* ms, when reading side i was paused */
+	int64_t throttled_ms[2]; /* time spent not reading side i */
+
+	/* metrics, times in us */
+	int64_t t_accept;
+	int64_t t_connect; /* target connection up */
+	int64_t t_first; /* first byte from the target */
+	uint64_t bytes[2], chunks[2]; /* read from side i */
+	int64_t blocked_since[2]; /* side (i + 1) % 2 stopped taking buf[i] */
+	int64_t blocked_us[2];
+
+	uint64_t cap_id; /* worker id << 48 | sequence, 0 if not captured */
+
+	/* tunnel streams: side tside is a stream on link, fd[tside] is -1
+	 * and data for the socket side is queued up in q */
+	int tside; /* -1 if not a stream */
+	struct Link * link; /* NULL once the link is gone */
+	uint32_t sid;
+	struct Conn * lnext; /* stream table of the link */
+	struct Chunk * q, * q_tail;
+	size_t q_len;
+	int64_t credit; /* bytes we may still send on the stream */
+	size_t unacked; /* written to the socket, no credit given back yet */
+	char shut; /* the FIN from the link went to the socket */
+	char dead; /* reset by the other end, or lost its link */
+};
+
+/* A piece of stream data waiting for its socket, lives in a relay
+ * buffer from the pool */
+struct Chunk
+{
+	struct Chunk * next;
+	uint32_t len, off;
+	uint8_t data[];
+};
+
+#define CHUNK_LEN (BUF_LEN - sizeof(struct Chunk))
+
+/* A persistent connection between two tcpproxies in tunnel mode, that
+ * carries the streams of many clients. On the entry side a link dials
+ * the exit with happy eyeballs like any target connection */
+struct Link
+{
+	int fd; /* -1 while down */
+	struct Conn * dial; /* connecting to the exit, or NULL */
+	int64_t retry_at; /* ms, don't dial before this */
+	int pfd;
+
+	uint8_t * in; /* incoming frames, the last maybe partial */
+	size_t in_len;
+	uint8_t * out; /* frames to send, from out_off up to out_len */
+	size_t out_off, out_len, out_cap;
+
+	struct Conn * streams[LINK_TABLE]; /* by sid */
+	int nstreams;
+	uint32_t next_sid;
+
+	/* -z: the blocks that go over the wire */
+	z_stream zout, zin;
+	char zinit;
+	uint8_t * wire; /* blocks to send */
+	size_t wire_off, wire_len, wire_cap;
+	uint8_t * win; /* blocks coming in, the last maybe partial */
+	size_t win_len;
+	int64_t bypass; /* bytes to send raw before trying deflate again */
+};
+
+/* A name in the resolver cache, with its addresses already in happy
+ * eyeballs order. naddrs == 0 means the name did not resolve */
+struct DnsEntry
+{
+	char host[NI_MAXHOST];
+	char port[NI_MAXSERV];
+
+	struct sockaddr_storage addrs[MAX_ADDRS];
+	socklen_t addrlens[MAX_ADDRS];
+	int naddrs;
+
+	int64_t expires; /* ms, after this the answer can't be used */
+	int64_t refresh_at; /* ms, after this a lookup triggers a refresh */
+	char valid; /* has been resolved at least once */
+	char pending; /* queued for the resolver thread */
+	char busy; /* the resolver thread is working on it */
+};
+
+/* The resolver thread and its cache. Everything in here is protected
+ * by lock, which is never held while talking to DNS */
+struct Resolver
+{
+	pthread_mutex_t lock;
+	pthread_cond_t cond; /* signaled when an entry becomes pending */
+	struct DnsEntry cache[DNS_CACHE_LEN];
+	int nentries;
+
+	/* pipes to the workers, a byte is written when a lookup is done */
+	int notify[MAX_WORKERS];
+	int nnotify;
+};
+
+/* A UDP client and the socket we talk to the target with for it */
+struct Session
+{
+	struct sockaddr_storage cli;
+	socklen_t cli_len;
+	int fd; /* connected to the target */
+	int64_t last_active; /* ms */
+
+	struct Session * hnext; /* hash chain, or free list */
+	struct Session * wnext; /* timer wheel slot */
+};
+
+/* datagrams for a recvmmsg()/sendmmsg() */
+struct UdpBatch
+{
+	struct mmsghdr msgs[UDP_BATCH];
+	struct iovec iov[UDP_BATCH];
+	struct sockaddr_storage addrs[UDP_BATCH];
+	uint8_t * bufs[UDP_BATCH];
+	int n; /* datagrams queued up */
+};
+
+/* Token buckets of a client IP, shared by its connections */
+struct IpEntry
+{
+	struct in6_addr addr; /* IPv4 is stored v4-mapped */
+	int refs; /* connections using it, 0 means the slot can be reused */
+	struct Bucket bucket[2];
+};
+
+/* The buckets that are shared between workers, behind a lock. Only
+ * touched when -I or -G is used */
+struct Shaper
+{
+	pthread_mutex_t lock;
+	struct Bucket global[2];
+	struct IpEntry ips[IP_TABLE_LEN];
+};
+
+/* capture record types */
+#define CAP_OPEN 0 /* data: client and target address */
+#define CAP_DATA 1
+#define CAP_FIN 2
+#define CAP_CLOSE 3
+
+/* A capture record as it goes through a ring, followed by len bytes */
+struct CapRec
+{
+	uint32_t len;
+	uint8_t type;
+	uint8_t dir; /* side the data was read from */
+	uint64_t conn;
+	int64_t ts_us; /* wall clock */
+};
+
+/* Single producer, single consumer byte ring between a worker and the
+ * capture thread. head and tail only grow, the worker moves head and
+ * the capture thread tail */
+struct Ring
+{
+	uint64_t head;
+	char pad[64 - sizeof(uint64_t)]; /* keep them off each other's cache line */
+	uint64_t tail;
+	uint64_t dropped; /* records that didn't fit */
+	uint8_t data[CAP_RING_LEN];
+};
+
+/* a connection as the capture thread sees it, addresses are IPv6 */
+struct CapFlow
+{
+	uint64_t id;
+	struct sockaddr_storage addrs[2];
+	uint32_t seq[2]; /* next TCP sequence number of side i */
+	char v4; /* both sides are v4-mapped, write IPv4 packets */
+	uint32_t session; /* in the trace */
+};
+
+/* the capture thread */
+struct CapWriter
+{
+	FILE * f;
+	int nfiles; /* files opened so far */
+	uint64_t written; /* bytes in the current file */
+	struct CapFlow flows[CAP_FLOWS];
+
+	FILE * trace; /* -R */
+	int64_t trace_last; /* us, time of the last trace record */
+	uint32_t sessions; /* in the trace so far */
+};
+
+/* A relay thread. Every worker has its own listening socket (the
+ * kernel spreads the clients over them with SO_REUSEPORT) and its own
+ * everything else, so workers never have to wait for each other */
+struct Worker
+{
+	int id;
+	int cpu; /* -1 if not pinned */
+	pthread_t tid;
+	int lsock;
+	int notify; /* read end of our resolver pipe */
+
+	struct Conn ** conns;
+	int nconns, conns_len;
+
+	/* upstream pool: target connections made before there is a client
+	 * for them, so a new client doesn't have to wait for a handshake */
+	struct Conn * spares[MAX_SPARES];
+	int nspares;
+	int64_t spare_retry; /* no new spares before this, after a failure */
+
+	/* buffer pool: free relay buffers, linked through their first bytes */
+	void * free_bufs;
+	int nfree_bufs;
+
+	struct pollfd * fds;
+	int fds_len;
+
+	/* UDP mode. The session table and timer wheel are ours alone too,
+	 * SO_REUSEPORT always hands a client to the same worker */
+	int epfd;
+	struct Session * sessions; /* all of them, allocated at start */
+	struct Session * free_sessions;
+	struct Session ** table;
+	uint32_t table_mask;
+	int nsessions;
+	struct Session * wheel[WHEEL_LEN];
+	int64_t wheel_tick; /* next second of the wheel to expire */
+	struct UdpBatch * in; /* from clients */
+	struct UdpBatch * out; /* to clients */
+
+	uint64_t udp_in, udp_out; /* datagrams */
+	uint64_t udp_dropped; /* no session could be made for it */
+
+	int64_t throttled_ms; /* time connections spent not being read */
+
+	/* tunnel links: a fixed set on the entry side, whoever connects on
+	 * the exit side */
+	struct Link ** links;
+	int nlinks, links_len;
+	int64_t links_up;
+
+	/* TCP Fast Open */
+	uint64_t tfo_in; /* clients whose SYN data we took */
+	uint64_t tfo_hits; /* target connections whose SYN data was taken */
+	uint64_t tfo_fallbacks; /* tried, but the data went the slow way */
+
+	/* tunnel compression, [0] for what we send, [1] what we get */
+	uint64_t zip_raw[2]; /* frame bytes */
+	uint64_t zip_wire[2]; /* block bytes, as they went over the link */
+	uint64_t zip_bypass[2]; /* frame bytes that went raw */
+	uint64_t zip_ns[2]; /* CPU time spent in zlib */
+
+	struct Ring * ring; /* to the capture thread, NULL if not capturing */
+	uint64_t cap_seq;
+
+	struct Stats stats;
+};
+
+/* event loop settings, set by program args */
+int attempt_delay = ATTEMPT_DELAY;
+int attempt_timeout = ATTEMPT_TIMEOUT;
+int dns_ttl = DNS_TTL;
+int dns_neg_ttl = DNS_NEG_TTL;
+int target_family = AF_UNSPEC;
+int n_spares = 0;
+int quiet = 0;
+int udp_mode = 0;
+int udp_idle = UDP_IDLE * 1000; /* ms */
+int udp_max_sessions = UDP_MAX_SESSIONS;
+double conn_rate = 0, ip_rate = 0, global_rate = 0; /* bytes/s, 0 is off */
+double shape_burst = 0; /* bytes, 0 means derive it from the rate */
+int tunnel_links = 0; /* entry side of a tunnel, with this many links */
+int tunnel_exit = 0;
+int tunnel_zip = 0; /* deflate level for the links, 0 is off */
+int tfo_queue = 0; /* TCP_FASTOPEN queue on the listener, 0 is off */
+int tfo_connect = 0; /* fast open to the target */
+const char * cap_path = NULL;
+const char * trace_path = NULL;
+uint64_t cap_rotate_size = CAP_ROTATE;
+int cap_wake = -1; /* eventfd the capture thread sleeps on */
+uint32_t cap_sleeping; /* it's about to, or does */
+
+const char * target_host;
+const char * target_port;
+
+struct Resolver resolver = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+struct Shaper shaper = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* for the stats thread */
+struct Worker * workers;
+int nworkers = 1;
+int stats_pipe[2]; /* SIGUSR1 writes here */
+const char * stats_path = NULL;
 
-#define BUF_LEN 512
 
 void * getinaddr(struct sockaddr * sa)
 {
-	if (sa->sa_family == AF_INET) /* IPv4 */
-		return &(((struct sockaddr_in*)sa)->sin_addr);
-		
-	return &(((struct sockaddr_in6*)sa)->sin6_addr); /* IPv6 */
+	if (sa->sa_family == AF_INET) /* IPv4 */
+		return &(((struct sockaddr_in*)sa)->sin_addr);
+		
+	return &(((struct sockaddr_in6*)sa)->sin6_addr); /* IPv6 */
+}
+
+/* milliseconds on a clock that does not jump around */
+int64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* microseconds on the same clock */
+int64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define BUMP(x, v) __atomic_fetch_add(&(x), (v), __ATOMIC_RELAXED)
+
+/* Copies the target addresses into addrs in the order RFC 8305 wants
+ * them tried: alternating address families, starting with the family
+ * that getaddrinfo() liked best. Returns the number of addresses */
+int order_addrs(struct sockaddr_storage * addrs, socklen_t * addrlens,
+	const struct addrinfo * list)
+{
+	const struct addrinfo * p;
+	const struct addrinfo * fam[2][MAX_ADDRS];
+	int n[2] = { 0, 0 };
+	int first, i, k, naddrs = 0;
+
+	if (list == NULL)
+		return 0;
+
+	first = list->ai_family;
+
+	for (p = list; p != NULL; p = p->ai_next) {
+		k = p->ai_family == first ? 0 : 1;
+
+		if (n[k] < MAX_ADDRS)
+			fam[k][n[k]++] = p;
+	}
+
+	for (i = 0; (i < n[0] || i < n[1]) && naddrs < MAX_ADDRS; i++) {
+		for (k = 0; k < 2 && naddrs < MAX_ADDRS; k++) {
+			if (i >= n[k]) continue;
+
+			memcpy(&addrs[naddrs], fam[k][i]->ai_addr,
+				fam[k][i]->ai_addrlen);
+			addrlens[naddrs] = fam[k][i]->ai_addrlen;
+			naddrs++;
+		}
+	}
+
+	return naddrs;
+}
+
+/* Asks DNS for the TTL of the A and AAAA records of host, because
+ * getaddrinfo() throws it away. Returns the lowest TTL in seconds,
+ * INT_MAX for numeric addresses, or -1 if DNS doesn't know the name
+ * (it might come from /etc/hosts). Blocks, resolver thread only! */
+int query_ttl(const char * host)
+{
+	struct __res_state rs;
+	unsigned char ans[4096];
+	struct in6_addr tmp;
+	ns_msg msg;
+	ns_rr rr;
+	int len, ttl = -1;
+	const int types[2] = { ns_t_a, ns_t_aaaa };
+
+	if (inet_pton(AF_INET, host, &tmp) == 1 ||
+			inet_pton(AF_INET6, host, &tmp) == 1)
+		return INT_MAX; /* those don't expire */
+
+	memset(&rs, 0, sizeof(rs));
+	if (res_ninit(&rs) == -1)
+		return -1;
+
+	/* the addresses are already known, don't hang around */
+	rs.retrans = 1;
+	rs.retry = 1;
+
+	for (int t = 0; t < 2; t++) {
+		len = res_nquery(&rs, host, ns_c_in, types[t], ans, sizeof(ans));
+		if (len < 0 || ns_initparse(ans, len, &msg) == -1)
+			continue;
+
+		for (int i = 0; i < ns_msg_count(msg, ns_s_an); i++) {
+			if (ns_parserr(&msg, ns_s_an, i, &rr) == -1)
+				break;
+
+			if (ttl == -1 || (int)ns_rr_ttl(rr) < ttl)
+				ttl = ns_rr_ttl(rr);
+		}
+	}
+
+	res_nclose(&rs);
+
+	return ttl;
+}
+
+/* sets when e expires and when it should be refreshed, ttl in s */
+void dns_set_ttl(struct DnsEntry * e, int ttl, int64_t now)
+{
+	if (ttl == INT_MAX) {
+		e->expires = e->refresh_at = INT64_MAX;
+		return;
+	}
+
+	if (ttl < 1)
+		ttl = 1; /* a TTL of 0 would have us resolve for every client */
+
+	e->expires = now + (int64_t)ttl * 1000;
+	e->refresh_at = e->expires - (int64_t)ttl * 1000 / DNS_REFRESH;
+}
+
+/* The resolver thread: resolves pending cache entries, one at a time */
+void * dns_thread(void * arg)
+{
+	struct Resolver * res = arg;
+	struct DnsEntry * e;
+	struct addrinfo hints, *list;
+	char host[NI_MAXHOST], port[NI_MAXSERV];
+	int i, r, ttl;
+
+	pthread_mutex_lock(&res->lock);
+
+	while (1) {
+		for (i = 0; i < res->nentries; i++) {
+			if (res->cache[i].pending && !res->cache[i].busy)
+				break;
+		}
+
+		if (i == res->nentries) {
+			pthread_cond_wait(&res->cond, &res->lock);
+			continue;
+		}
+
+		e = &res->cache[i];
+		e->busy = 1;
+		memcpy(host, e->host, sizeof(host));
+		memcpy(port, e->port, sizeof(port));
+
+		pthread_mutex_unlock(&res->lock);
+
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = target_family;
+		hints.ai_socktype = SOCK_STREAM; /* TCP */
+
+		r = getaddrinfo(host, port, &hints, &list);
+
+		pthread_mutex_lock(&res->lock);
+
+		if (r != 0) {
+			fprintf(stderr, "getaddrinfo(%s): %s\n", host, gai_strerror(r));
+
+			/* a failed refresh doesn't throw away a good answer, it
+			 * is used until it expires */
+			if (!e->valid || e->naddrs == 0 || e->expires <= now_ms()) {
+				e->naddrs = 0;
+				dns_set_ttl(e, dns_neg_ttl, now_ms());
+			}
+		} else {
+			e->naddrs = order_addrs(e->addrs, e->addrlens, list);
+			freeaddrinfo(list);
+
+			/* the clients can go ahead with the default TTL, the real
+			 * one comes in below */
+			dns_set_ttl(e, dns_ttl, now_ms());
+		}
+
+		e->valid = 1;
+		e->pending = 0;
+
+		pthread_mutex_unlock(&res->lock);
+
+		/* wake up the event loops, if a pipe is full that one is awake */
+		for (i = 0; i < res->nnotify; i++) {
+			if (write(res->notify[i], "", 1) == -1 && errno != EAGAIN)
+				perror("write");
+		}
+
+		ttl = r == 0 ? query_ttl(host) : -1;
+
+		pthread_mutex_lock(&res->lock);
+
+		if (ttl >= 0 && !e->pending)
+			dns_set_ttl(e, ttl, now_ms());
+
+		e->busy = 0;
+	}
+
+	return NULL;
+}
+
+/* Looks host:port up in the resolver cache, without ever waiting for
+ * DNS. Returns 1 and fills addrs if there is an answer, 0 if the
+ * resolver thread has to look it up first (try again when it writes to
+ * the notify pipe), or -1 if the name is known not to resolve. addrs
+ * and addrlens need room for MAX_ADDRS addresses */
+int dns_lookup(struct Resolver * res, const char * host, const char * port,
+	struct sockaddr_storage * addrs, socklen_t * addrlens, int * naddrs,
+	int64_t now)
+{
+	struct DnsEntry * e = NULL;
+	int i, r;
+
+	pthread_mutex_lock(&res->lock);
+
+	for (i = 0; i < res->nentries; i++) {
+		if (strcmp(res->cache[i].host, host) == 0 &&
+				strcmp(res->cache[i].port, port) == 0) {
+			e = &res->cache[i];
+			break;
+		}
+	}
+
+	if (e == NULL) {
+		if (res->nentries < DNS_CACHE_LEN) {
+			e = &res->cache[res->nentries++];
+		} else {
+			/* evict whatever expires first */
+			for (i = 0; i < DNS_CACHE_LEN; i++) {
+				if (res->cache[i].pending || res->cache[i].busy)
+					continue;
+
+				if (e == NULL || res->cache[i].expires < e->expires)
+					e = &res->cache[i];
+			}
+
+			if (e == NULL) {
+				/* everything is being resolved, come back later */
+				pthread_mutex_unlock(&res->lock);
+				return 0;
+			}
+		}
+
+		memset(e, 0, sizeof(*e));
+		snprintf(e->host, sizeof(e->host), "%s", host);
+		snprintf(e->port, sizeof(e->port), "%s", port);
+	}
+
+	if (!e->valid || now >= e->expires) {
+		r = 0;
+	} else if (e->naddrs == 0) {
+		r = -1;
+	} else {
+		r = 1;
+	}
+
+	if (r == 1 && addrs != NULL) {
+		*naddrs = e->naddrs;
+		memcpy(addrs, e->addrs, e->naddrs * sizeof(e->addrs[0]));
+		memcpy(addrlens, e->addrlens, e->naddrs * sizeof(e->addrlens[0]));
+	}
+
+	/* expired, or about to: get a fresh answer */
+	if (r == 0 || (r == 1 && now >= e->refresh_at)) {
+		if (!e->pending) {
+			e->pending = 1;
+			pthread_cond_signal(&res->cond);
+		}
+	}
+
+	pthread_mutex_unlock(&res->lock);
+
+	return r;
+}
+
+/* 1 while the attempt that took client bytes along in its SYN is in
+ * flight. Nothing may race it then: whichever attempt won, the server
+ * it reached would have the bytes, and the winner would get them again
+ * through relay() */
+int tfo_in_flight(const struct Conn * c)
+{
+	return c->tfo_attempt != -1 && c->tfo_sent > 0 &&
+		c->attempt_fd[c->tfo_attempt] != -1;
+}
+
+/* Starts the next connection attempt of c. Returns 0 if an attempt was
+ * started, -1 if we ran out of addresses */
+int start_attempt(struct Conn * c, int64_t now)
+{
+	int i, fd;
+	struct sockaddr * sa;
+	uint8_t peek[BUF_LEN - 1];
+	ssize_t b;
+
+	while (c->next_addr < c->naddrs) {
+		i = c->next_addr++;
+		sa = (struct sockaddr *)&c->addrs[i];
+
+		fd = socket(sa->sa_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+		if (fd == -1) {
+			perror("socket");
+			continue;
+		}
+
+		/* With fast open, the first attempt takes whatever the client
+		 * has sent so far along in its SYN. It stays in the client
+		 * socket until we know if this attempt wins, relay() skips
+		 * it then. The next attempt only starts once this one failed,
+		 * see tfo_in_flight(), so it never races */
+		b = 0;
+		if (tfo_connect && i == 0 && c->fd[0] != -1)
+			b = recv(c->fd[0], peek, sizeof(peek), MSG_PEEK);
+
+		if (b > 0) {
+			b = sendto(fd, peek, b, MSG_FASTOPEN, sa, c->addrlens[i]);
+
+			/* no cookie yet, it only asked for one */
+			c->tfo_sent = b > 0 ? b : 0;
+			c->tfo_attempt = i;
+		} else {
+			b = connect(fd, sa, c->addrlens[i]);
+		}
+
+		/* nonblocking, so this will mostly say EINPROGRESS. Success
+		 * or failure is picked up through poll() */
+		if (b == -1 && errno != EINPROGRESS) {
+			perror("connect");
+			close(fd);
+			continue;
+		}
+
+		c->attempt_fd[i] = fd;
+		c->attempt_deadline[i] = now + attempt_timeout;
+		c->next_attempt = now + attempt_delay;
+
+		return 0;
+	}
+
+	return -1;
+}
+
+/* Copies len bytes from p into the ring at position pos, wrapping
+ * around the end */
+void ring_write(struct Ring * r, uint64_t pos, const void * p, size_t len)
+{
+	size_t at = pos & (CAP_RING_LEN - 1);
+	size_t first = CAP_RING_LEN - at < len ? CAP_RING_LEN - at : len;
+
+	memcpy(r->data + at, p, first);
+	memcpy(r->data, (const uint8_t *)p + first, len - first);
+}
+
+void ring_read(struct Ring * r, uint64_t pos, void * p, size_t len)
+{
+	size_t at = pos & (CAP_RING_LEN - 1);
+	size_t first = CAP_RING_LEN - at < len ? CAP_RING_LEN - at : len;
+
+	memcpy(p, r->data + at, first);
+	memcpy((uint8_t *)p + first, r->data, len - first);
+}
+
+/* Hands a record to the capture thread. Never waits: if the ring is
+ * full the record is dropped and counted */
+void cap_put(struct Worker * w, struct Conn * c, int type, int dir,
+	const void * data, size_t len)
+{
+	struct Ring * r = w->ring;
+	struct CapRec rec;
+	struct timespec ts;
+	uint64_t head, tail;
+	size_t need = sizeof(rec) + len;
+
+	if (r == NULL || c->cap_id == 0)
+		return;
+
+	/* only we move head, the capture thread moves tail */
+	head = r->head;
+	tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+
+	if (CAP_RING_LEN - (head - tail) < need) {
+		BUMP(r->dropped, 1);
+		return;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &ts); /* pcap wants wall clock time */
+
+	rec.len = len;
+	rec.type = type;
+	rec.dir = dir;
+	rec.conn = c->cap_id;
+	rec.ts_us = (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+
+	ring_write(r, head, &rec, sizeof(rec));
+	ring_write(r, head + sizeof(rec), data, len);
+
+	__atomic_store_n(&r->head, head + need, __ATOMIC_RELEASE);
+
+	/* The capture thread says it sleeps before it looks at the heads
+	 * one last time, and we look if it does after moving ours, so one
+	 * of us sees the other. Whoever clears the flag wakes it */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&cap_sleeping, __ATOMIC_RELAXED) &&
+			__atomic_exchange_n(&cap_sleeping, 0, __ATOMIC_RELAXED)) {
+		uint64_t one = 1;
+
+		if (write(cap_wake, &one, sizeof(one)) == -1)
+			perror("write eventfd");
+	}
+}
+
+/* starts capturing c, which just got its target connection */
+void cap_open(struct Worker * w, struct Conn * c)
+{
+	struct sockaddr_storage sa[2];
+	socklen_t sa_len;
+
+	if (w->ring == NULL)
+		return;
+
+	for (int i = 0; i < 2; i++) {
+		sa_len = sizeof(sa[i]);
+		if (getpeername(c->fd[i], (struct sockaddr *)&sa[i], &sa_len) == -1)
+			return;
+	}
+
+	c->cap_id = ((uint64_t)w->id << 48) | ++w->cap_seq;
+	cap_put(w, c, CAP_OPEN, 0, sa, sizeof(sa));
+}
+
+/* RFC 1071 sum of len bytes, not folded or inverted yet */
+uint32_t sum16(const uint8_t * p, size_t len, uint32_t sum)
+{
+	for (; len > 1; p += 2, len -= 2)
+		sum += (p[0] << 8) | p[1];
+
+	if (len)
+		sum += p[0] << 8;
+
+	return sum;
+}
+
+uint16_t fold16(uint32_t sum)
+{
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+
+	return ~sum;
+}
+
+/* pcapng wants blocks padded to 4 bytes */
+#define PAD4(x) (((x) + 3) & ~3u)
+
+void put16(uint8_t * p, uint16_t v) { p[0] = v >> 8; p[1] = v; }
+void put32(uint8_t * p, uint32_t v) { put16(p, v >> 16); put16(p + 2, v); }
+
+/* Opens the next capture file and writes the pcapng header blocks */
+int cap_rotate(struct CapWriter * cw)
+{
+	char path[PATH_MAX];
+	/* section header, then an interface with raw IP packets */
+	uint32_t shb[7] = { 0x0a0d0d0a, 28, 0x1a2b3c4d, 1 /* v1.0 */, 0xffffffff,
+		0xffffffff, 28 };
+	uint32_t idb[5] = { 1, 20, 101 /* LINKTYPE_RAW */, CAP_SNAPLEN, 20 };
+
+	if (cw->f != NULL)
+		fclose(cw->f);
+
+	if (cw->nfiles == 0)
+		snprintf(path, sizeof(path), "%s", cap_path);
+	else
+		snprintf(path, sizeof(path), "%s.%d", cap_path, cw->nfiles);
+
+	cw->nfiles++;
+	cw->written = sizeof(shb) + sizeof(idb);
+
+	cw->f = fopen(path, "w");
+	if (cw->f == NULL) {
+		perror(path);
+		return -1;
+	}
+
+	fwrite(shb, sizeof(shb), 1, cw->f);
+	fwrite(idb, sizeof(idb), 1, cw->f);
+
+	return 0;
+}
+
+/* Writes a TCP segment of the flow of s into the capture file. dir is
+ * the side that sent it */
+void cap_segment(struct CapWriter * cw, struct CapFlow * s, int dir,
+	uint8_t flags, const uint8_t * data, size_t len, int64_t ts_us)
+{
+	uint8_t pkt[60]; /* IP + TCP header, the data follows */
+	uint32_t epb[7];
+	size_t iplen, hlen, caplen;
+	const struct sockaddr_storage * src = &s->addrs[dir];
+	const struct sockaddr_storage * dst = &s->addrs[(dir + 1) % 2];
+	uint8_t * tcp;
+	uint32_t sum;
+	static const uint8_t zero[4];
+
+	if (cw->f == NULL)
+		return;
+
+	memset(pkt, 0, sizeof(pkt));
+
+	if (s->v4) {
+		hlen = 20;
+		iplen = hlen + 20 + len;
+
+		pkt[0] = 0x45;
+		put16(pkt + 2, iplen);
+		pkt[8] = 64; /* TTL */
+		pkt[9] = IPPROTO_TCP;
+		memcpy(pkt + 12, (uint8_t *)&((struct sockaddr_in6 *)src)->sin6_addr + 12, 4);
+		memcpy(pkt + 16, (uint8_t *)&((struct sockaddr_in6 *)dst)->sin6_addr + 12, 4);
+		put16(pkt + 10, fold16(sum16(pkt, 20, 0)));
+
+		/* pseudo header for the TCP checksum */
+		sum = sum16(pkt + 12, 8, 0) + IPPROTO_TCP + 20 + len;
+	} else {
+		hlen = 40;
+		iplen = hlen + 20 + len;
+
+		pkt[0] = 0x60;
+		put16(pkt + 4, iplen - hlen);
+		pkt[6] = IPPROTO_TCP;
+		pkt[7] = 64; /* hop limit */
+		memcpy(pkt + 8, &((struct sockaddr_in6 *)src)->sin6_addr, 16);
+		memcpy(pkt + 24, &((struct sockaddr_in6 *)dst)->sin6_addr, 16);
+
+		sum = sum16(pkt + 8, 32, 0) + IPPROTO_TCP + 20 + len;
+	}
+
+	tcp = pkt + hlen;
+	memcpy(tcp, &((struct sockaddr_in6 *)src)->sin6_port, 2);
+	memcpy(tcp + 2, &((struct sockaddr_in6 *)dst)->sin6_port, 2);
+	put32(tcp + 4, s->seq[dir]);
+	put32(tcp + 8, (flags & 0x10) ? s->seq[(dir + 1) % 2] : 0);
+	tcp[12] = 5 << 4; /* header length in words */
+	tcp[13] = flags;
+	put16(tcp + 14, 65535); /* window */
+
+	sum = sum16(tcp, 20, sum);
+	put16(tcp + 16, fold16(sum16(data, len, sum)));
+
+	caplen = hlen + 20 + len;
+	if (caplen > CAP_SNAPLEN)
+		caplen = CAP_SNAPLEN;
+
+	/* enhanced packet block */
+	epb[0] = 6;
+	epb[1] = 32 + PAD4(caplen);
+	epb[2] = 0; /* interface */
+	epb[3] = (uint64_t)ts_us >> 32;
+	epb[4] = (uint32_t)ts_us;
+	epb[5] = caplen;
+	epb[6] = iplen;
+
+	fwrite(epb, sizeof(epb), 1, cw->f);
+	fwrite(pkt, hlen + 20, 1, cw->f);
+	fwrite(data, caplen - hlen - 20, 1, cw->f);
+	fwrite(zero, PAD4(caplen) - caplen, 1, cw->f);
+	fwrite(&epb[1], 4, 1, cw->f);
+
+	cw->written += epb[1];
+
+	/* SYN and FIN take a sequence number too */
+	s->seq[dir] += len + ((flags & 0x03) ? 1 : 0);
+}
+
+/* finds the flow of conn id, or a free slot for it */
+struct CapFlow * cap_flow(struct CapWriter * cw, uint64_t id, int make)
+{
+	uint64_t h = id * 0x9e3779b97f4a7c15ull;
+	struct CapFlow * s;
+
+	for (int i = 0; i < CAP_FLOWS; i++) {
+		s = &cw->flows[(h + i) % CAP_FLOWS];
+
+		if (s->id == id)
+			return s;
+
+		if (s->id == 0) {
+			if (!make)
+				return NULL;
+
+			s->id = id;
+			return s;
+		}
+	}
+
+	return NULL; /* full, that flow won't be captured */
+}
+
+/* stores sa as IPv6, mapping IPv4 */
+void cap_addr(struct sockaddr_storage * out, const struct sockaddr_storage * sa)
+{
+	struct sockaddr_in6 * a = (struct sockaddr_in6 *)out;
+
+	if (sa->ss_family == AF_INET6) {
+		memcpy(out, sa, sizeof(struct sockaddr_in6));
+		return;
+	}
+
+	memset(a, 0, sizeof(*a));
+	a->sin6_family = AF_INET6;
+	a->sin6_port = ((struct sockaddr_in *)sa)->sin_port;
+	a->sin6_addr.s6_addr[10] = a->sin6_addr.s6_addr[11] = 0xff;
+	memcpy(&a->sin6_addr.s6_addr[12], &((struct sockaddr_in *)sa)->sin_addr, 4);
+}
+
+void put_varint(FILE * f, uint64_t v)
+{
+	while (v >= 0x80) {
+		fputc((v & 0x7f) | 0x80, f);
+		v >>= 7;
+	}
+
+	fputc(v, f);
+}
+
+/* Writes rec to the trace: sizes and times only, never the data. The
+ * capture record types double as trace record types */
+void trace_record(struct CapWriter * cw, struct CapFlow * s,
+	struct CapRec * rec)
+{
+	/* the rings of different workers can be a little out of order */
+	int64_t delta = rec->ts_us - cw->trace_last;
+
+	if (cw->trace == NULL)
+		return;
+
+	if (delta < 0)
+		delta = 0;
+	else
+		cw->trace_last = rec->ts_us;
+
+	fputc(rec->type | rec->dir << 2, cw->trace);
+	put_varint(cw->trace, delta);
+	put_varint(cw->trace, s->session);
+
+	if (rec->type == CAP_DATA)
+		put_varint(cw->trace, rec->len);
+}
+
+/* turns one record into packets, and a trace record */
+void cap_record(struct CapWriter * cw, struct CapRec * rec, uint8_t * data)
+{
+	struct CapFlow * s;
+
+	if (rec->type == CAP_OPEN) {
+		s = cap_flow(cw, rec->conn, 1);
+		if (s == NULL)
+			return;
+
+		if (cw->trace_last == 0)
+			cw->trace_last = rec->ts_us;
+		s->session = cw->sessions++;
+		trace_record(cw, s, rec);
+
+		for (int i = 0; i < 2; i++)
+			cap_addr(&s->addrs[i], (struct sockaddr_storage *)data + i);
+
+		s->v4 = IN6_IS_ADDR_V4MAPPED(&((struct sockaddr_in6 *)&s->addrs[0])->sin6_addr) &&
+			IN6_IS_ADDR_V4MAPPED(&((struct sockaddr_in6 *)&s->addrs[1])->sin6_addr);
+		s->seq[0] = (uint32_t)rec->conn * 2654435761u;
+		s->seq[1] = ~s->seq[0];
+
+		/* make up a handshake so Wireshark knows what's what */
+		cap_segment(cw, s, 0, 0x02, NULL, 0, rec->ts_us);
+		cap_segment(cw, s, 1, 0x12, NULL, 0, rec->ts_us);
+		cap_segment(cw, s, 0, 0x10, NULL, 0, rec->ts_us);
+		return;
+	}
+
+	s = cap_flow(cw, rec->conn, 0);
+	if (s == NULL)
+		return; /* its open record was dropped */
+
+	trace_record(cw, s, rec);
+
+	switch (rec->type) {
+		case CAP_DATA:
+			cap_segment(cw, s, rec->dir, 0x18, data, rec->len, rec->ts_us);
+			break;
+
+		case CAP_FIN:
+			cap_segment(cw, s, rec->dir, 0x11, NULL, 0, rec->ts_us);
+			break;
+
+		case CAP_CLOSE:
+			/* leave a tombstone-free table: move the flows after it
+			 * that were displaced by it back into place */
+			memset(s, 0, sizeof(*s));
+			for (int i = 1; i < CAP_FLOWS; i++) {
+				struct CapFlow * n = &cw->flows[(s - cw->flows + i) % CAP_FLOWS];
+				struct CapFlow tmp;
+
+				if (n->id == 0)
+					break;
+
+				tmp = *n;
+				memset(n, 0, sizeof(*n));
+				*cap_flow(cw, tmp.id, 1) = tmp;
+			}
+			break;
+	}
+}
+
+/* whether any worker has records for the capture thread */
+int cap_pending(void)
+{
+	for (int i = 0; i < nworkers; i++) {
+		struct Ring * r = workers[i].ring;
+
+		if (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) != r->tail)
+			return 1;
+	}
+
+	return 0;
+}
+
+/* The capture thread: empties the rings of the workers into pcapng
+ * files, so the workers never wait for the disk */
+void * cap_thread(void * arg)
+{
+	struct CapWriter * cw = arg;
+	struct CapRec rec;
+	uint8_t * data = malloc(CAP_RING_LEN);
+	uint64_t head, tail, n;
+	int busy;
+
+	if (cap_path != NULL && cap_rotate(cw) == -1)
+		return NULL;
+
+	if (trace_path != NULL) {
+		cw->trace = fopen(trace_path, "w");
+		if (cw->trace == NULL) {
+			perror(trace_path);
+			return NULL;
+		}
+
+		fputs(TRACE_MAGIC, cw->trace);
+	}
+
+	while (1) {
+		busy = 0;
+
+		for (int i = 0; i < nworkers; i++) {
+			struct Ring * r = workers[i].ring;
+
+			head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+			tail = r->tail;
+
+			while (tail != head) {
+				ring_read(r, tail, &rec, sizeof(rec));
+				ring_read(r, tail + sizeof(rec), data, rec.len);
+				tail += sizeof(rec) + rec.len;
+
+				cap_record(cw, &rec, data);
+				busy = 1;
+			}
+
+			__atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+
+			if (cap_path != NULL && cap_rotate_size > 0 &&
+					cw->written >= cap_rotate_size)
+				cap_rotate(cw);
+		}
+
+		if (!busy) {
+			/* nothing to do: make what we have readable and sleep
+			 * until a worker has something */
+			if (cw->f != NULL)
+				fflush(cw->f);
+			if (cw->trace != NULL)
+				fflush(cw->trace);
+
+			__atomic_store_n(&cap_sleeping, 1, __ATOMIC_RELAXED);
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			if (!cap_pending() &&
+					read(cap_wake, &n, sizeof(n)) == -1 && errno != EINTR)
+				perror("read eventfd");
+			__atomic_store_n(&cap_sleeping, 0, __ATOMIC_RELAXED);
+		}
+	}
+
+	free(data);
+	return NULL;
+}
+
+/* prints who is talking to who over c */
+void print_conn(struct Conn * c)
+{
+	char ntop_buf[2][INET6_ADDRSTRLEN];
+	struct sockaddr_storage sa[2];
+	socklen_t sa_len[2] = { sizeof(sa[0]), sizeof(sa[1]) };
+
+	if (quiet)
+		return;
+
+	for (int i = 0; i < 2; i++) {
+		if (getpeername(c->fd[i], (struct sockaddr *)&sa[i], &sa_len[i]) == -1 ||
+				inet_ntop(sa[i].ss_family,
+				getinaddr((struct sockaddr *)&sa[i]),
+				ntop_buf[i], sizeof(ntop_buf[i])) == NULL) {
+			perror("inet_ntop");
+			return;
+		}
+	}
+
+	printf("%s <-> %s\n", ntop_buf[0], ntop_buf[1]);
+}
+
+/* Counts how the fast open attempt of c did, now that winner has the
+ * target connection */
+void tfo_result(struct Worker * w, struct Conn * c, int winner)
+{
+	struct tcp_info ti;
+	socklen_t len = sizeof(ti);
+
+	if (winner == c->tfo_attempt && c->tfo_sent > 0) {
+		/* the data is in the target socket either way, but only with
+		 * SYN_DATA did it save the round trip */
+		c->skip = c->tfo_sent;
+
+		if (getsockopt(c->fd[1], IPPROTO_TCP, TCP_INFO, &ti, &len) == 0 &&
+				(ti.tcpi_options & TCPI_OPT_SYN_DATA)) {
+			BUMP(w->tfo_hits, 1);
+			return;
+		}
+	}
+
+	BUMP(w->tfo_fallbacks, 1);
+}
+
+/* closes every attempt except the winner, which becomes the target */
+void finish_attempts(struct Worker * w, struct Conn * c, int winner)
+{
+	for (int i = 0; i < c->naddrs; i++) {
+		if (c->attempt_fd[i] == -1 || i == winner) continue;
+
+		close(c->attempt_fd[i]);
+		c->attempt_fd[i] = -1;
+	}
+
+	c->fd[1] = c->attempt_fd[winner];
+	c->attempt_fd[winner] = -1;
+
+	if (c->tfo_attempt != -1)
+		tfo_result(w, c, winner);
+
+	if (c->fd[0] == -1 && c->tside == -1) {
+		/* nobody to relay for yet, wait in the upstream pool */
+		c->state = CONN_SPARE;
+		return;
+	}
+
+	c->state = CONN_RELAY;
+	c->t_connect = now_us();
+	hist_add(&w->stats.connect, c->t_connect - c->t_accept);
+
+	if (c->tside == -1) {
+		print_conn(c);
+		cap_open(w, c);
+	}
+}
+
+/* Checks up on the connection attempts of c. Returns -1 if every
+ * address has been tried without success */
+int poll_attempts(struct Worker * w, struct Conn * c, struct pollfd * fds,
+	int64_t now)
+{
+	int err, inflight = 0;
+	socklen_t err_len;
+	int k = c->pfd;
+
+	for (int i = 0; i < c->naddrs; i++) {
+		if (c->attempt_fd[i] == -1) continue;
+
+		/* the pollfd list holds the attempts in address order */
+		if (fds[k].revents & (POLLOUT | POLLERR | POLLHUP)) {
+			err = 0;
+			err_len = sizeof(err);
+
+			if (getsockopt(c->attempt_fd[i], SOL_SOCKET, SO_ERROR,
+					&err, &err_len) == -1)
+				err = errno;
+
+			if (err == 0) {
+				/* we have a winner */
+				finish_attempts(w, c, i);
+				return 0;
+			}
+
+			fprintf(stderr, "connect: %s\n", strerror(err));
+			close(c->attempt_fd[i]);
+			c->attempt_fd[i] = -1;
+
+			/* don't wait for the attempt delay after a failure */
+			c->next_attempt = now;
+		} else if (now >= c->attempt_deadline[i]) {
+			fprintf(stderr, "connect: attempt timed out\n");
+			close(c->attempt_fd[i]);
+			c->attempt_fd[i] = -1;
+			c->next_attempt = now;
+		} else {
+			inflight++;
+		}
+
+		k++;
+	}
+
+	if (now >= c->next_attempt && !tfo_in_flight(c) &&
+			start_attempt(c, now) == 0)
+		inflight++;
+
+	return inflight > 0 ? 0 : -1;
+}
+
+/* takes a relay buffer from the pool of w */
+uint8_t * buf_get(struct Worker * w)
+{
+	void * b = w->free_bufs;
+
+	if (b == NULL)
+		return malloc(BUF_LEN);
+
+	w->free_bufs = *(void **)b;
+	w->nfree_bufs--;
+
+	return b;
+}
+
+/* gives a relay buffer back to the pool of w */
+void buf_put(struct Worker * w, uint8_t * b)
+{
+	if (w->nfree_bufs >= BUF_POOL_LEN) {
+		free(b);
+		return;
+	}
+
+	*(void **)b = w->free_bufs;
+	w->free_bufs = b;
+	w->nfree_bufs++;
+}
+
+/* parses a rate or size like 250k or 10m, in bytes */
+double parse_bytes(const char * s)
+{
+	char * end;
+	double v = strtod(s, &end);
+
+	switch (*end) {
+		case 'k': case 'K': v *= 1e3; break;
+		case 'm': case 'M': v *= 1e6; break;
+		case 'g': case 'G': v *= 1e9; break;
+	}
+
+	return v;
+}
+
+/* tops up b for a bucket filling at rate bytes/s */
+void bucket_fill(struct Bucket * b, double rate, int64_t now)
+{
+	double burst = shape_burst > 0 ? shape_burst : rate / SHAPE_BURST_DIV;
+
+	if (burst < BUF_LEN)
+		burst = BUF_LEN; /* or we could never read a whole buffer */
+
+	if (b->last == 0)
+		b->tokens = burst; /* new buckets start out full */
+	else
+		b->tokens += (double)(now - b->last) * rate / 1000;
+
+	if (b->tokens > burst)
+		b->tokens = burst;
+
+	b->last = now;
+}
+
+/* Gets the per IP buckets for the client of c, if we shape by IP */
+void shape_attach(struct Conn * c, const struct sockaddr_storage * cli)
+{
+	struct in6_addr a;
+	struct IpEntry * e, * reuse = NULL;
+	uint32_t h = 2166136261u;
+
+	if (ip_rate <= 0)
+		return;
+
+	if (cli->ss_family == AF_INET) {
+		/* v4-mapped, so a client is the same over both families */
+		memset(&a, 0, sizeof(a));
+		a.s6_addr[10] = a.s6_addr[11] = 0xff;
+		memcpy(&a.s6_addr[12], &((struct sockaddr_in *)cli)->sin_addr, 4);
+	} else {
+		a = ((struct sockaddr_in6 *)cli)->sin6_addr;
+	}
+
+	for (int i = 0; i < 16; i++)
+		h = (h ^ a.s6_addr[i]) * 16777619u;
+
+	pthread_mutex_lock(&shaper.lock);
+
+	for (int i = 0; i < IP_PROBE; i++) {
+		e = &shaper.ips[(h + i) % IP_TABLE_LEN];
+
+		if (memcmp(&e->addr, &a, sizeof(a)) == 0 &&
+				(e->refs > 0 || e->bucket[0].last != 0)) {
+			reuse = e;
+			break;
+		}
+
+		/* an IP without connections has nothing worth remembering
+		 * but its empty bucket, take the slot if nothing better */
+		if (e->refs == 0 && reuse == NULL)
+			reuse = e;
+	}
+
+	if (reuse != NULL) {
+		if (memcmp(&reuse->addr, &a, sizeof(a)) != 0) {
+			memset(reuse, 0, sizeof(*reuse));
+			reuse->addr = a;
+		}
+
+		reuse->refs++;
+		c->ip = reuse;
+	}
+	/* else the table is too crowded here, c goes unshaped by IP */
+
+	pthread_mutex_unlock(&shaper.lock);
+}
+
+void shape_detach(struct Conn * c)
+{
+	if (c->ip == NULL)
+		return;
+
+	pthread_mutex_lock(&shaper.lock);
+	c->ip->refs--;
+	pthread_mutex_unlock(&shaper.lock);
+
+	c->ip = NULL;
+}
+
+/* Returns how many bytes c may read from side i right now. If that is
+ * none, reading is paused and c->resume_at[i] says when to come back */
+size_t shape_allow(struct Conn * c, int i, int64_t now)
+{
+	double allow = BUF_LEN - 1, rate = 0;
+
+	if (conn_rate > 0) {
+		bucket_fill(&c->bucket[i], conn_rate, now);
+
+		allow = c->bucket[i].tokens;
+		rate = conn_rate;
+	}
+
+	if (c->ip != NULL || global_rate > 0) {
+		pthread_mutex_lock(&shaper.lock);
+
+		if (c->ip != NULL) {
+			bucket_fill(&c->ip->bucket[i], ip_rate, now);
+
+			if (c->ip->bucket[i].tokens < allow) {
+				allow = c->ip->bucket[i].tokens;
+				rate = ip_rate;
+			}
+		}
+
+		if (global_rate > 0) {
+			bucket_fill(&shaper.global[i], global_rate, now);
+
+			if (shaper.global[i].tokens < allow) {
+				allow = shaper.global[i].tokens;
+				rate = global_rate;
+			}
+		}
+
+		pthread_mutex_unlock(&shaper.lock);
+	}
+
+	if (allow >= 1)
+		return allow < BUF_LEN - 1 ? (size_t)allow : BUF_LEN - 1;
+
+	/* out of tokens: come back when the tightest bucket has enough
+	 * for a decent read, rather than a byte at a time */
+	c->resume_at[i] = now + 1 +
+		(int64_t)((SHAPE_MIN_READ - allow) * 1000 / rate);
+
+	return 0;
+}
+
+/* takes the tokens for b bytes read from side i of c */
+void shape_charge(struct Conn * c, int i, size_t b)
+{
+	if (conn_rate > 0)
+		c->bucket[i].tokens -= b;
+
+	if (c->ip == NULL && global_rate <= 0)
+		return;
+
+	/* other workers may have taken from the shared buckets since we
+	 * looked, they can go a bit negative and will pay it back */
+	pthread_mutex_lock(&shaper.lock);
+
+	if (c->ip != NULL)
+		c->ip->bucket[i].tokens -= b;
+	if (global_rate > 0)
+		shaper.global[i].tokens -= b;
+
+	pthread_mutex_unlock(&shaper.lock);
+}
+
+/* listens to side i of c again if its tokens are back */
+void shape_resume(struct Worker * w, struct Conn * c, int i, int64_t now)
+{
+	if (c->resume_at[i] != 0 && now >= c->resume_at[i]) {
+		c->throttled_ms[i] += c->resume_at[i] - c->paused_at[i];
+		BUMP(w->throttled_ms, c->resume_at[i] - c->paused_at[i]);
+		c->resume_at[i] = 0;
+	}
+}
+
+/* Moves bytes for one direction of c: i is the side we read from.
+ * Returns -1 if the connection should be torn down */
+int relay(struct Worker * w, struct Conn * c, int i, short revents,
+	short out_revents, int64_t now)
+{
+	int o = (i + 1) % 2;
+	ssize_t b;
+	size_t want;
+
+	shape_resume(w, c, i, now);
+
+	if (c->len[i] == 0 && !c->eof[i] && c->resume_at[i] == 0 &&
+			(revents & (POLLIN | POLLHUP | POLLERR))) {
+		want = shape_allow(c, i, now);
+		if (want == 0) {
+			c->paused_at[i] = now;
+			return 0;
+		}
+
+		/* buffers only stick around while there is something in them,
+		 * so idle connections don't cost any */
+		if (c->buf[i] == NULL)
+			c->buf[i] = buf_get(w);
+
+		/* want is at most BUF_LEN - 1, room for a terminating 0 byte */
+		b = recv(c->fd[i], c->buf[i], want, 0);
+
+		if (b <= 0) {
+			buf_put(w, c->buf[i]);
+			c->buf[i] = NULL;
+		}
+
+		if (b < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+				return 0;
+
+			perror("recv");
+			return -1;
+		}
+		else if (b == 0) {
+			/* EOF, pass it on to the other side */
+			if (!quiet)
+				printf("EOF(probably connection %d closed)\n", i);
+
+			c->eof[i] = 1;
+			shutdown(c->fd[o], SHUT_WR);
+			cap_put(w, c, CAP_FIN, i, NULL, 0);
+			return 0;
+		}
+
+		c->len[i] = b;
+		c->off[i] = 0;
+		shape_charge(c, i, b);
+		cap_put(w, c, CAP_DATA, i, c->buf[i], b);
+
+		if (i == 0 && c->skip > 0) {
+			/* went to the target in its SYN already */
+			c->off[i] = c->skip < (size_t)b ? c->skip : (size_t)b;
+			c->skip -= c->off[i];
+		}
+
+		c->bytes[i] += b;
+		c->chunks[i]++;
+		BUMP(w->stats.bytes[i], b);
+		BUMP(w->stats.chunks[i], 1);
+		hist_add(&w->stats.chunk[i], b);
+
+		if (i == 1 && c->t_first == 0) {
+			c->t_first = now_us();
+			hist_add(&w->stats.ttfb, c->t_first - c->t_accept);
+		}
+
+		/* the contents go to the capture file with -C, if anywhere */
+		if (!quiet)
+			printf("message from %d: length %zd\n", i, b);
+
+		/* try to get rid of it right away, most of the time the other
+		 * side has room */
+		out_revents |= POLLOUT;
+	}
+
+	if (c->len[i] > 0 && (out_revents & (POLLOUT | POLLERR | POLLHUP))) {
+		/* send the data to the next socket */
+		b = send(c->fd[o], c->buf[i] + c->off[i],
+			c->len[i] - c->off[i], MSG_NOSIGNAL);
+
+		if (b < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+				perror("send");
+				return -1;
+			}
+
+			b = 0;
+		}
+
+		c->off[i] += b;
+		if (c->off[i] == c->len[i]) {
+			c->len[i] = c->off[i] = 0;
+
+			buf_put(w, c->buf[i]);
+			c->buf[i] = NULL;
+
+			if (c->blocked_since[i] != 0) {
+				int64_t d = now_us() - c->blocked_since[i];
+
+				c->blocked_us[i] += d;
+				hist_add(&w->stats.blocked, d);
+				c->blocked_since[i] = 0;
+			}
+		} else if (c->blocked_since[i] == 0) {
+			/* the other side can't keep up, start the clock */
+			c->blocked_since[i] = now_us();
+		}
+	}
+
+	return 0;
+}
+
+/* makes a connection for client cfd, or a spare one if cfd is -1 */
+struct Conn * conn_new(int cfd)
+{
+	struct Conn * c = malloc(sizeof(struct Conn));
+
+	memset(c, 0, sizeof(struct Conn));
+	c->fd[0] = cfd;
+	c->fd[1] = -1;
+	c->tside = -1;
+	c->state = CONN_RESOLVING;
+
+	for (int i = 0; i < MAX_ADDRS; i++)
+		c->attempt_fd[i] = -1;
+	c->tfo_attempt = -1;
+
+	return c;
+}
+
+/* Gets c going once we know where the target is. Returns -1 if there
+ * is no way c will ever reach it */
+int conn_resolve(struct Conn * c, int64_t now)
+{
+	int r = dns_lookup(&resolver, target_host, target_port,
+		c->addrs, c->addrlens, &c->naddrs, now);
+
+	if (r == 0)
+		return 0; /* try again when the resolver thread is done */
+
+	if (r < 0) {
+		fprintf(stderr, "Can't resolve %s\n", target_host);
+		return -1;
+	}
+
+	c->state = CONN_CONNECTING;
+
+	if (start_attempt(c, now) == -1) {
+		fprintf(stderr, "All attempts to connect to target host have failed\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+void put_frame_hdr(uint8_t * p, int type, uint32_t sid, size_t len)
+{
+	p[0] = type;
+	p[1] = 0;
+	put16(p + 2, len);
+	put32(p + 4, sid);
+}
+
+uint32_t get32(const uint8_t * p)
+{
+	return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+/* Makes room for n more bytes of output on l, returns where they go */
+uint8_t * link_reserve(struct Link * l, size_t n)
+{
+	if (l->out_len + n > l->out_cap && l->out_off > 0) {
+		memmove(l->out, l->out + l->out_off, l->out_len - l->out_off);
+		l->out_len -= l->out_off;
+		l->out_off = 0;
+	}
+
+	while (l->out_len + n > l->out_cap) {
+		l->out_cap = l->out_cap ? l->out_cap * 2 : LINK_OUT_LEN;
+		l->out = realloc(l->out, l->out_cap);
+	}
+
+	return l->out + l->out_len;
+}
+
+/* queues a frame without data, arg is the payload of FRAME_WINDOW */
+void link_frame(struct Link * l, int type, uint32_t sid, uint32_t arg)
+{
+	size_t len = type == FRAME_WINDOW ? 4 : 0;
+	uint8_t * p = link_reserve(l, FRAME_HDR + len);
+
+	put_frame_hdr(p, type, sid, len);
+	if (len)
+		put32(p + FRAME_HDR, arg);
+
+	l->out_len += FRAME_HDR + len;
+}
+
+/* if streams may add data to l, which is how they take turns: all
+ * streams that were readable when there was room get one chunk in */
+int link_room(struct Link * l)
+{
+	return l->out_len - l->out_off < LINK_HIGH;
+}
+
+struct Conn * link_find(struct Link * l, uint32_t sid)
+{
+	struct Conn * c = l->streams[sid % LINK_TABLE];
+
+	while (c != NULL && c->sid != sid)
+		c = c->lnext;
+
+	return c;
+}
+
+void link_add(struct Link * l, struct Conn * c, uint32_t sid)
+{
+	c->link = l;
+	c->sid = sid;
+	c->lnext = l->streams[sid % LINK_TABLE];
+	l->streams[sid % LINK_TABLE] = c;
+	l->nstreams++;
+}
+
+void link_remove(struct Link * l, struct Conn * c)
+{
+	struct Conn ** p = &l->streams[c->sid % LINK_TABLE];
+
+	while (*p != c)
+		p = &(*p)->lnext;
+
+	*p = c->lnext;
+	l->nstreams--;
+	c->link = NULL;
+}
+
+/* Drops the connection of l, and with it every stream on it */
+void link_down(struct Worker * w, struct Link * l, int64_t now)
+{
+	struct Conn * c;
+
+	if (l->fd != -1) {
+		close(l->fd);
+		l->fd = -1;
+		BUMP(w->links_up, -1);
+	}
+
+	for (int i = 0; i < LINK_TABLE; i++) {
+		while ((c = l->streams[i]) != NULL) {
+			l->streams[i] = c->lnext;
+			c->link = NULL;
+			c->dead = 1;
+		}
+	}
+
+	l->nstreams = 0;
+	l->in_len = l->out_len = l->out_off = 0;
+	l->win_len = l->wire_len = l->wire_off = 0;
+	l->bypass = 0;
+	l->retry_at = now + SPARE_RETRY;
+}
+
+/* CPU time of the calling thread, in ns */
+int64_t cpu_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Turns the frames l has queued up into blocks on the wire. Deflate
+ * gets a sync flush at the end of every block, so whatever was queued
+ * when the link had room goes out right away and interactive traffic
+ * never waits for a window to fill up */
+void link_pack(struct Worker * w, struct Link * l)
+{
+	size_t n, len;
+	uint8_t * p;
+	int type, r;
+	int64_t t;
+
+	while (l->out_off < l->out_len) {
+		n = l->out_len - l->out_off;
+		if (n > BLOCK_LEN)
+			n = BLOCK_LEN;
+
+		while (l->wire_len + BLOCK_HDR + BLOCK_MAX > l->wire_cap) {
+			l->wire_cap = l->wire_cap ? l->wire_cap * 2 : LINK_OUT_LEN;
+			l->wire = realloc(l->wire, l->wire_cap);
+		}
+
+		p = l->wire + l->wire_len;
+
+		if (l->bypass > 0) {
+			type = BLOCK_RAW;
+			len = n;
+			memcpy(p + BLOCK_HDR, l->out + l->out_off, n);
+
+			l->bypass -= n;
+			BUMP(w->zip_bypass[0], n);
+		} else {
+			type = BLOCK_DEFLATE;
+			t = cpu_ns();
+
+			l->zout.next_in = l->out + l->out_off;
+			l->zout.avail_in = n;
+			l->zout.next_out = p + BLOCK_HDR;
+			l->zout.avail_out = BLOCK_MAX;
+			r = deflate(&l->zout, Z_SYNC_FLUSH);
+			len = BLOCK_MAX - l->zout.avail_out;
+
+			BUMP(w->zip_ns[0], cpu_ns() - t);
+
+			if (r != Z_OK || l->zout.avail_in != 0) {
+				/* Whatever deflate took in is in its history now,
+				 * and the other end's inflate will never see it.
+				 * So no more deflate until the link comes up again,
+				 * starting with this block */
+				type = BLOCK_RAW;
+				len = n;
+				memcpy(p + BLOCK_HDR, l->out + l->out_off, n);
+
+				l->bypass = INT64_MAX;
+				BUMP(w->zip_bypass[0], n);
+			} else if (n >= ZIP_SAMPLE && len * 16 > n * 15) {
+				/* not worth it, this is probably compressed
+				 * already. Skip deflate for a while and then have
+				 * another look. Small blocks are all flush
+				 * overhead, they don't count */
+				l->bypass = ZIP_BYPASS;
+			}
+		}
+
+		p[0] = type;
+		p[1] = 0;
+		put16(p + 2, len);
+
+		l->wire_len += BLOCK_HDR + len;
+		l->out_off += n;
+
+		BUMP(w->zip_raw[0], n);
+		BUMP(w->zip_wire[0], BLOCK_HDR + len);
+	}
+
+	l->out_off = l->out_len = 0;
+}
+
+/* Gets the frames out of a block that came in over l, into l->in.
+ * Returns -1 for nonsense */
+int link_unpack(struct Worker * w, struct Link * l, uint8_t * p)
+{
+	size_t len = p[2] << 8 | p[3];
+	size_t room = LINK_IN_LEN - l->in_len;
+	int64_t t;
+	int r;
+
+	if (p[0] == BLOCK_RAW) {
+		if (len > room)
+			return -1;
+
+		memcpy(l->in + l->in_len, p + BLOCK_HDR, len);
+		l->in_len += len;
+
+		BUMP(w->zip_bypass[1], len);
+		BUMP(w->zip_raw[1], len);
+	} else if (p[0] == BLOCK_DEFLATE) {
+		t = cpu_ns();
+
+		l->zin.next_in = p + BLOCK_HDR;
+		l->zin.avail_in = len;
+		l->zin.next_out = l->in + l->in_len;
+		l->zin.avail_out = room;
+		r = inflate(&l->zin, Z_SYNC_FLUSH);
+
+		BUMP(w->zip_ns[1], cpu_ns() - t);
+
+		/* the sender never puts more than fits in a block */
+		if ((r != Z_OK && r != Z_BUF_ERROR) || l->zin.avail_in != 0)
+			return -1;
+
+		l->in_len += room - l->zin.avail_out;
+		BUMP(w->zip_raw[1], room - l->zin.avail_out);
+	} else {
+		return -1;
+	}
+
+	BUMP(w->zip_wire[1], BLOCK_HDR + len);
+
+	return 0;
+}
+
+/* sends len - off bytes of buf, returns -1 if the link broke */
+int link_send(struct Link * l, uint8_t * buf, size_t * off, size_t * len)
+{
+	ssize_t b;
+
+	if (*off == *len)
+		return 0;
+
+	b = send(l->fd, buf + *off, *len - *off, MSG_NOSIGNAL);
+
+	if (b < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return 0;
+
+		perror("send to link");
+		return -1;
+	}
+
+	*off += b;
+	if (*off == *len)
+		*off = *len = 0;
+
+	return 0;
+}
+
+/* sends what l has queued up, returns -1 if the link broke */
+int link_flush(struct Worker * w, struct Link * l)
+{
+	if (l->fd == -1)
+		return 0;
+
+	if (!tunnel_zip)
+		return link_send(l, l->out, &l->out_off, &l->out_len);
+
+	/* pack only once the last blocks are gone: frames that pile up
+	 * while the link is busy make for bigger blocks that compress
+	 * better, and nothing waits when it isn't */
+	if (l->wire_off == l->wire_len)
+		link_pack(w, l);
+
+	return link_send(l, l->wire, &l->wire_off, &l->wire_len);
+}
+
+/* l has something to send */
+int link_pending(struct Link * l)
+{
+	return l->out_off < l->out_len || l->wire_off < l->wire_len;
+}
+
+/* Gets a new stream going on the entry side for client connection c */
+void stream_open(struct Worker * w, struct Conn * c)
+{
+	struct Link * l = w->links[0];
+
+	/* the least busy link, a dialing one is fine too: the frames wait
+	 * for it */
+	for (int i = 1; i < w->nlinks; i++) {
+		if (w->links[i]->nstreams < l->nstreams)
+			l = w->links[i];
+	}
+
+	link_add(l, c, l->next_sid++);
+	link_frame(l, FRAME_OPEN, c->sid, 0);
+
+	c->tside = 1;
+	c->credit = STREAM_WINDOW;
+	c->state = CONN_RELAY;
+	c->t_connect = c->t_accept;
+	hist_add(&w->stats.connect, 0); /* the link is up already, or not */
+}
+
+/* Writes what the link gave us to the socket of c. Returns -1 if the
+ * socket is broken */
+int stream_flush(struct Worker * w, struct Conn * c, int64_t now)
+{
+	int s = 1 - c->tside;
+	struct Chunk * k;
+	ssize_t b;
+
+	(void)now;
+
+	if (c->fd[s] == -1)
+		return 0; /* exit side, still connecting */
+
+	while ((k = c->q) != NULL) {
+		b = send(c->fd[s], k->data + k->off, k->len - k->off, MSG_NOSIGNAL);
+
+		if (b < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+				break;
+
+			perror("send");
+			return -1;
+		}
+
+		k->off += b;
+		c->q_len -= b;
+		c->unacked += b;
+
+		if (k->off < k->len)
+			break;
+
+		c->q = k->next;
+		if (c->q == NULL)
+			c->q_tail = NULL;
+		buf_put(w, (uint8_t *)k);
+	}
+
+	/* hand back credit in bits big enough to not drown the link in
+	 * window frames, small enough that the other end keeps going */
+	if (c->link != NULL && c->unacked >= STREAM_WINDOW / 4) {
+		link_frame(c->link, FRAME_WINDOW, c->sid, c->unacked);
+		c->unacked = 0;
+	}
+
+	if (c->q == NULL && c->eof[c->tside] && !c->shut) {
+		shutdown(c->fd[s], SHUT_WR);
+		c->shut = 1;
+	}
+
+	return 0;
+}
+
+/* queues len bytes that came in over the link for the socket of c */
+void stream_queue(struct Worker * w, struct Conn * c, const uint8_t * p,
+	size_t len)
+{
+	struct Chunk * k = c->q_tail;
+	size_t n;
+
+	c->q_len += len;
+
+	while (len > 0) {
+		if (k == NULL || k->len == CHUNK_LEN) {
+			k = (struct Chunk *)buf_get(w);
+			k->next = NULL;
+			k->len = k->off = 0;
+
+			if (c->q_tail != NULL)
+				c->q_tail->next = k;
+			else
+				c->q = k;
+			c->q_tail = k;
+		}
+
+		n = CHUNK_LEN - k->len < len ? CHUNK_LEN - k->len : len;
+		memcpy(k->data + k->len, p, n);
+		k->len += n;
+		p += n;
+		len -= n;
+	}
+}
+
+/* both directions are done and delivered */
+int stream_done(struct Conn * c)
+{
+	return c->eof[0] && c->eof[1] && c->q == NULL && c->shut;
+}
+
+/* Moves bytes for stream c: from its socket into frames on the link,
+ * and from its queue into the socket. events are what we polled the
+ * socket for. Returns -1 if c is done */
+int stream_relay(struct Worker * w, struct Conn * c, short events,
+	short revents, int64_t now)
+{
+	int s = 1 - c->tside;
+	struct Link * l = c->link;
+	uint8_t * p;
+	ssize_t b;
+	size_t want;
+
+	shape_resume(w, c, s, now);
+
+	/* events, not just revents: POLLHUP shows up uninvited, and we
+	 * only want to read when the link had room */
+	if ((events & POLLIN) && (revents & (POLLIN | POLLHUP | POLLERR)) &&
+			c->resume_at[s] == 0) {
+		want = shape_allow(c, s, now);
+		if (want == 0) {
+			c->paused_at[s] = now;
+		} else {
+			if ((int64_t)want > c->credit)
+				want = c->credit;
+
+			/* straight into the link buffer, behind room for the header */
+			p = link_reserve(l, FRAME_HDR + want);
+			b = recv(c->fd[s], p + FRAME_HDR, want, 0);
+
+			if (b < 0 && errno != EAGAIN && errno != EWOULDBLOCK &&
+					errno != EINTR) {
+				perror("recv");
+				return -1;
+			}
+
+			if (b == 0) {
+				c->eof[s] = 1;
+				link_frame(l, FRAME_FIN, c->sid, 0);
+			}
+
+			if (b > 0) {
+				put_frame_hdr(p, FRAME_DATA, c->sid, b);
+				l->out_len += FRAME_HDR + b;
+				c->credit -= b;
+				shape_charge(c, s, b);
+
+				c->bytes[s] += b;
+				c->chunks[s]++;
+				BUMP(w->stats.bytes[s], b);
+				BUMP(w->stats.chunks[s], 1);
+				hist_add(&w->stats.chunk[s], b);
+
+				if (s == 1 && c->t_first == 0) {
+					c->t_first = now_us();
+					hist_add(&w->stats.ttfb, c->t_first - c->t_accept);
+				}
+			}
+		}
+	}
+
+	if (c->q != NULL && stream_flush(w, c, now) == -1)
+		return -1;
+
+	return stream_done(c) ? -1 : 0;
+}
+
+/* Adds the socket of stream c to fds */
+int stream_pollfds(struct Conn * c, struct pollfd * fds, int nfds,
+	int64_t * wake)
+{
+	int s = 1 - c->tside;
+
+	fds[nfds].fd = c->fd[s];
+	fds[nfds].events = 0;
+
+	if (!c->eof[s] && c->resume_at[s] == 0 && c->credit > 0 &&
+			c->link != NULL && link_room(c->link))
+		fds[nfds].events |= POLLIN;
+	if (c->q != NULL)
+		fds[nfds].events |= POLLOUT;
+
+	if (c->resume_at[s] != 0 && (*wake == -1 || c->resume_at[s] < *wake))
+		*wake = c->resume_at[s];
+
+	if (stream_done(c))
+		*wake = 0;
+
+	return nfds + 1;
+}
+
+/* adds c to the connections of w */
+void conn_add(struct Worker * w, struct Conn * c)
+{
+	if (w->nconns >= w->conns_len) {
+		/* if realloc fails all hope is lost anyways */
+		w->conns_len *= 2;
+		w->conns = realloc(w->conns, w->conns_len * sizeof(struct Conn *));
+	}
+
+	w->conns[w->nconns++] = c;
+}
+
+/* Handles a frame that came in over l. Returns -1 if the other end
+ * doesn't speak our language */
+int link_input(struct Worker * w, struct Link * l, const uint8_t * f,
+	int64_t now)
+{
+	size_t len = f[2] << 8 | f[3];
+	uint32_t sid = get32(f + 4);
+	struct Conn * c = link_find(l, sid);
+
+	/* frames for a stream we're done with are normal, there may have
+	 * been some in flight */
+	switch (f[0]) {
+		case FRAME_OPEN:
+			if (!tunnel_exit || c != NULL)
+				return -1;
+
+			c = conn_new(-1);
+			c->tside = 0;
+			c->credit = STREAM_WINDOW;
+			c->t_accept = now_us();
+			link_add(l, c, sid);
+			BUMP(w->stats.conns, 1);
+
+			if (conn_resolve(c, now) == -1)
+				c->dead = 1;
+
+			conn_add(w, c);
+			break;
+
+		case FRAME_DATA:
+			if (c == NULL)
+				break;
+
+			if (c->eof[c->tside] || c->q_len + len > STREAM_WINDOW) {
+				fprintf(stderr, "Stream %u ignores its window\n", sid);
+				c->dead = 1;
+				break;
+			}
+
+			stream_queue(w, c, f + FRAME_HDR, len);
+
+			c->bytes[c->tside] += len;
+			c->chunks[c->tside]++;
+			BUMP(w->stats.bytes[c->tside], len);
+			BUMP(w->stats.chunks[c->tside], 1);
+			hist_add(&w->stats.chunk[c->tside], len);
+
+			if (c->tside == 1 && c->t_first == 0) {
+				c->t_first = now_us();
+				hist_add(&w->stats.ttfb, c->t_first - c->t_accept);
+			}
+
+			if (stream_flush(w, c, now) == -1)
+				c->dead = 1;
+			break;
+
+		case FRAME_WINDOW:
+			if (c != NULL && len == 4)
+				c->credit += get32(f + FRAME_HDR);
+			break;
+
+		case FRAME_FIN:
+			if (c == NULL)
+				break;
+
+			c->eof[c->tside] = 1;
+			if (stream_flush(w, c, now) == -1)
+				c->dead = 1;
+			break;
+
+		case FRAME_RST:
+			if (c != NULL)
+				c->dead = 1;
+			break;
+
+		default:
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Handles the whole frames in l->in. Returns -1 if the link should be
+ * dropped */
+int link_parse(struct Worker * w, struct Link * l, int64_t now)
+{
+	size_t off = 0, len;
+
+	while (l->in_len - off >= FRAME_HDR) {
+		len = l->in[off + 2] << 8 | l->in[off + 3];
+
+		if (len > BUF_LEN) {
+			fprintf(stderr, "Frame too big, dropping link\n");
+			return -1;
+		}
+
+		if (l->in_len - off < FRAME_HDR + len)
+			break; /* the rest is on its way */
+
+		if (link_input(w, l, l->in + off, now) == -1) {
+			fprintf(stderr, "Bad frame, dropping link\n");
+			return -1;
+		}
+
+		off += FRAME_HDR + len;
+	}
+
+	memmove(l->in, l->in + off, l->in_len - off);
+	l->in_len -= off;
+
+	return 0;
+}
+
+/* Reads frames from l, or blocks of them with -z. Returns -1 if the
+ * link broke */
+int link_read(struct Worker * w, struct Link * l, int64_t now)
+{
+	uint8_t * buf;
+	size_t * len, cap, off = 0, n;
+	ssize_t b;
+
+	if (l->in == NULL)
+		l->in = malloc(LINK_IN_LEN);
+	if (tunnel_zip && l->win == NULL)
+		l->win = malloc(2 * (BLOCK_HDR + BLOCK_MAX));
+
+	if (tunnel_zip) {
+		buf = l->win;
+		len = &l->win_len;
+		cap = 2 * (BLOCK_HDR + BLOCK_MAX);
+	} else {
+		buf = l->in;
+		len = &l->in_len;
+		cap = LINK_IN_LEN;
+	}
+
+	b = recv(l->fd, buf + *len, cap - *len, 0);
+
+	if (b < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return 0;
+
+		perror("recv from link");
+		return -1;
+	}
+
+	if (b == 0)
+		return -1;
+
+	*len += b;
+
+	if (!tunnel_zip)
+		return link_parse(w, l, now);
+
+	/* a block at a time, parsing leaves at most part of a frame behind
+	 * so there is always room for the next one */
+	while (l->win_len - off >= BLOCK_HDR) {
+		n = l->win[off + 2] << 8 | l->win[off + 3];
+
+		if (n > BLOCK_MAX) {
+			fprintf(stderr, "Block too big, is the other end using -z?\n");
+			return -1;
+		}
+
+		if (l->win_len - off < BLOCK_HDR + n)
+			break;
+
+		if (link_unpack(w, l, l->win + off) == -1) {
+			fprintf(stderr, "Bad block, dropping link\n");
+			return -1;
+		}
+
+		off += BLOCK_HDR + n;
+
+		if (link_parse(w, l, now) == -1)
+			return -1;
+	}
+
+	memmove(l->win, l->win + off, l->win_len - off);
+	l->win_len -= off;
+
+	return 0;
+}
+
+/* a link came up, TCP_NODELAY because we do our own batching.
+ * Returns -1, and leaves fd to the caller, if zlib has no memory for
+ * it */
+int link_up(struct Worker * w, struct Link * l, int fd)
+{
+	const int yes = 1;
+
+	/* a new connection is a new deflate stream */
+	if (tunnel_zip && !l->zinit) {
+		if (deflateInit(&l->zout, tunnel_zip) != Z_OK) {
+			fprintf(stderr, "deflateInit: %s\n", l->zout.msg ?
+				l->zout.msg : "failed");
+			return -1;
+		}
+		if (inflateInit(&l->zin) != Z_OK) {
+			fprintf(stderr, "inflateInit: %s\n", l->zin.msg ?
+				l->zin.msg : "failed");
+			deflateEnd(&l->zout);
+			return -1;
+		}
+		l->zinit = 1;
+	} else if (tunnel_zip) {
+		deflateReset(&l->zout);
+		inflateReset(&l->zin);
+	}
+
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+	l->fd = fd;
+	BUMP(w->links_up, 1);
+
+	return 0;
+}
+
+void link_free(struct Link * l)
+{
+	if (l->zinit) {
+		deflateEnd(&l->zout);
+		inflateEnd(&l->zin);
+	}
+
+	free(l->in);
+	free(l->out);
+	free(l->win);
+	free(l->wire);
+	free(l);
+}
+
+void conn_free(struct Worker * w, struct Conn * c)
+{
+	struct Chunk * k;
+
+	cap_put(w, c, CAP_CLOSE, 0, NULL, 0);
+
+	/* spares don't count until they have a client */
+	if (c->t_accept != 0)
+		BUMP(w->stats.closed, 1);
+
+	if (!quiet && c->t_accept != 0 && c->t_connect != 0) {
+		printf("Connection done: up %llu bytes in %llu chunks, down %llu bytes in %llu chunks, "
+			"connect %lld us, first byte %lld us, write blocked %lld/%lld us, throttled %lld/%lld ms\n",
+			(unsigned long long)c->bytes[0], (unsigned long long)c->chunks[0],
+			(unsigned long long)c->bytes[1], (unsigned long long)c->chunks[1],
+			(long long)(c->t_connect - c->t_accept),
+			(long long)(c->t_first ? c->t_first - c->t_accept : -1),
+			(long long)c->blocked_us[0], (long long)c->blocked_us[1],
+			(long long)c->throttled_ms[0], (long long)c->throttled_ms[1]);
+	}
+
+	shape_detach(c);
+
+	if (c->link != NULL) {
+		/* tell the other end, unless it all ended well */
+		if (!stream_done(c))
+			link_frame(c->link, FRAME_RST, c->sid, 0);
+		link_remove(c->link, c);
+	}
+
+	while ((k = c->q) != NULL) {
+		c->q = k->next;
+		buf_put(w, (uint8_t *)k);
+	}
+
+	for (int i = 0; i < c->naddrs; i++) {
+		if (c->attempt_fd[i] != -1)
+			close(c->attempt_fd[i]);
+	}
+
+	for (int i = 0; i < 2; i++) {
+		if (c->fd[i] != -1)
+			close(c->fd[i]);
+		if (c->buf[i] != NULL)
+			buf_put(w, c->buf[i]);
+	}
+
+	free(c);
+}
+
+/* Adds the sockets c is waiting on to fds, starting at nfds, and moves
+ * wake forward to c's earliest timer. Returns the new nfds */
+int conn_pollfds(struct Conn * c, struct pollfd * fds, int nfds,
+	int64_t * wake)
+{
+	c->pfd = nfds;
+
+	if (c->dead)
+		*wake = 0; /* nothing left to wait for, get it freed */
+
+	switch (c->state) {
+		case CONN_RESOLVING:
+			break; /* nothing to poll for */
+
+		case CONN_CONNECTING:
+			if (c->next_addr < c->naddrs && !tfo_in_flight(c) &&
+					(*wake == -1 || c->next_attempt < *wake))
+				*wake = c->next_attempt;
+
+			for (int a = 0; a < c->naddrs; a++) {
+				if (c->attempt_fd[a] == -1) continue;
+
+				fds[nfds].fd = c->attempt_fd[a];
+				fds[nfds].events = POLLOUT;
+				nfds++;
+
+				if (*wake == -1 || c->attempt_deadline[a] < *wake)
+					*wake = c->attempt_deadline[a];
+			}
+			break;
+
+		case CONN_SPARE:
+			/* only interested in the target hanging up on us */
+			fds[nfds].fd = c->fd[1];
+			fds[nfds].events = POLLRDHUP;
+			nfds++;
+			break;
+
+		case CONN_RELAY:
+			if (c->tside != -1)
+				return stream_pollfds(c, fds, nfds, wake);
+
+			/* read from a side only if its buffer is empty, and wait
+			 * for room on the other side if it isn't */
+			for (int s = 0; s < 2; s++) {
+				fds[nfds].fd = c->fd[s];
+				fds[nfds].events = 0;
+
+				if (c->len[s] == 0 && !c->eof[s] && c->resume_at[s] == 0)
+					fds[nfds].events |= POLLIN;
+				if (c->len[(s + 1) % 2] > 0)
+					fds[nfds].events |= POLLOUT;
+
+				/* out of tokens, wake up when there are more */
+				if (c->resume_at[s] != 0 &&
+						(*wake == -1 || c->resume_at[s] < *wake))
+					*wake = c->resume_at[s];
+
+				nfds++;
+			}
+			break;
+	}
+
+	return nfds;
+}
+
+/* Handles whatever poll() had to say about c. resolved is set if the
+ * resolver thread has news. Returns -1 if c should be freed */
+int conn_process(struct Worker * w, struct Conn * c, struct pollfd * fds,
+	int64_t now, int resolved)
+{
+	struct pollfd * f = &fds[c->pfd];
+	int r = 0;
+
+	if (c->dead)
+		return -1;
+
+	switch (c->state) {
+		case CONN_RESOLVING:
+			if (resolved)
+				r = conn_resolve(c, now);
+			break;
+
+		case CONN_CONNECTING:
+			r = poll_attempts(w, c, fds, now);
+
+			if (r < 0)
+				fprintf(stderr, "All attempts to connect to target host have failed\n");
+			break;
+
+		case CONN_SPARE:
+			/* the target got tired of waiting */
+			if (f[0].revents)
+				r = -1;
+			break;
+
+		case CONN_RELAY:
+			if (c->tside != -1) {
+				r = stream_relay(w, c, f[0].events, f[0].revents, now);
+				break;
+			}
+
+			r = relay(w, c, 0, f[0].revents, f[1].revents, now);
+			if (r == 0)
+				r = relay(w, c, 1, f[1].revents, f[0].revents, now);
+
+			/* both sides said bye and everything is delivered */
+			if (c->eof[0] && c->eof[1] &&
+					c->len[0] == 0 && c->len[1] == 0) {
+				if (!quiet)
+					puts("Both sides closed, bye");
+				r = -1;
+			}
+			break;
+	}
+
+	return r;
+}
+
+/* Adds the links of w, or their connection attempts, to fds */
+int links_pollfds(struct Worker * w, struct pollfd * fds, int nfds,
+	int64_t now, int64_t * wake)
+{
+	struct Link * l;
+
+	for (int i = 0; i < w->nlinks; i++) {
+		l = w->links[i];
+
+		if (l->fd != -1) {
+			l->pfd = nfds;
+			fds[nfds].fd = l->fd;
+			fds[nfds].events = POLLIN;
+			if (link_pending(l))
+				fds[nfds].events |= POLLOUT;
+			nfds++;
+			continue;
+		}
+
+		/* entry side, dial the exit */
+		if (l->dial == NULL && now >= l->retry_at) {
+			l->dial = conn_new(-1);
+
+			if (conn_resolve(l->dial, now) == -1) {
+				conn_free(w, l->dial);
+				l->dial = NULL;
+				link_down(w, l, now);
+			}
+		}
+
+		if (l->dial != NULL)
+			nfds = conn_pollfds(l->dial, fds, nfds, wake);
+		else if (*wake == -1 || l->retry_at < *wake)
+			*wake = l->retry_at;
+	}
+
+	return nfds;
+}
+
+/* Handles whatever poll() had to say about the links of w */
+void links_process(struct Worker * w, struct pollfd * fds, int64_t now,
+	int resolved)
+{
+	struct Link * l;
+	short revents;
+
+	for (int i = 0; i < w->nlinks; i++) {
+		l = w->links[i];
+
+		if (l->dial != NULL) {
+			if (conn_process(w, l->dial, fds, now, resolved) < 0) {
+				conn_free(w, l->dial);
+				l->dial = NULL;
+				link_down(w, l, now); /* takes the waiting streams along */
+			} else if (l->dial->state == CONN_SPARE) {
+				if (link_up(w, l, l->dial->fd[1]) == 0)
+					l->dial->fd[1] = -1;
+				conn_free(w, l->dial);
+				l->dial = NULL;
+				if (l->fd == -1)
+					link_down(w, l, now); /* try again later */
+			}
+			continue;
+		}
+
+		if (l->fd == -1)
+			continue;
+
+		revents = fds[l->pfd].revents;
+
+		if (((revents & (POLLIN | POLLHUP | POLLERR)) &&
+				link_read(w, l, now) == -1) ||
+				((revents & POLLOUT) && link_flush(w, l) == -1)) {
+			link_down(w, l, now);
+
+			if (tunnel_exit) {
+				/* the entry will dial a new one */
+				link_free(l);
+				w->links[i--] = w->links[--w->nlinks];
+			}
+		}
+	}
+}
+
+/* tries to get the output of every link out, after a round of streams
+ * had their say */
+void links_flush(struct Worker * w, int64_t now)
+{
+	struct Link * l;
+
+	for (int i = 0; i < w->nlinks; i++) {
+		l = w->links[i];
+
+		if (link_flush(w, l) == -1) {
+			link_down(w, l, now);
+
+			if (tunnel_exit) {
+				link_free(l);
+				w->links[i--] = w->links[--w->nlinks];
+			}
+		}
+	}
+}
+
+/* exit side: takes the links the entry dialed */
+void accept_links(struct Worker * w)
+{
+	struct Link * l;
+	int nsock;
+
+	while ((nsock = accept4(w->lsock, NULL, NULL, SOCK_NONBLOCK)) != -1) {
+		if (w->nlinks >= w->links_len) {
+			w->links_len = w->links_len ? w->links_len * 2 : MAX_LINKS;
+			w->links = realloc(w->links,
+				w->links_len * sizeof(struct Link *));
+		}
+
+		l = calloc(1, sizeof(struct Link));
+		if (link_up(w, l, nsock) == -1) {
+			close(nsock);
+			free(l);
+			continue;
+		}
+		w->links[w->nlinks++] = l;
+	}
+
+	if (errno != EAGAIN && errno != EWOULDBLOCK)
+		perror("accept");
+}
+
+/* tops up the upstream pool of w */
+void fill_spares(struct Worker * w, int64_t now)
+{
+	struct Conn * c;
+
+	/* don't hammer a target that is down */
+	if (now < w->spare_retry)
+		return;
+
+	while (w->nspares < n_spares) {
+		c = conn_new(-1);
+
+		if (conn_resolve(c, now) == -1) {
+			conn_free(w, c);
+			w->spare_retry = now + SPARE_RETRY;
+			return;
+		}
+
+		w->spares[w->nspares++] = c;
+	}
+}
+
+/* Hands an established spare target connection to client cfd. Returns
+ * NULL if the pool has none ready */
+struct Conn * take_spare(struct Worker * w, int cfd)
+{
+	struct Conn * c;
+
+	for (int i = 0; i < w->nspares; i++) {
+		c = w->spares[i];
+
+		if (c->state != CONN_SPARE) continue;
+
+		w->spares[i] = w->spares[--w->nspares];
+
+		c->fd[0] = cfd;
+		c->state = CONN_RELAY;
+		c->t_accept = c->t_connect = now_us();
+		hist_add(&w->stats.connect, 0); /* that's the point of spares */
+
+		print_conn(c);
+		cap_open(w, c);
+
+		return c;
+	}
+
+	return NULL;
+}
+
+/* takes every client that is waiting on the listening socket */
+void accept_clients(struct Worker * w, int64_t now)
+{
+	struct Conn * c;
+	struct sockaddr_storage cli;
+	socklen_t cli_len;
+	int nsock;
+
+	while (1) {
+		cli_len = sizeof(cli);
+		nsock = accept4(w->lsock, (struct sockaddr *)&cli, &cli_len,
+			SOCK_NONBLOCK);
+
+		if (nsock == -1) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				perror("accept");
+			break;
+		}
+
+		BUMP(w->stats.conns, 1);
+
+		if (tfo_queue > 0) {
+			struct tcp_info ti;
+			socklen_t ti_len = sizeof(ti);
+
+			if (getsockopt(nsock, IPPROTO_TCP, TCP_INFO, &ti, &ti_len) == 0 &&
+					(ti.tcpi_options & TCPI_OPT_SYN_DATA))
+				BUMP(w->tfo_in, 1);
+		}
+
+		if (tunnel_links > 0) {
+			/* no target connection, a stream on one of our links */
+			c = conn_new(nsock);
+			c->t_accept = now_us();
+			stream_open(w, c);
+
+			shape_attach(c, &cli);
+			conn_add(w, c);
+			continue;
+		}
+
+		c = take_spare(w, nsock);
+
+		if (c == NULL) {
+			c = conn_new(nsock);
+			c->t_accept = now_us();
+
+			if (conn_resolve(c, now) == -1) {
+				conn_free(w, c);
+				continue;
+			}
+		}
+
+		shape_attach(c, &cli);
+		conn_add(w, c);
+	}
+}
+
+/* pins the calling worker thread to its CPU, if it has one */
+void pin_worker(struct Worker * w)
+{
+	cpu_set_t set;
+	int r;
+
+	if (w->cpu == -1)
+		return;
+
+	CPU_ZERO(&set);
+	CPU_SET(w->cpu, &set);
+
+	r = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if (r != 0)
+		fprintf(stderr, "worker %d: can't pin to cpu %d: %s\n",
+			w->id, w->cpu, strerror(r));
+}
+
+/* hashes the address of a UDP client, FNV-1a */
+uint32_t sa_hash(const struct sockaddr_storage * sa)
+{
+	const uint8_t * p;
+	size_t len;
+	uint32_t h = 2166136261u;
+
+	if (sa->ss_family == AF_INET) {
+		/* port and address are next to each other */
+		p = (const uint8_t *)&((struct sockaddr_in *)sa)->sin_port;
+		len = sizeof(in_port_t) + sizeof(struct in_addr);
+	} else {
+		const struct sockaddr_in6 * a = (struct sockaddr_in6 *)sa;
+
+		h = (h ^ (a->sin6_port & 0xff)) * 16777619u;
+		h = (h ^ (a->sin6_port >> 8)) * 16777619u;
+
+		p = a->sin6_addr.s6_addr;
+		len = sizeof(struct in6_addr);
+	}
+
+	while (len--)
+		h = (h ^ *p++) * 16777619u;
+
+	return h;
+}
+
+/* 1 if a and b are the same UDP client */
+int sa_equal(const struct sockaddr_storage * a, const struct sockaddr_storage * b)
+{
+	if (a->ss_family != b->ss_family)
+		return 0;
+
+	if (a->ss_family == AF_INET) {
+		const struct sockaddr_in * x = (struct sockaddr_in *)a;
+		const struct sockaddr_in * y = (struct sockaddr_in *)b;
+
+		return x->sin_port == y->sin_port &&
+			x->sin_addr.s_addr == y->sin_addr.s_addr;
+	}
+
+	const struct sockaddr_in6 * x = (struct sockaddr_in6 *)a;
+	const struct sockaddr_in6 * y = (struct sockaddr_in6 *)b;
+
+	return x->sin6_port == y->sin6_port &&
+		memcmp(&x->sin6_addr, &y->sin6_addr, sizeof(x->sin6_addr)) == 0;
+}
+
+/* puts s in the timer wheel slot of second tick */
+void wheel_add(struct Worker * w, struct Session * s, int64_t tick)
+{
+	int slot;
+
+	/* the slot of a tick gone by would only come round a lap later */
+	if (tick < w->wheel_tick)
+		tick = w->wheel_tick;
+	slot = tick % WHEEL_LEN;
+
+	s->wnext = w->wheel[slot];
+	w->wheel[slot] = s;
+}
+
+/* Finds the session of a client, making one if it is new. Returns NULL
+ * if the table is full or the target can't be reached right now */
+struct Session * session_get(struct Worker * w,
+	const struct sockaddr_storage * cli, socklen_t cli_len, int64_t now)
+{
+	struct sockaddr_storage addrs[MAX_ADDRS];
+	socklen_t addrlens[MAX_ADDRS];
+	int naddrs;
+	uint32_t h = sa_hash(cli) & w->table_mask;
+	struct Session * s;
+	struct epoll_event ev;
+
+	for (s = w->table[h]; s != NULL; s = s->hnext) {
+		if (sa_equal(&s->cli, cli)) {
+			s->last_active = now;
+			return s;
+		}
+	}
+
+	if (w->free_sessions == NULL) {
+		BUMP(w->udp_dropped, 1);
+		return NULL; /* the table is full, that's as big as we get */
+	}
+
+	/* UDP is lossy anyways, drop the datagram while DNS is looked up */
+	if (dns_lookup(&resolver, target_host, target_port,
+			addrs, addrlens, &naddrs, now) != 1)
+		return NULL;
+
+	s = w->free_sessions;
+
+	/* UDP has no handshake to race, just take the favorite address.
+	 * Failing here happens for every datagram of a new client once it
+	 * does, out of files say, so it is counted and not printed */
+	s->fd = socket(addrs[0].ss_family, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+	if (s->fd == -1) {
+		BUMP(w->udp_dropped, 1);
+		return NULL;
+	}
+
+	/* connect() so the kernel only gives us the target's datagrams */
+	if (connect(s->fd, (struct sockaddr *)&addrs[0], addrlens[0]) == -1) {
+		BUMP(w->udp_dropped, 1);
+		close(s->fd);
+		return NULL;
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = s;
+	if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, s->fd, &ev) == -1) {
+		BUMP(w->udp_dropped, 1);
+		close(s->fd);
+		return NULL;
+	}
+
+	w->free_sessions = s->hnext;
+
+	memcpy(&s->cli, cli, cli_len);
+	s->cli_len = cli_len;
+	s->last_active = now;
+
+	s->hnext = w->table[h];
+	w->table[h] = s;
+
+	wheel_add(w, s, (now + udp_idle) / 1000);
+	BUMP(w->nsessions, 1);
+
+	return s;
+}
+
+/* closes s and gives it back to the free list */
+void session_free(struct Worker * w, struct Session * s)
+{
+	struct Session ** pp = &w->table[sa_hash(&s->cli) & w->table_mask];
+
+	while (*pp != s)
+		pp = &(*pp)->hnext;
+	*pp = s->hnext;
+
+	close(s->fd); /* takes it out of epoll too */
+
+	s->hnext = w->free_sessions;
+	w->free_sessions = s;
+	BUMP(w->nsessions, -1);
+}
+
+/* Expires idle sessions, for every second that went by since the last
+ * time. Sessions that were active in the meantime are put back in the
+ * wheel instead of being moved on every datagram */
+void wheel_advance(struct Worker * w, int64_t now)
+{
+	int64_t tick = now / 1000, due;
+	struct Session * s, * next;
+
+	for (; w->wheel_tick <= tick; w->wheel_tick++) {
+		s = w->wheel[w->wheel_tick % WHEEL_LEN];
+		w->wheel[w->wheel_tick % WHEEL_LEN] = NULL;
+
+		for (; s != NULL; s = next) {
+			next = s->wnext;
+			due = (s->last_active + udp_idle) / 1000;
+
+			if (due <= w->wheel_tick) {
+				session_free(w, s);
+				continue;
+			}
+
+			/* timeouts longer than the wheel take another lap */
+			if (due >= w->wheel_tick + WHEEL_LEN)
+				due = w->wheel_tick + WHEEL_LEN - 1;
+
+			wheel_add(w, s, due);
+		}
+	}
+}
+
+/* Reads datagrams from clients in batches and passes them on to the
+ * target, through the socket of the client's session */
+void udp_from_clients(struct Worker * w, int64_t now)
+{
+	struct UdpBatch * b = w->in;
+	struct Session * sess[UDP_BATCH];
+	int n, i, j, r;
+
+	do {
+		for (i = 0; i < UDP_BATCH; i++) {
+			b->iov[i].iov_base = b->bufs[i];
+			b->iov[i].iov_len = UDP_BUF_LEN;
+			b->msgs[i].msg_hdr.msg_name = &b->addrs[i];
+			b->msgs[i].msg_hdr.msg_namelen = sizeof(b->addrs[i]);
+			b->msgs[i].msg_hdr.msg_iov = &b->iov[i];
+			b->msgs[i].msg_hdr.msg_iovlen = 1;
+			b->msgs[i].msg_hdr.msg_control = NULL;
+			b->msgs[i].msg_hdr.msg_controllen = 0;
+			b->msgs[i].msg_hdr.msg_flags = 0;
+		}
+
+		n = recvmmsg(w->lsock, b->msgs, UDP_BATCH, MSG_DONTWAIT, NULL);
+		if (n <= 0) {
+			if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK &&
+					errno != EINTR)
+				perror("recvmmsg");
+			return;
+		}
+
+		BUMP(w->udp_in, n);
+
+		for (i = 0; i < n; i++) {
+			sess[i] = session_get(w, &b->addrs[i],
+				b->msgs[i].msg_hdr.msg_namelen, now);
+
+			/* the sockets are connected, no need for addresses */
+			b->iov[i].iov_len = b->msgs[i].msg_len;
+			b->msgs[i].msg_hdr.msg_name = NULL;
+			b->msgs[i].msg_hdr.msg_namelen = 0;
+		}
+
+		/* send the datagrams of a client that are next to each other
+		 * in one go, a busy client usually has a couple of them */
+		for (i = 0; i < n; i = j) {
+			for (j = i + 1; j < n && sess[j] == sess[i]; j++);
+
+			if (sess[i] == NULL) continue;
+
+			r = sendmmsg(sess[i]->fd, &b->msgs[i], j - i, MSG_DONTWAIT);
+			if (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+				perror("sendmmsg");
+		}
+	} while (n == UDP_BATCH);
+}
+
+/* sends the replies that piled up in w->out to their clients */
+void udp_flush(struct Worker * w)
+{
+	struct UdpBatch * b = w->out;
+	int r, done = 0;
+
+	while (done < b->n) {
+		r = sendmmsg(w->lsock, &b->msgs[done], b->n - done, MSG_DONTWAIT);
+
+		if (r <= 0) {
+			/* socket buffer full, the rest is lost like UDP does */
+			if (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+				perror("sendmmsg");
+			break;
+		}
+
+		done += r;
+	}
+
+	BUMP(w->udp_out, done);
+	b->n = 0;
+}
+
+/* Reads the target's replies for s, and queues them up in w->out to
+ * be sent to the client together with the replies of other sessions */
+void udp_from_target(struct Worker * w, struct Session * s, int64_t now)
+{
+	struct UdpBatch * b = w->out;
+	int n, i;
+
+	do {
+		if (b->n == UDP_BATCH)
+			udp_flush(w);
+
+		for (i = b->n; i < UDP_BATCH; i++) {
+			b->iov[i].iov_base = b->bufs[i];
+			b->iov[i].iov_len = UDP_BUF_LEN;
+			b->msgs[i].msg_hdr.msg_name = NULL;
+			b->msgs[i].msg_hdr.msg_namelen = 0;
+			b->msgs[i].msg_hdr.msg_iov = &b->iov[i];
+			b->msgs[i].msg_hdr.msg_iovlen = 1;
+			b->msgs[i].msg_hdr.msg_control = NULL;
+			b->msgs[i].msg_hdr.msg_controllen = 0;
+			b->msgs[i].msg_hdr.msg_flags = 0;
+		}
+
+		n = recvmmsg(s->fd, &b->msgs[b->n], UDP_BATCH - b->n,
+			MSG_DONTWAIT, NULL);
+		if (n <= 0) {
+			if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK &&
+					errno != EINTR)
+				perror("recvmmsg"); /* ICMP unreachable and such */
+			return;
+		}
+
+		s->last_active = now;
+
+		for (i = b->n; i < b->n + n; i++) {
+			b->iov[i].iov_len = b->msgs[i].msg_len;
+			b->msgs[i].msg_hdr.msg_name = &s->cli;
+			b->msgs[i].msg_hdr.msg_namelen = s->cli_len;
+		}
+
+		b->n += n;
+	} while (b->n == UDP_BATCH);
+}
+
+struct UdpBatch * udp_batch_new(void)
+{
+	struct UdpBatch * b = malloc(sizeof(struct UdpBatch));
+
+	b->n = 0;
+	for (int i = 0; i < UDP_BATCH; i++)
+		b->bufs[i] = malloc(UDP_BUF_LEN);
+
+	return b;
+}
+
+void udp_batch_free(struct UdpBatch * b)
+{
+	for (int i = 0; i < UDP_BATCH; i++)
+		free(b->bufs[i]);
+	free(b);
+}
+
+/* The event loop of a worker in UDP mode. Sessions can get numerous,
+ * so this one uses epoll instead of rebuilding a pollfd list */
+void * udp_worker_run(void * arg)
+{
+	struct Worker * w = arg;
+	struct epoll_event evs[UDP_BATCH], ev;
+	struct Session * s;
+	uint32_t table_len = 1;
+	int64_t now;
+	int i, n, timeout;
+
+	pin_worker(w);
+
+	/* everything is allocated up front, so memory stays bounded no
+	 * matter how many clients show up */
+	while (table_len < (uint32_t)udp_max_sessions * 2)
+		table_len *= 2;
+
+	w->table = calloc(table_len, sizeof(struct Session *));
+	w->table_mask = table_len - 1;
+
+	w->sessions = malloc(udp_max_sessions * sizeof(struct Session));
+	for (i = 0; i < udp_max_sessions; i++)
+		w->sessions[i].hnext = i + 1 < udp_max_sessions ?
+			&w->sessions[i + 1] : NULL;
+	w->free_sessions = &w->sessions[0];
+
+	w->in = udp_batch_new();
+	w->out = udp_batch_new();
+	w->wheel_tick = now_ms() / 1000;
+
+	w->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (w->epfd == -1) {
+		perror("epoll_create1");
+		return NULL;
+	}
+
+	/* the listening socket and resolver pipe are told apart from the
+	 * sessions by their pointer */
+	ev.events = EPOLLIN;
+	ev.data.ptr = &w->lsock;
+	epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->lsock, &ev);
+
+	ev.data.ptr = &w->notify;
+	epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->notify, &ev);
+
+	while (1)
+	{
+		/* wake up for the next tick of the wheel if there is a
+		 * session to expire */
+		now = now_ms();
+		timeout = w->nsessions > 0 ? (int)(1000 - now % 1000) : -1;
+
+		n = epoll_wait(w->epfd, evs, UDP_BATCH, timeout);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+
+			perror("epoll_wait");
+			break;
+		}
+
+		now = now_ms();
+
+		for (i = 0; i < n; i++) {
+			if (evs[i].data.ptr == &w->lsock) {
+				udp_from_clients(w, now);
+			} else if (evs[i].data.ptr == &w->notify) {
+				char drain[64];
+
+				while (read(w->notify, drain, sizeof(drain)) > 0);
+			} else {
+				udp_from_target(w, evs[i].data.ptr, now);
+			}
+		}
+
+		udp_flush(w);
+		wheel_advance(w, now);
+	}
+
+	for (i = 0; i <= (int)w->table_mask; i++) {
+		for (s = w->table[i]; s != NULL; s = s->hnext)
+			close(s->fd);
+	}
+
+	close(w->epfd);
+	udp_batch_free(w->in);
+	udp_batch_free(w->out);
+	free(w->sessions);
+	free(w->table);
+
+	return NULL;
+}
+
+/* The event loop of a worker, runs until poll() breaks */
+void * worker_run(void * arg)
+{
+	struct Worker * w = arg;
+	int i, r, nfds, timeout, resolved;
+	int64_t now, wake;
+
+	pin_worker(w);
+
+	w->conns_len = 16;
+	w->conns = malloc(w->conns_len * sizeof(struct Conn *));
+
+	if (tunnel_links > 0) {
+		w->nlinks = w->links_len = tunnel_links;
+		w->links = malloc(w->nlinks * sizeof(struct Link *));
+
+		for (i = 0; i < w->nlinks; i++) {
+			w->links[i] = calloc(1, sizeof(struct Link));
+			w->links[i]->fd = -1;
+		}
+	}
+
+	while (1)
+	{
+		now = now_ms();
+		fill_spares(w, now);
+
+		/* every connection or link needs at most MAX_ADDRS entries,
+		 * +2 for the listening socket and resolver */
+		i = (w->nconns + w->nspares + w->nlinks) * MAX_ADDRS + 2;
+		if (i > w->fds_len) {
+			w->fds_len = i * 2;
+			w->fds = realloc(w->fds, w->fds_len * sizeof(struct pollfd));
+		}
+
+		/* build the pollfd list, and find out when the earliest
+		 * happy eyeballs timer runs out */
+		wake = -1;
+
+		w->fds[0].fd = w->lsock;
+		w->fds[0].events = POLLIN;
+		w->fds[1].fd = w->notify;
+		w->fds[1].events = POLLIN;
+		nfds = 2;
+
+		for (i = 0; i < w->nconns; i++)
+			nfds = conn_pollfds(w->conns[i], w->fds, nfds, &wake);
+
+		for (i = 0; i < w->nspares; i++)
+			nfds = conn_pollfds(w->spares[i], w->fds, nfds, &wake);
+
+		nfds = links_pollfds(w, w->fds, nfds, now, &wake);
+
+		if (w->nspares < n_spares && (wake == -1 || w->spare_retry < wake))
+			wake = w->spare_retry;
+
+		timeout = -1;
+		if (wake != -1)
+			timeout = wake > now ? (int)(wake - now) : 0;
+
+		r = poll(w->fds, nfds, timeout);
+		if (r < 0)
+		{
+			/* EINTR is interrupt, non-fatal error, try again */
+			if (errno == EINTR)
+				continue;
+
+			perror("poll");
+			break;
+		}
+
+		now = now_ms();
+
+		resolved = 0;
+		if (w->fds[1].revents & POLLIN) {
+			/* the resolver thread has news, drain the pipe */
+			char drain[64];
+
+			while (read(w->notify, drain, sizeof(drain)) > 0);
+			resolved = 1;
+		}
+
+		for (i = 0; i < w->nconns; i++) {
+			if (conn_process(w, w->conns[i], w->fds, now, resolved) < 0) {
+				conn_free(w, w->conns[i]);
+
+				/* swap last element with the removed one */
+				w->conns[i--] = w->conns[--w->nconns];
+			}
+		}
+
+		for (i = 0; i < w->nspares; i++) {
+			if (conn_process(w, w->spares[i], w->fds, now, resolved) < 0) {
+				conn_free(w, w->spares[i]);
+				w->spares[i--] = w->spares[--w->nspares];
+				w->spare_retry = now + SPARE_RETRY;
+			}
+		}
+
+		/* after the streams, so new ones from the exit side don't get
+		 * processed before they were polled */
+		links_process(w, w->fds, now, resolved);
+
+		if ((w->fds[0].revents & POLLIN) && tunnel_exit)
+			accept_links(w);
+		else if (w->fds[0].revents & POLLIN)
+			accept_clients(w, now);
+
+		links_flush(w, now);
+	}
+
+	for (i = 0; i < w->nconns; i++)
+		conn_free(w, w->conns[i]);
+	for (i = 0; i < w->nspares; i++)
+		conn_free(w, w->spares[i]);
+	for (i = 0; i < w->nlinks; i++) {
+		link_down(w, w->links[i], now);
+		link_free(w->links[i]);
+	}
+
+	while (w->free_bufs != NULL)
+		free(buf_get(w));
+
+	free(w->conns);
+	free(w->fds);
+	free(w->links);
+
+	return NULL;
+}
+
+/* writes the numbers of all workers together to f */
+void stats_report(FILE * f)
+{
+	struct Stats * sum = calloc(1, sizeof(struct Stats));
+	uint64_t throttled = 0, udp_in = 0, udp_out = 0, udp_dropped = 0;
+	uint64_t cap_dropped = 0;
+	int64_t links_up = 0;
+	uint64_t zip_raw[2] = { 0 }, zip_wire[2] = { 0 };
+	uint64_t zip_bypass[2] = { 0 }, zip_ns[2] = { 0 };
+	uint64_t tfo_in = 0, tfo_hits = 0, tfo_fallbacks = 0;
+	int64_t sessions = 0;
+
+	for (int i = 0; i < nworkers; i++) {
+		struct Worker * w = &workers[i];
+
+		hist_merge(&sum->connect, &w->stats.connect);
+		hist_merge(&sum->ttfb, &w->stats.ttfb);
+		hist_merge(&sum->blocked, &w->stats.blocked);
+
+		for (int d = 0; d < 2; d++) {
+			hist_merge(&sum->chunk[d], &w->stats.chunk[d]);
+			sum->bytes[d] += LOAD(w->stats.bytes[d]);
+			sum->chunks[d] += LOAD(w->stats.chunks[d]);
+		}
+
+		sum->conns += LOAD(w->stats.conns);
+		sum->closed += LOAD(w->stats.closed);
+		throttled += LOAD(w->throttled_ms);
+		udp_in += LOAD(w->udp_in);
+		udp_out += LOAD(w->udp_out);
+		udp_dropped += LOAD(w->udp_dropped);
+		sessions += LOAD(w->nsessions);
+		if (w->ring != NULL)
+			cap_dropped += LOAD(w->ring->dropped);
+		links_up += LOAD(w->links_up);
+		tfo_in += LOAD(w->tfo_in);
+		tfo_hits += LOAD(w->tfo_hits);
+		tfo_fallbacks += LOAD(w->tfo_fallbacks);
+
+		for (int d = 0; d < 2; d++) {
+			zip_raw[d] += LOAD(w->zip_raw[d]);
+			zip_wire[d] += LOAD(w->zip_wire[d]);
+			zip_bypass[d] += LOAD(w->zip_bypass[d]);
+			zip_ns[d] += LOAD(w->zip_ns[d]);
+		}
+	}
+
+	if (udp_mode) {
+		fprintf(f, "udp sessions %lld, datagrams in %llu out %llu, dropped %llu\n",
+			(long long)sessions, (unsigned long long)udp_in,
+			(unsigned long long)udp_out, (unsigned long long)udp_dropped);
+	} else {
+		fprintf(f, "connections %llu, active %llu\n",
+			(unsigned long long)sum->conns,
+			(unsigned long long)(sum->conns - sum->closed));
+		fprintf(f, "up %llu bytes in %llu chunks, down %llu bytes in %llu chunks\n",
+			(unsigned long long)sum->bytes[0], (unsigned long long)sum->chunks[0],
+			(unsigned long long)sum->bytes[1], (unsigned long long)sum->chunks[1]);
+		fprintf(f, "throttled %llu ms\n", (unsigned long long)throttled);
+		if (cap_path != NULL || trace_path != NULL)
+			fprintf(f, "capture records dropped %llu\n",
+				(unsigned long long)cap_dropped);
+		if (tfo_queue > 0)
+			fprintf(f, "fast open clients %llu\n", (unsigned long long)tfo_in);
+		if (tfo_connect)
+			fprintf(f, "fast open to target: hits %llu, fallbacks %llu\n",
+				(unsigned long long)tfo_hits,
+				(unsigned long long)tfo_fallbacks);
+		if (tunnel_links > 0)
+			fprintf(f, "tunnel links up %lld of %d\n", (long long)links_up,
+				tunnel_links * nworkers);
+		if (tunnel_exit)
+			fprintf(f, "tunnel links up %lld\n", (long long)links_up);
+
+		/* the entry sends up, the exit sends down */
+		for (int d = 0; d < 2 && tunnel_zip; d++) {
+			int k = (d == 0) == (tunnel_links > 0) ? 0 : 1;
+
+			fprintf(f, "compression %s: %llu -> %llu bytes (%.1f%%), %llu sent raw, cpu %.1f ms (%.2f ns/byte)\n",
+				d == 0 ? "up" : "down",
+				(unsigned long long)zip_raw[k], (unsigned long long)zip_wire[k],
+				zip_raw[k] ? 100.0 * zip_wire[k] / zip_raw[k] : 0,
+				(unsigned long long)zip_bypass[k], zip_ns[k] / 1e6,
+				zip_raw[k] ? (double)zip_ns[k] / zip_raw[k] : 0);
+		}
+
+		hist_print(f, "connect us", &sum->connect);
+		hist_print(f, "first byte us", &sum->ttfb);
+		hist_print(f, "write blocked us", &sum->blocked);
+		hist_print(f, "chunk bytes up", &sum->chunk[0]);
+		hist_print(f, "chunk bytes down", &sum->chunk[1]);
+	}
+
+	free(sum);
 }
 
+void on_sigusr1(int sig)
+{
+	int saved = errno;
 
+	(void)sig;
+	if (write(stats_pipe[1], "", 1) == -1) {
+		/* nothing to be done about it in a signal handler */
+	}
 
-int main(int argc, char **argv)
+	errno = saved;
+}
+
+/* Serves the stats: on stderr for SIGUSR1, and to anyone connecting to
+ * the stats socket if there is one. Only reads what workers write */
+void * stats_thread(void * arg)
 {
-	int domain = AF_INET6;
-	
-	#define IS_IPV6 (domain == AF_INET6)
-	
-	int r;
-	int listen_port;
-	/* l is for listen, t is for target*/
-	int lsock, tsock;
-	struct addrinfo hints, *servinfo, *p;
-	struct sockaddr * listen_addr;
-	struct sockaddr * n_addr;
-	socklen_t listen_addrlen = sizeof(struct sockaddr_in6);
-	socklen_t n_addrlen;
-	
-	
-	
-	if (argc < 4) {
-		fprintf(stdout, "Usage: %s <listen port> <target addr> <target port> [6 or 4 for IPv6 or IPv4]\n", argv[0]);
-		return 1;
+	struct pollfd fds[2];
+	struct sockaddr_un a;
+	int nfds = 1, fd;
+	FILE * f;
+
+	(void)arg;
+
+	fds[0].fd = stats_pipe[0];
+	fds[0].events = POLLIN;
+
+	if (stats_path != NULL) {
+		fds[1].fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		fds[1].events = POLLIN;
+
+		memset(&a, 0, sizeof(a));
+		a.sun_family = AF_UNIX;
+		snprintf(a.sun_path, sizeof(a.sun_path), "%s", stats_path);
+		unlink(stats_path); /* left over from last time */
+
+		if (fds[1].fd == -1 ||
+				bind(fds[1].fd, (struct sockaddr *)&a, sizeof(a)) == -1 ||
+				listen(fds[1].fd, BACKLOG) == -1) {
+			perror("stats socket");
+		} else {
+			nfds = 2;
+		}
 	}
-	
-	/* TODO: Error handling */
-	listen_port = atoi(argv[1]);
-	
-	if (argc >= 5) {
-		if ((argv[4][0] == '4' && argv[4][1] == 0x00) ||
-			strncmp(argv[4], "ipv4", 4) == 0) {
-			
-			domain = AF_INET; /* IPv4 */
-			listen_addrlen = sizeof(struct sockaddr_in);
-			puts("Connecting via IPv4");
-			
-		} else if (!(argv[2][0] == '6' && argv[2][1] == 0x00) &&
-				strncmp(argv[2], "ipv6", 4) != 0) {
-			
-			fprintf(stderr, "I have no idea what %s is, defaulting to IPv6\n", argv[4]);
+
+	while (1) {
+		if (poll(fds, nfds, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+
+			perror("poll");
+			return NULL;
+		}
+
+		if (fds[0].revents & POLLIN) {
+			char drain[64];
+
+			while (read(stats_pipe[0], drain, sizeof(drain)) > 0);
+			stats_report(stderr);
+		}
+
+		if (nfds > 1 && (fds[1].revents & POLLIN)) {
+			fd = accept4(fds[1].fd, NULL, NULL, SOCK_CLOEXEC);
+			if (fd == -1)
+				continue;
+
+			f = fdopen(fd, "w");
+			if (f == NULL) {
+				close(fd);
+				continue;
+			}
+
+			stats_report(f);
+			fclose(f);
 		}
 	}
-	
+
+	return NULL;
+}
+
+/* Opens a listening socket on port, type is SOCK_STREAM or SOCK_DGRAM.
+ * Several of them can share the port, the kernel spreads incoming
+ * connections (or UDP clients) over them */
+int make_listener(int domain, int type, int listen_port)
+{
+	int lsock;
+	struct sockaddr * listen_addr;
+	socklen_t listen_addrlen = domain == AF_INET6 ?
+		sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
 	
 	/* Creating listen socket */
-	lsock = socket(domain, SOCK_STREAM, 0); /* TCP socket */
+	lsock = socket(domain, type | SOCK_NONBLOCK, 0);
 	
 	if (lsock == -1) {
 		perror("could not open listen socket");
-		return 1;
+		return -1;
 	}
 	
 	
@@ -95,11 +3737,14 @@ int main(int argc, char **argv)
 		 * outside this scope */
 		const socklen_t yes = 1;
 		
-		/* Make socket reusable */
+		/* Make socket reusable, and shareable between workers */
 		if (setsockopt(lsock, SOL_SOCKET, SO_REUSEADDR,
+				&yes, sizeof(yes)) < 0 ||
+				setsockopt(lsock, SOL_SOCKET, SO_REUSEPORT,
 				&yes, sizeof(yes)) < 0) {
 			perror("setsockopt");
-			return 1;
+			close(lsock);
+			return -1;
 		}
 	}
 	
@@ -128,157 +3773,362 @@ int main(int argc, char **argv)
 	
 	if (bind(lsock, listen_addr, listen_addrlen) < 0) {
 		perror("bind");
-		return 1;
+		free(listen_addr);
+		close(lsock);
+		return -1;
 	}
-	
-	r = listen(lsock, 1);
-	
-	if (r == -1) {
+
+	free(listen_addr);
+
+	if (type == SOCK_STREAM && listen(lsock, BACKLOG) == -1) {
 		perror("listen");
-		return 1;
+		close(lsock);
+		return -1;
 	}
-	
-	
-	/* Connecting to target */
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = domain;
-	hints.ai_socktype = SOCK_STREAM; /* TCP */
-	
-	r = getaddrinfo(argv[2], argv[3], &hints, &servinfo);
-	if (r != 0) {
-		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(r));
+
+	/* not fatal, clients just won't get to send data in their SYN */
+	if (type == SOCK_STREAM && tfo_queue > 0 &&
+			setsockopt(lsock, IPPROTO_TCP, TCP_FASTOPEN,
+			&tfo_queue, sizeof(tfo_queue)) == -1)
+		perror("setsockopt TCP_FASTOPEN");
+
+	return lsock;
+}
+
+
+
+int main(int argc, char **argv)
+{
+	int domain = AF_INET6;
+
+	int r, i, opt;
+	int listen_port;
+	int pin = 0;
+	int pipefd[2];
+	pthread_t dns_tid, stats_tid, cap_tid;
+	cpu_set_t cpus;
+
+
+	while ((opt = getopt(argc, argv, "d:t:c:n:w:Ps:qui:m:r:I:G:B:S:C:Z:R:T:Xz:F:f")) != -1) {
+		switch (opt) {
+			case 'd': /* happy eyeballs attempt delay */
+				attempt_delay = atoi(optarg);
+				break;
+
+			case 't': /* per attempt timeout */
+				attempt_timeout = atoi(optarg);
+				break;
+
+			case 'c': /* TTL for names without one */
+				dns_ttl = atoi(optarg);
+				break;
+
+			case 'n': /* negative caching TTL */
+				dns_neg_ttl = atoi(optarg);
+				break;
+
+			case 'w': /* number of relay threads */
+				nworkers = atoi(optarg);
+				if (nworkers < 1 || nworkers > MAX_WORKERS) {
+					fprintf(stderr, "Can do 1 to %d workers\n", MAX_WORKERS);
+					return 1;
+				}
+				break;
+
+			case 'P': /* pin workers to CPUs */
+				pin = 1;
+				break;
+
+			case 's': /* spare target connections per worker */
+				n_spares = atoi(optarg);
+				if (n_spares < 0 || n_spares > MAX_SPARES) {
+					fprintf(stderr, "Can keep 0 to %d spares\n", MAX_SPARES);
+					return 1;
+				}
+				break;
+
+			case 'q': /* don't dump the traffic */
+				quiet = 1;
+				break;
+
+			case 'u': /* relay UDP */
+				udp_mode = 1;
+				break;
+
+			case 'i': /* UDP session idle timeout */
+				udp_idle = atoi(optarg) * 1000;
+				break;
+
+			case 'm': /* max UDP sessions per worker */
+				udp_max_sessions = atoi(optarg);
+				if (udp_max_sessions < 1) {
+					fprintf(stderr, "Need room for at least 1 session\n");
+					return 1;
+				}
+				break;
+
+			case 'r': /* bytes/s per connection */
+				conn_rate = parse_bytes(optarg);
+				break;
+
+			case 'I': /* bytes/s per client IP */
+				ip_rate = parse_bytes(optarg);
+				break;
+
+			case 'G': /* bytes/s for everything together */
+				global_rate = parse_bytes(optarg);
+				break;
+
+			case 'B': /* token bucket size */
+				shape_burst = parse_bytes(optarg);
+				break;
+
+			case 'S': /* unix socket to serve stats on */
+				stats_path = optarg;
+				break;
+
+			case 'C': /* pcapng file to capture the traffic in */
+				cap_path = optarg;
+				break;
+
+			case 'R': /* trace to replay with tpreplay */
+				trace_path = optarg;
+				break;
+
+			case 'Z': /* capture file size to rotate at, 0 is never */
+				cap_rotate_size = parse_bytes(optarg);
+				break;
+
+			case 'T': /* tunnel entry, links per worker to the exit */
+				tunnel_links = atoi(optarg);
+				if (tunnel_links < 1 || tunnel_links > MAX_LINKS) {
+					fprintf(stderr, "Can do 1 to %d links\n", MAX_LINKS);
+					return 1;
+				}
+				break;
+
+			case 'X': /* tunnel exit */
+				tunnel_exit = 1;
+				break;
+
+			case 'F': /* fast open queue on the listener */
+				tfo_queue = atoi(optarg);
+				break;
+
+			case 'f': /* fast open to the target */
+				tfo_connect = 1;
+				break;
+
+			case 'z': /* deflate level for tunnel links */
+				tunnel_zip = atoi(optarg);
+				if (tunnel_zip < 1 || tunnel_zip > 9) {
+					fprintf(stderr, "Deflate levels go from 1 to 9\n");
+					return 1;
+				}
+				break;
+
+			default:
+				argc = 0; /* print usage */
+				break;
+		}
+	}
+
+	argv += optind - 1;
+	argc -= optind - 1;
+
+	if (argc < 4) {
+		fprintf(stdout, "Usage: %s [-d attempt delay ms] [-t attempt timeout ms] [-c default dns ttl s] [-n negative dns ttl s] [-w workers] [-P(in workers to cpus)] [-s spare connections per worker] [-q(uiet)] [-u(dp) [-i udp idle timeout s] [-m max udp sessions per worker]] [-r rate per connection] [-I rate per client ip] [-G global rate] [-B burst] [-S stats socket path] [-C capture file [-Z rotate size]] [-R trace file] [-T tunnel links | -X(tunnel exit) [-z deflate level]] [-F fast open queue] [-f(ast open to target)] <listen port> <target addr> <target port> [6 or 4 for IPv6 or IPv4]\n", argv[0]);
 		return 1;
 	}
-	
-	/* loop through possible socket candidates */
-	for (p = servinfo; p != NULL; p = p->ai_next) {
-		
-		tsock = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
-		if (tsock == -1)
-			continue;
-		
-		if (connect(tsock, p->ai_addr, p->ai_addrlen) == -1)
-		{
-			perror("connect");
-			close(tsock);
-			continue;
+
+	/* TODO: Error handling */
+	listen_port = atoi(argv[1]);
+	target_host = argv[2];
+	target_port = argv[3];
+
+	if (argc >= 5) {
+		if ((argv[4][0] == '4' && argv[4][1] == 0x00) ||
+			strncmp(argv[4], "ipv4", 4) == 0) {
+
+			domain = AF_INET; /* IPv4 */
+			target_family = AF_INET;
+			puts("Connecting via IPv4");
+
+		} else if ((argv[4][0] == '6' && argv[4][1] == 0x00) ||
+				strncmp(argv[4], "ipv6", 4) == 0) {
+
+			target_family = AF_INET6;
+
+		} else {
+			fprintf(stderr, "I have no idea what %s is, defaulting to IPv6\n", argv[4]);
 		}
-		
-		break;
 	}
-	
-	if (p == NULL) {
-		fprintf(stderr, "All attempts to connect to target host have failed\n");
+
+	if ((tunnel_links > 0 || tunnel_exit) &&
+			(udp_mode || (tunnel_links > 0 && tunnel_exit))) {
+		fprintf(stderr, "A tunnel has one entry and one exit, and carries TCP\n");
 		return 1;
 	}
-	
-	puts("Connected! Listening...");
-	
-	/* TODO: SOCK NONBLOCK */
-	
-	n_addrlen = p->ai_addrlen;
-	n_addr = malloc(p->ai_addrlen);
-	
-	int nsock = accept(lsock, n_addr, &n_addrlen);
-	
-	if (nsock == -1) {
-		perror("accept");
+
+	if (tunnel_zip && tunnel_links == 0 && !tunnel_exit) {
+		fprintf(stderr, "-z only works on tunnels\n");
 		return 1;
 	}
-	
-	/* pretty print the addresses */
-	int ntop_buf_len = IS_IPV6 ? INET6_ADDRSTRLEN : INET_ADDRSTRLEN;
-	
-	/* instead of creating two strings, create one and put both in there */
-	char * ntop_buf = malloc(ntop_buf_len * 2);
-	
-	/* took me a longer time I would like to admit to resolve a segfault,
-	 * turns out you have to initialize n_addr during accept yourself... */
-	if (inet_ntop(domain, getinaddr(n_addr), ntop_buf, ntop_buf_len) == NULL ||
-			inet_ntop(domain, getinaddr(p->ai_addr),
-			(ntop_buf + ntop_buf_len), ntop_buf_len) == NULL) {
-		perror("inet_ntop");
-	} else {
-		printf("%s <-> %s\n", ntop_buf, (ntop_buf + ntop_buf_len));
+
+	if ((tunnel_links > 0 || tunnel_exit) && n_spares > 0) {
+		fprintf(stderr, "Tunnels don't use spare connections, ignoring -s\n");
+		n_spares = 0;
 	}
-	
-	free(ntop_buf);
-	
-	
-	
-	/* the magic number 2 is the length of the fd list, if you see the
-	 * magic number 2 than it is the length of this array */
-	struct pollfd fds[2];
-	
-	fds[0].fd = nsock;
-	fds[0].events = POLLIN;
-	
-	fds[1].fd = tsock;
-	fds[1].events = POLLIN;
-	
-	int b;
-	uint8_t buf[BUF_LEN];
-	
-	
-	while (1)
-	{
-		r = poll(fds, 2, -1);
-		if (r < 0)
-		{
-			/* EINTR is interrupt, non-fatal error, try again */
-			if (errno == EINTR)
-				continue;
-			
-			perror("poll");
-			return 1;
-		}
-		
-		if (r == 0) continue;
-		
-		for (int i = 0; i < 2; i++) {
-			
-			/* no data? skip */
-			if (!(fds[i].revents & POLLIN)) continue;
-			
-			memset(&buf, 0, BUF_LEN);
-			
-			/* -1 because of terminating 0 byte */
-			b = recv(fds[i].fd, (void *)&buf, BUF_LEN - 1, 0);
-			
-			if (b < 0) {
-				perror("recv");
+
+	if (udp_mode) {
+		/* every session is a socket, so the table is only as big as
+		 * the files we may open; go as high as we are allowed to */
+		struct rlimit files;
+		rlim_t room;
+
+		if (getrlimit(RLIMIT_NOFILE, &files) == 0) {
+			if (files.rlim_cur < files.rlim_max) {
+				files.rlim_cur = files.rlim_max;
+				if (setrlimit(RLIMIT_NOFILE, &files) == -1)
+					getrlimit(RLIMIT_NOFILE, &files);
+			}
+
+			room = files.rlim_cur > UDP_SPARE_FILES ?
+				(files.rlim_cur - UDP_SPARE_FILES) / nworkers : 0;
+			if (room < 1) {
+				fprintf(stderr, "Too few files to open for a UDP session (ulimit -n)\n");
 				return 1;
 			}
-			else if (b == 0) {
-				/* EOF */
-				printf("EOF(probably connection %d closed), bye\n", i);
-				
-				goto quit; /* hah i am using goto anyways */
-			}
-			
-			/* TODO: specify IP address */
-			printf("message from %d: length %d\n", i, b);
-			
-			puts((const char*)buf);
-			
-			
-			/* send the data to the next socket */
-			b = send(fds[(i + 1) % 2].fd, &buf, b, 0);
-			
-			if (b < 0) {
-				perror("send");
+			if ((rlim_t)udp_max_sessions > room) {
+				fprintf(stderr, "Room for %llu UDP sessions per worker (ulimit -n)\n",
+					(unsigned long long)room);
+				udp_max_sessions = room;
+			}
+		}
+	}
+
+	workers = malloc(nworkers * sizeof(struct Worker));
+	memset(workers, 0, nworkers * sizeof(struct Worker));
+
+	if (pin && sched_getaffinity(0, sizeof(cpus), &cpus) == -1) {
+		perror("sched_getaffinity");
+		pin = 0;
+	}
+
+	for (i = 0; i < nworkers; i++) {
+		struct Worker * w = &workers[i];
+
+		w->id = i;
+		w->cpu = -1;
+
+		if (pin) {
+			/* the i-th CPU we are allowed on, wrapping around */
+			int n = i % CPU_COUNT(&cpus);
+
+			for (w->cpu = 0; ; w->cpu++) {
+				if (CPU_ISSET(w->cpu, &cpus) && n-- == 0)
+					break;
+			}
+		}
+
+		w->lsock = make_listener(domain,
+			udp_mode ? SOCK_DGRAM : SOCK_STREAM, listen_port);
+		if (w->lsock == -1)
+			return 1;
+
+		/* every worker gets its own pipe to hear from the resolver */
+		if (pipe2(pipefd, O_NONBLOCK | O_CLOEXEC) == -1) {
+			perror("pipe");
+			return 1;
+		}
+
+		w->notify = pipefd[0];
+		resolver.notify[resolver.nnotify++] = pipefd[1];
+
+		if ((cap_path != NULL || trace_path != NULL) && !udp_mode) {
+			w->ring = aligned_alloc(64, sizeof(struct Ring));
+			if (w->ring == NULL) {
+				perror("malloc");
 				return 1;
 			}
+			memset(w->ring, 0, offsetof(struct Ring, data));
 		}
 	}
-	
-quit:
-	close(nsock);
-	close(tsock);
-	close(lsock);
-	freeaddrinfo(p);
-	free(listen_addr);
-	free(n_addr);
+
+	if ((cap_path != NULL || trace_path != NULL) && udp_mode) {
+		fprintf(stderr, "Can only capture TCP\n");
+		cap_path = trace_path = NULL;
+	}
+
+	if (cap_path != NULL || trace_path != NULL) {
+		struct CapWriter * cw = calloc(1, sizeof(struct CapWriter));
+
+		cap_wake = eventfd(0, EFD_CLOEXEC);
+		if (cap_wake == -1) {
+			perror("eventfd");
+			return 1;
+		}
+
+		r = pthread_create(&cap_tid, NULL, cap_thread, cw);
+		if (r != 0) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(r));
+			return 1;
+		}
+	}
+
+
+	/* stats, on yet another thread */
+	if (pipe2(stats_pipe, O_NONBLOCK | O_CLOEXEC) == -1) {
+		perror("pipe");
+		return 1;
+	}
+
+	r = pthread_create(&stats_tid, NULL, stats_thread, NULL);
+	if (r != 0) {
+		fprintf(stderr, "pthread_create: %s\n", strerror(r));
+		return 1;
+	}
+
+	{
+		struct sigaction sa;
+
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = on_sigusr1;
+		sa.sa_flags = SA_RESTART;
+		sigaction(SIGUSR1, &sa, NULL);
+	}
+
+	/* Resolving target, on a separate thread */
+	r = pthread_create(&dns_tid, NULL, dns_thread, &resolver);
+	if (r != 0) {
+		fprintf(stderr, "pthread_create: %s\n", strerror(r));
+		return 1;
+	}
+
+	/* get the cache going before the first client shows up */
+	dns_lookup(&resolver, target_host, target_port, NULL, NULL, NULL,
+		now_ms());
+
+	for (i = 0; i < nworkers; i++) {
+		r = pthread_create(&workers[i].tid, NULL,
+			udp_mode ? udp_worker_run : worker_run, &workers[i]);
+		if (r != 0) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(r));
+			return 1;
+		}
+	}
+
+	printf("Listening with %d worker%s...\n", nworkers,
+		nworkers == 1 ? "" : "s");
+	fflush(stdout);
+
+	for (i = 0; i < nworkers; i++) {
+		pthread_join(workers[i].tid, NULL);
+		close(workers[i].lsock);
+		close(workers[i].notify);
+	}
+
+	free(workers);
 	
 	return 0;
 }
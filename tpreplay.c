@@ -0,0 +1,759 @@
+/*
+ * tpreplay.c - Plays a trace recorded with tcpproxy -R back through a
+ *              tcpproxy, to see if a change made it faster or slower
+ *
+ * usage: tpreplay [-x path to tcpproxy | -p proxy port] [-a proxy args]
+ *                 [-s speed] [-c max sessions] trace
+ *
+ * Starts tcpproxy (with -a added to its arguments) in front of a sink
+ * of our own, and plays every session of the trace against it: the
+ * client end sends what the client sent, the sink end what the target
+ * sent, with the same sizes and the same timing. The data itself was
+ * never recorded, it is made up. A chunk is only sent once everything
+ * the other end sent before it has arrived, so request/response
+ * traffic stays that even at higher speeds.
+ *
+ * -s 1 replays in real time, -s 10 ten times faster and -s 0 as fast
+ * as it goes. With -p the proxy is one you started yourself, pointing
+ * at 127.0.0.1 SINK_PORT; then there are no CPU numbers.
+ *
+ * At the end it says how many bytes went through how fast, how long a
+ * chunk took from being sent at one end to arriving at the other, and
+ * how much CPU the proxy used for it.
+ *
+ * compile with: cc tpreplay.c -o tpreplay
+ *
+ * CC0/Public domain
+ */
+
+/* for accept4() */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/resource.h> /* wait4 */
+#include <netinet/in.h>
+#include <netinet/tcp.h> /* TCP_NODELAY */
+#include <arpa/inet.h>
+
+#include "hist.h"
+
+#define PROXY_PORT 19910
+#define SINK_PORT 19911
+#define MAX_ARGS 32
+#define MAX_SESSIONS 1000 /* at the same time, by default */
+#define PATTERN_LEN 65536
+
+#define TRACE_MAGIC "TPTRACE1"
+
+/* trace record types, as tcpproxy writes them */
+#define T_OPEN 0
+#define T_DATA 1
+#define T_FIN 2
+#define T_CLOSE 3
+
+struct Event
+{
+	int64_t t; /* us since the start of the trace */
+	uint8_t type;
+	uint8_t dir; /* 0 is client to target */
+	uint32_t len;
+};
+
+/* a chunk on its way, to time it */
+struct Mark
+{
+	uint64_t end; /* stream offset of its last byte */
+	int64_t sent; /* us, when that went out, 0 if it hasn't */
+};
+
+#define S_WAITING 0
+#define S_RUNNING 1
+#define S_DONE 2
+
+/* A session of the trace. Direction d is sent on fd[d] and arrives on
+ * fd[1 - d]: 0 is the client end, 1 the sink end */
+struct Session
+{
+	int64_t open; /* us since the start of the trace */
+	struct Event * ev;
+	int nev, ev_len;
+
+	int state;
+	int next; /* event to fire next */
+	int fd[2]; /* fd[1] is -1 until the sink knows who it is */
+	int connected;
+	int id_left; /* bytes of our id still to send, so the sink knows */
+
+	uint64_t queued[2]; /* still to be sent */
+	uint64_t sent[2], rcvd[2];
+	char fin[2]; /* shut down direction d once it's all sent */
+	char shut[2];
+	char eof[2]; /* direction d arrived completely */
+
+	struct Mark * marks[2];
+	int nmarks[2], marks_len[2];
+	int wmark[2], rmark[2]; /* next mark to be sent, to arrive */
+};
+
+/* a connection to the sink that hasn't said which session it is */
+struct Pending
+{
+	int fd;
+	uint8_t id[4];
+	int got;
+};
+
+struct Session * sessions;
+int nsessions;
+struct Pending * pending;
+int npending, pending_len;
+struct Hist lat;
+uint8_t pattern[PATTERN_LEN];
+uint8_t scratch[PATTERN_LEN];
+
+/* prints msg, with error details, and exits */
+void ferr(const char * msg)
+{
+	perror(msg);
+	exit(EXIT_FAILURE);
+}
+
+int64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int get_varint(FILE * f, uint64_t * v)
+{
+	int c, shift = 0;
+
+	*v = 0;
+
+	do {
+		c = fgetc(f);
+		if (c == EOF || shift > 63)
+			return -1;
+
+		*v |= (uint64_t)(c & 0x7f) << shift;
+		shift += 7;
+	} while (c & 0x80);
+
+	return 0;
+}
+
+/* Reads the trace into sessions. Returns -1 if it isn't one */
+int load_trace(const char * path)
+{
+	FILE * f = fopen(path, "r");
+	char magic[sizeof(TRACE_MAGIC) - 1];
+	int c, sessions_len = 0;
+	uint64_t delta, id, len;
+	int64_t t = 0;
+	struct Session * s;
+	struct Event * e;
+
+	if (f == NULL)
+		ferr(path);
+
+	if (fread(magic, sizeof(magic), 1, f) != 1 ||
+			memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0) {
+		fprintf(stderr, "%s is not a tcpproxy trace\n", path);
+		return -1;
+	}
+
+	while ((c = fgetc(f)) != EOF) {
+		len = 0;
+
+		if (get_varint(f, &delta) == -1 || get_varint(f, &id) == -1 ||
+				((c & 3) == T_DATA && get_varint(f, &len) == -1)) {
+			fprintf(stderr, "%s is cut short, using what's there\n", path);
+			break;
+		}
+
+		t += delta;
+
+		/* sessions are numbered in the order they opened */
+		if ((c & 3) == T_OPEN) {
+			if (id != (uint64_t)nsessions)
+				continue;
+
+			if (nsessions == sessions_len) {
+				sessions_len = sessions_len ? sessions_len * 2 : 64;
+				sessions = realloc(sessions,
+					sessions_len * sizeof(struct Session));
+			}
+
+			s = &sessions[nsessions++];
+			memset(s, 0, sizeof(*s));
+			s->open = t;
+			s->fd[0] = s->fd[1] = -1;
+			continue;
+		}
+
+		if (id >= (uint64_t)nsessions)
+			continue; /* its open got dropped while recording */
+
+		s = &sessions[id];
+
+		if (s->nev == s->ev_len) {
+			s->ev_len = s->ev_len ? s->ev_len * 2 : 8;
+			s->ev = realloc(s->ev, s->ev_len * sizeof(struct Event));
+		}
+
+		e = &s->ev[s->nev++];
+		e->t = t;
+		e->type = c & 3;
+		e->dir = (c >> 2) & 1;
+		e->len = len;
+	}
+
+	fclose(f);
+
+	return 0;
+}
+
+/* so Nagle doesn't end up in the latencies, the proxy is what we time */
+void nodelay(int fd)
+{
+	const int yes = 1;
+
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+}
+
+int connect_to(int port, int nonblock)
+{
+	struct sockaddr_in a;
+	int fd = socket(AF_INET, SOCK_STREAM | (nonblock ? SOCK_NONBLOCK : 0), 0);
+
+	if (fd == -1)
+		ferr("socket");
+
+	nodelay(fd);
+
+	memset(&a, 0, sizeof(a));
+	a.sin_family = AF_INET;
+	a.sin_port = htons(port);
+	a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if (connect(fd, (struct sockaddr *)&a, sizeof(a)) == -1 &&
+			errno != EINPROGRESS) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+int listen_on(int port)
+{
+	struct sockaddr_in a;
+	const int yes = 1;
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+
+	if (fd == -1)
+		ferr("socket");
+
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+	memset(&a, 0, sizeof(a));
+	a.sin_family = AF_INET;
+	a.sin_port = htons(port);
+	a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if (bind(fd, (struct sockaddr *)&a, sizeof(a)) == -1)
+		ferr("bind");
+	if (listen(fd, 1024) == -1)
+		ferr("listen");
+
+	return fd;
+}
+
+/* runs tcpproxy in front of the sink, with extra arguments */
+pid_t start_proxy(const char * path, char * extra)
+{
+	char * argv[MAX_ARGS + 8];
+	char lport[16], tport[16];
+	int argc = 0;
+	pid_t pid;
+
+	snprintf(lport, sizeof(lport), "%d", PROXY_PORT);
+	snprintf(tport, sizeof(tport), "%d", SINK_PORT);
+
+	argv[argc++] = (char *)path;
+	argv[argc++] = "-q";
+
+	for (char * a = strtok(extra, " "); a != NULL && argc < MAX_ARGS;
+			a = strtok(NULL, " "))
+		argv[argc++] = a;
+
+	argv[argc++] = lport;
+	argv[argc++] = "127.0.0.1";
+	argv[argc++] = tport;
+	argv[argc++] = "4";
+	argv[argc] = NULL;
+
+	/* or the child prints our buffered output too */
+	fflush(stdout);
+
+	pid = fork();
+	if (pid < 0)
+		ferr("fork");
+
+	if (pid == 0) {
+		freopen("/dev/null", "w", stdout);
+		execv(path, argv);
+		ferr("exec tcpproxy");
+	}
+
+	return pid;
+}
+
+/* queues up len bytes of direction d, to be timed */
+void add_mark(struct Session * s, int d, uint32_t len)
+{
+	struct Mark * m;
+
+	if (s->nmarks[d] == s->marks_len[d]) {
+		s->marks_len[d] = s->marks_len[d] ? s->marks_len[d] * 2 : 8;
+		s->marks[d] = realloc(s->marks[d],
+			s->marks_len[d] * sizeof(struct Mark));
+	}
+
+	m = &s->marks[d][s->nmarks[d]++];
+	m->end = s->sent[d] + s->queued[d] + len;
+	m->sent = 0;
+
+	s->queued[d] += len;
+}
+
+/* Fires the events of s that are due. Returns when the next one is,
+ * in us since start, or -1 if it waits for something else */
+int64_t fire_events(struct Session * s, int64_t elapsed, double speed)
+{
+	struct Event * e;
+	int64_t due;
+	int o;
+
+	while (s->next < s->nev) {
+		e = &s->ev[s->next];
+		o = 1 - e->dir;
+
+		/* what the other end said before this must have arrived */
+		if (s->queued[o] > 0 || s->rcvd[o] < s->sent[o])
+			return -1;
+
+		if (e->dir == 1 && s->fd[1] == -1)
+			return -1;
+
+		due = speed > 0 ? (int64_t)((e->t - sessions[0].open) / speed) : 0;
+		if (due > elapsed)
+			return due;
+
+		switch (e->type) {
+			case T_DATA:
+				add_mark(s, e->dir, e->len);
+				break;
+
+			case T_FIN:
+				s->fin[e->dir] = 1;
+				break;
+
+			case T_CLOSE:
+				s->fin[0] = s->fin[1] = 1;
+				break;
+		}
+
+		s->next++;
+	}
+
+	return -1;
+}
+
+/* sends what s has queued for direction d */
+int session_send(struct Session * s, int d, int64_t now)
+{
+	ssize_t b;
+	size_t n;
+
+	if (d == 0 && s->id_left > 0) {
+		uint8_t id[4];
+		int i = s - sessions;
+
+		id[0] = i >> 24; id[1] = i >> 16; id[2] = i >> 8; id[3] = i;
+
+		b = send(s->fd[0], id + 4 - s->id_left, s->id_left, MSG_NOSIGNAL);
+		if (b < 0)
+			return errno == EAGAIN ? 0 : -1;
+
+		s->id_left -= b;
+		if (s->id_left > 0)
+			return 0;
+	}
+
+	while (s->queued[d] > 0) {
+		n = s->queued[d] < PATTERN_LEN ? s->queued[d] : PATTERN_LEN;
+
+		b = send(s->fd[d], pattern, n, MSG_NOSIGNAL);
+		if (b < 0)
+			return errno == EAGAIN ? 0 : -1;
+
+		s->queued[d] -= b;
+		s->sent[d] += b;
+
+		while (s->wmark[d] < s->nmarks[d] &&
+				s->marks[d][s->wmark[d]].end <= s->sent[d])
+			s->marks[d][s->wmark[d]++].sent = now;
+	}
+
+	if (s->fin[d] && !s->shut[d]) {
+		shutdown(s->fd[d], SHUT_WR);
+		s->shut[d] = 1;
+	}
+
+	return 0;
+}
+
+/* takes in what arrived for direction d */
+int session_recv(struct Session * s, int d, int64_t now)
+{
+	ssize_t b = recv(s->fd[1 - d], scratch, sizeof(scratch), 0);
+
+	if (b < 0)
+		return errno == EAGAIN ? 0 : -1;
+
+	if (b == 0) {
+		s->eof[d] = 1;
+		return 0;
+	}
+
+	s->rcvd[d] += b;
+
+	while (s->rmark[d] < s->wmark[d] &&
+			s->marks[d][s->rmark[d]].end <= s->rcvd[d]) {
+		hist_add(&lat, now - s->marks[d][s->rmark[d]].sent);
+		s->rmark[d]++;
+	}
+
+	return 0;
+}
+
+/* all events played, everything arrived */
+int session_done(struct Session * s)
+{
+	for (int d = 0; d < 2; d++) {
+		if (s->queued[d] > 0 || s->rcvd[d] < s->sent[d])
+			return 0;
+		if (s->fin[d] && !s->eof[d])
+			return 0;
+	}
+
+	/* the sink end must be there too, or it would show up late */
+	return s->next == s->nev && s->id_left == 0 && s->fd[1] != -1;
+}
+
+void session_close(struct Session * s)
+{
+	for (int d = 0; d < 2; d++) {
+		if (s->fd[d] != -1)
+			close(s->fd[d]);
+		s->fd[d] = -1;
+		free(s->marks[d]);
+		s->marks[d] = NULL;
+	}
+
+	s->state = S_DONE;
+}
+
+/* reads the session id off a new sink connection */
+void pending_read(struct Pending * p)
+{
+	ssize_t b = recv(p->fd, p->id + p->got, 4 - p->got, 0);
+	uint32_t i;
+
+	if (b < 0 && errno == EAGAIN)
+		return;
+
+	if (b <= 0) {
+		close(p->fd); /* tcpproxy checking if we're there, probably */
+		p->fd = -1;
+		return;
+	}
+
+	p->got += b;
+	if (p->got < 4)
+		return;
+
+	i = (uint32_t)p->id[0] << 24 | p->id[1] << 16 | p->id[2] << 8 | p->id[3];
+
+	if (i >= (uint32_t)nsessions || sessions[i].state != S_RUNNING ||
+			sessions[i].fd[1] != -1) {
+		fprintf(stderr, "Sink got a connection for session %u?\n", i);
+		close(p->fd);
+	} else {
+		sessions[i].fd[1] = p->fd;
+	}
+
+	p->fd = -1;
+}
+
+int main(int argc, char **argv)
+{
+	const char * path = "./tcpproxy";
+	char extra[256] = "";
+	int port = 0, max_active = MAX_SESSIONS;
+	double speed = 1;
+	int opt, lsock, fd, nfds, active = 0, next_open = 0, done = 0;
+	int failed = 0, timeout;
+	struct pollfd * fds;
+	int64_t start, elapsed, wake, due;
+	uint64_t bytes[2] = { 0, 0 };
+	double cpu, secs;
+	pid_t pid = -1;
+	struct Session * s;
+	struct rusage ru;
+
+	while ((opt = getopt(argc, argv, "x:p:a:s:c:")) != -1) {
+		switch (opt) {
+			case 'x': path = optarg; break;
+			case 'p': port = atoi(optarg); break;
+			case 'a': snprintf(extra, sizeof(extra), "%s", optarg); break;
+			case 's': speed = atof(optarg); break;
+			case 'c': max_active = atoi(optarg); break;
+			default:
+				argc = 0;
+		}
+	}
+
+	if (optind >= argc || max_active < 1) {
+		fprintf(stderr, "Usage: %s [-x path to tcpproxy | -p proxy port] [-a proxy args] [-s speed, 0 is max] [-c max sessions] trace\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (load_trace(argv[optind]) == -1)
+		return EXIT_FAILURE;
+
+	if (nsessions == 0) {
+		fprintf(stderr, "No sessions in the trace\n");
+		return EXIT_FAILURE;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	/* made up data that doesn't compress */
+	for (uint32_t i = 0, x = 2463534242u; i < PATTERN_LEN; i++) {
+		x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+		pattern[i] = x;
+	}
+
+	lsock = listen_on(SINK_PORT);
+
+	if (port == 0) {
+		pid = start_proxy(path, extra);
+		port = PROXY_PORT;
+
+		/* wait for it to listen */
+		for (int tries = 0; (fd = connect_to(port, 0)) == -1; tries++) {
+			if (tries == 100)
+				ferr("connect to proxy");
+			usleep(20000);
+		}
+		close(fd);
+	}
+
+	/* two per session, the pending ones and the listener */
+	fds = malloc((2 * nsessions + 1) * sizeof(struct pollfd) +
+		MAX_SESSIONS * sizeof(struct pollfd));
+	pending_len = MAX_SESSIONS;
+	pending = malloc(pending_len * sizeof(struct Pending));
+
+	start = now_us();
+
+	while (done < nsessions) {
+		elapsed = now_us() - start;
+		wake = -1;
+
+		/* sessions open in trace order, as long as there is room */
+		while (next_open < nsessions && active < max_active) {
+			s = &sessions[next_open];
+			due = speed > 0 ? (int64_t)((s->open - sessions[0].open) / speed) : 0;
+
+			if (due > elapsed) {
+				wake = due;
+				break;
+			}
+
+			s->fd[0] = connect_to(port, 1);
+			if (s->fd[0] == -1) {
+				failed++;
+				done++;
+				s->state = S_DONE;
+			} else {
+				s->state = S_RUNNING;
+				s->id_left = 4;
+				active++;
+			}
+
+			next_open++;
+		}
+
+		/* build the pollfd list, pfd 0 is the sink listener */
+		fds[0].fd = lsock;
+		fds[0].events = POLLIN;
+		nfds = 1;
+
+		for (int i = 0; i < npending; i++) {
+			fds[nfds].fd = pending[i].fd;
+			fds[nfds].events = POLLIN;
+			nfds++;
+		}
+
+		for (int i = 0; i < next_open; i++) {
+			s = &sessions[i];
+			if (s->state != S_RUNNING)
+				continue;
+
+			if (s->connected) {
+				due = fire_events(s, elapsed, speed);
+				if (due != -1 && (wake == -1 || due < wake))
+					wake = due;
+			}
+
+			for (int d = 0; d < 2; d++) {
+				fds[nfds].fd = s->fd[d];
+				fds[nfds].events = POLLIN;
+
+				if (!s->connected || s->queued[d] > 0 ||
+						(s->fin[d] && !s->shut[d]) || (d == 0 && s->id_left))
+					fds[nfds].events |= POLLOUT;
+				nfds++;
+			}
+		}
+
+		timeout = -1;
+		if (wake != -1)
+			timeout = wake > elapsed ? (int)((wake - elapsed + 999) / 1000) : 0;
+
+		if (poll(fds, nfds, timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+			ferr("poll");
+		}
+
+		int64_t now = now_us();
+
+		/* same order as when building the list */
+		nfds = 1;
+		for (int i = 0; i < npending; i++) {
+			if (fds[nfds++].revents)
+				pending_read(&pending[i]);
+		}
+
+		for (int i = 0; i < next_open; i++) {
+			s = &sessions[i];
+			if (s->state != S_RUNNING)
+				continue;
+
+			int r = 0;
+
+			for (int d = 0; d < 2 && r == 0; d++) {
+				short rev = fds[nfds + d].revents;
+
+				/* fd[1] may have shown up in the meantime */
+				if (s->fd[d] == -1)
+					continue;
+
+				if (d == 0 && !s->connected && (rev & (POLLOUT | POLLERR | POLLHUP))) {
+					int err = 0;
+					socklen_t len = sizeof(err);
+
+					getsockopt(s->fd[0], SOL_SOCKET, SO_ERROR, &err, &len);
+					if (err != 0) {
+						r = -1;
+						break;
+					}
+					s->connected = 1;
+				}
+
+				if (rev & (POLLIN | POLLERR | POLLHUP))
+					r = session_recv(s, 1 - d, now);
+
+				if (r == 0 && s->connected)
+					r = session_send(s, d, now);
+			}
+
+			nfds += 2;
+
+			if (r == -1) {
+				failed++;
+			} else if (!session_done(s)) {
+				continue;
+			}
+
+			bytes[0] += s->rcvd[0];
+			bytes[1] += s->rcvd[1];
+			session_close(s);
+			active--;
+			done++;
+		}
+
+		/* drop the pending entries that found their session */
+		for (int i = 0; i < npending; i++) {
+			if (pending[i].fd == -1)
+				pending[i--] = pending[--npending];
+		}
+
+		if (fds[0].revents & POLLIN) {
+			while (npending < pending_len &&
+					(fd = accept4(lsock, NULL, NULL, SOCK_NONBLOCK)) != -1) {
+				nodelay(fd);
+				pending[npending].fd = fd;
+				pending[npending].got = 0;
+				npending++;
+			}
+		}
+	}
+
+	secs = (now_us() - start) / 1e6;
+
+	printf("sessions %d (%d failed), up %.1f MB, down %.1f MB in %.2f s: %.1f MB/s\n",
+		nsessions, failed, bytes[0] / 1e6, bytes[1] / 1e6, secs,
+		(bytes[0] + bytes[1]) / 1e6 / secs);
+	printf("chunk latency us: n %llu p50 %llu p90 %llu p99 %llu p99.9 %llu max %llu\n",
+		(unsigned long long)lat.n,
+		(unsigned long long)hist_quantile(&lat, 0.5),
+		(unsigned long long)hist_quantile(&lat, 0.9),
+		(unsigned long long)hist_quantile(&lat, 0.99),
+		(unsigned long long)hist_quantile(&lat, 0.999),
+		(unsigned long long)lat.max);
+
+	if (pid != -1) {
+		/* all it did was start up and relay for us */
+		kill(pid, SIGTERM);
+		wait4(pid, NULL, 0, &ru);
+
+		cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+			ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+		printf("proxy cpu %.3f s, %.2f s/GB\n", cpu,
+			bytes[0] + bytes[1] ? cpu / ((bytes[0] + bytes[1]) / 1e9) : 0);
+	}
+
+	close(lsock);
+
+	return failed > 0 ? EXIT_FAILURE : 0;
+}